@@ -0,0 +1,149 @@
+#ifndef _AGGREGATOR_H_
+#define _AGGREGATOR_H_
+
+#include <Arduino.h>
+#include <map>
+#include "config.h"
+#include "packet_t.h"
+
+/**
+ * @brief One row of INFLUX_AGGREGATION in config.h.
+ */
+
+struct AggregationConfig {
+    const char* data_source;
+    const char* data_name;
+    uint8_t window_minutes;     // 1, 5, 15 ...
+    bool also_raw;              // true to send every value too
+};
+
+/**
+ * @brief All of the values of one datapoint in one window.
+ */
+
+struct AggregateWindow {
+    String data_source;
+    String data_name;
+    uint32_t window_ms = 0;         // 0 if the datapoint isn't aggregated
+    bool also_raw = false;
+    uint32_t window_start_ms = 0;
+    uint32_t count = 0;
+    float min = 0;
+    float max = 0;
+    double sum = 0;
+    float last = 0;
+    int16_t alarm_code = 0;         // the highest alarm_code in the window
+    int8_t RSSI = 0;                // of the last value
+    int8_t SNR = 0;
+};
+
+typedef bool (*aggregate_sender_t)(void* context, const AggregateWindow& window);
+
+/**
+ * @brief Aggregator turns the values of a chatty datapoint into one InfluxDB point per window,
+ * with the min, max, mean, count and last value of the window, so Grafana still shows the
+ * extremes with a fraction of the writes. Windows are aligned to multiples of their length
+ * (since boot), by the timestamp of each value. A window is sent the first time flush() is
+ * called after it ends, or when a value for a later window comes in, whichever is first.
+ * Only the datapoints in INFLUX_AGGREGATION are aggregated - every other value is sent as it is.
+ *
+ * It's used only by the task that reads the influx queue, so it has no mutex.
+ */
+
+class Aggregator {
+
+private:
+    std::map<String, AggregateWindow> windows_;   // keyed by unique_id
+
+    static AggregateWindow configure(const Packet_t& packet) {
+        AggregateWindow window;
+        window.data_source = packet.data_source;
+        window.data_name = packet.data_name;
+#ifdef INFLUX_AGGREGATION
+        static const AggregationConfig aggregation[] = INFLUX_AGGREGATION;
+        for (const AggregationConfig& config : aggregation) {
+            if (packet.data_source == config.data_source && packet.data_name == config.data_name) {
+                window.window_ms = config.window_minutes * 60000UL;
+                window.also_raw = config.also_raw;
+            }
+        }
+#endif
+        return window;
+    }
+
+    /**
+     * @brief Whether the window is over at now_ms. Values don't come in in time order - the alarm
+     * lane of the queues lets alarms pass routine values - so now_ms can be before the window
+     * started. The difference is signed: such a value is in the current window, and doesn't
+     * end it, instead of looking 49 days late.
+     */
+
+    static bool window_ended(const AggregateWindow& window, uint32_t now_ms) {
+        return window.count > 0 && (int32_t)(now_ms - window.window_start_ms) >= (int32_t)window.window_ms;
+    }
+
+    static void send(AggregateWindow& window, aggregate_sender_t sender, void* context) {
+        sender(context, window);
+        window.count = 0;
+        window.sum = 0;
+    }
+
+public:
+
+    /**
+     * @brief Add a value to its datapoint's window.
+     *
+     * @param sender Sends the previous window, if the value is for a new one
+     * @return true if the value should (also) be sent as it is
+     */
+
+    bool add(const Packet_t& packet, aggregate_sender_t sender, void* context) {
+        auto it = windows_.find(packet.unique_id);
+        if (it == windows_.end()) {
+            it = windows_.insert(std::make_pair(packet.unique_id, configure(packet))).first;
+        }
+        AggregateWindow& window = it->second;
+        if (window.window_ms == 0) {
+            return true;
+        }
+        uint32_t now_ms = packet.timestamp;
+        if (window_ended(window, now_ms)) {
+            send(window, sender, context);
+        }
+        float value = packet.data_value.toFloat();
+        if (window.count == 0) {
+            window.window_start_ms = now_ms - now_ms % window.window_ms;
+            window.min = value;
+            window.max = value;
+            window.alarm_code = packet.alarm_code;
+        }
+        else {
+            window.min = value < window.min ? value : window.min;
+            window.max = value > window.max ? value : window.max;
+            window.alarm_code = packet.alarm_code > window.alarm_code ? packet.alarm_code : window.alarm_code;
+        }
+        window.sum += value;
+        window.count++;
+        window.last = value;
+        window.RSSI = packet.RSSI;
+        window.SNR = packet.SNR;
+        return window.also_raw;
+    }
+
+    /**
+     * @brief Send every window that has ended, with sender. A window that can't be sent
+     * is dropped anyway, like a raw value that can't be sent.
+     */
+
+    void flush(uint32_t now_ms, aggregate_sender_t sender, void* context) {
+        for (auto& entry : windows_) {
+            AggregateWindow& window = entry.second;
+            if (window_ended(window, now_ms)) {
+                send(window, sender, context);
+            }
+        }
+    }
+
+}; // class Aggregator
+
+#endif // _AGGREGATOR_H_
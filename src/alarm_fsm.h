@@ -0,0 +1,130 @@
+#ifndef _ALARM_FSM_H_
+#define _ALARM_FSM_H_
+
+#include <Arduino.h>
+
+enum alarm_state_t : uint8_t {ALARM_NORMAL, ALARM_PENDING, ALARM_ACTIVE, ALARM_CLEARING};
+
+enum alarm_event_t : uint8_t {ALARM_NO_CHANGE, ALARM_RAISED, ALARM_CLEARED};
+
+/**
+ * @brief AlarmFsm is the alarm state of one datapoint:
+ *
+ *   NORMAL --condition--> PENDING --condition for raise_dwell_ms--> ACTIVE
+ *     ^                      |                                       |  ^
+ *     +-----no condition-----+                          no condition |  | condition
+ *     |                                                              v  |
+ *     +-----------------no condition for clear_dwell_ms------------ CLEARING
+ *
+ * The "condition" is an alarm_code: from the transmitter, or from an alarm rule (whose
+ * hysteresis band keeps it from flickering - see alarm_rules.h). A condition that comes back
+ * while CLEARING continues the same alarm, so a value that hovers at a threshold doesn't
+ * beep, email, and start a new alarm on every packet.
+ *
+ * update() depends only on its arguments - no clock, no I/O - so any sequence of
+ * (condition, time) pairs always gives the same sequence of states.
+ */
+
+class AlarmFsm {
+
+public:
+
+    /**
+     * @brief Move the state machine along with one new value of its datapoint.
+     *
+     * @param condition_code The alarm_code that value calls for, 0 for none
+     * @param raise_dwell_ms How long the condition has to last to raise the alarm
+     * @param clear_dwell_ms How long the condition has to be gone to clear the alarm
+     * @param now_ms The time of the value
+     * @return ALARM_RAISED or ALARM_CLEARED if the alarm just started or ended
+     */
+
+    alarm_event_t update(int16_t condition_code, uint32_t raise_dwell_ms, uint32_t clear_dwell_ms, uint32_t now_ms) {
+        bool condition = condition_code != 0;
+        switch (state_) {
+            case ALARM_NORMAL:
+                if (condition) {
+                    enter(ALARM_PENDING, now_ms);
+                    return update(condition_code, raise_dwell_ms, clear_dwell_ms, now_ms); // a dwell of 0 raises it now
+                }
+                break;
+            case ALARM_PENDING:
+                if (!condition) {
+                    enter(ALARM_NORMAL, now_ms);
+                }
+                else if (now_ms - since_ms_ >= raise_dwell_ms) {
+                    enter(ALARM_ACTIVE, now_ms);
+                    code_ = condition_code;
+                    return ALARM_RAISED;
+                }
+                break;
+            case ALARM_ACTIVE:
+                if (condition) {
+                    code_ = condition_code;
+                }
+                else {
+                    enter(ALARM_CLEARING, now_ms);
+                    return update(condition_code, raise_dwell_ms, clear_dwell_ms, now_ms); // a dwell of 0 clears it now
+                }
+                break;
+            case ALARM_CLEARING:
+                if (condition) {
+                    enter(ALARM_ACTIVE, now_ms);
+                    code_ = condition_code;
+                }
+                else if (now_ms - since_ms_ >= clear_dwell_ms) {
+                    enter(ALARM_NORMAL, now_ms);
+                    code_ = 0;
+                    return ALARM_CLEARED;
+                }
+                break;
+        }
+        return ALARM_NO_CHANGE;
+    }
+
+    alarm_state_t state() const {
+        return state_;
+    }
+
+    /**
+     * @brief The alarm_code to show, and to send emails about: 0 unless the alarm is
+     * ACTIVE (or CLEARING, which is still an alarm until it's done).
+     */
+
+    int16_t alarm_code() const {
+        return (state_ == ALARM_ACTIVE || state_ == ALARM_CLEARING) ? code_ : 0;
+    }
+
+    /**
+     * @brief Put the state machine back in the state it was in before a restart
+     * (see snapshot.h). The dwell of that state starts over, at now_ms.
+     */
+
+    void restore(alarm_state_t state, int16_t code, uint32_t now_ms) {
+        enter(state <= ALARM_CLEARING ? state : ALARM_NORMAL, now_ms);
+        code_ = code;
+    }
+
+    static const char* state_name(alarm_state_t state) {
+        switch (state) {
+            case ALARM_NORMAL: return "normal";
+            case ALARM_PENDING: return "pending";
+            case ALARM_ACTIVE: return "active";
+            case ALARM_CLEARING: return "clearing";
+        }
+        return "?";
+    }
+
+private:
+    alarm_state_t state_ = ALARM_NORMAL;
+    uint32_t since_ms_ = 0;
+    int16_t code_ = 0;
+
+    void enter(alarm_state_t state, uint32_t now_ms) {
+        state_ = state;
+        since_ms_ = now_ms;
+    }
+
+}; // class AlarmFsm
+
+#endif // _ALARM_FSM_H_
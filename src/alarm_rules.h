@@ -0,0 +1,207 @@
+#ifndef _ALARM_RULES_H_
+#define _ALARM_RULES_H_
+
+#include <Arduino.h>
+#include <map>
+#include <vector>
+#include "config.h"
+#include "packet_t.h"
+
+#define NO_ALARM_RULES -1   // Packet_t::alarm_rules of a datapoint that has no rules
+#define MAX_RULES_PER_DATAPOINT 8   // one bit each in Packet_t::alarm_rules_broken
+
+enum rule_op_t : uint8_t {RULE_LESS_THAN, RULE_AT_MOST, RULE_GREATER_THAN, RULE_AT_LEAST};
+
+/**
+ * @brief One row of the ALARM_RULES table in config.h:
+ * "data_source/data_name op threshold for for_minutes -> alarm_code, email every
+ * alarm_email_interval minutes, at most max_alarm_emails_to_send times". Once the rule is
+ * broken, it stays broken until the value is back past the threshold by more than hysteresis.
+ */
+
+struct AlarmRule {
+    const char* data_source;
+    const char* data_name;
+    rule_op_t op;
+    float threshold;
+    float hysteresis;                   // in the units of the value - 0 for none
+    uint16_t for_minutes;               // 0 to raise the alarm on the first value that breaks the rule
+    int16_t alarm_code;
+    uint16_t alarm_email_interval;      // minutes
+    uint16_t max_alarm_emails_to_send;
+};
+
+/**
+ * @brief An AlarmRule as it's evaluated: no strings, and no state. Whether the rule is broken
+ * now is kept by each datapoint, in its Packet_t::alarm_rules_broken - two transmitters can
+ * send datapoints with the same data_source and data_name, and so share the rules.
+ */
+
+struct CompiledRule {
+    rule_op_t op;
+    float threshold;
+    float clear_threshold;          // threshold, moved away from the alarm side by the hysteresis
+    uint32_t hold_ms;
+    int16_t alarm_code;
+    uint16_t alarm_email_interval;
+    uint16_t max_alarm_emails_to_send;
+};
+
+/**
+ * @brief AlarmRules raises alarms at the base station from the values of any datapoint, so
+ * thresholds can be changed here instead of in every transmitter. (The BME280's thresholds
+ * are rules, too.)
+ *
+ * load() compiles the table into one array of CompiledRules, sorted by datapoint, and a map
+ * from "data_source/data_name" to each datapoint's slice of that array. The slice is looked
+ * up only once per datapoint - PacketList keeps it in the datapoint's Packet_t::alarm_rules -
+ * so checking a value costs the same however many rules there are for other datapoints.
+ *
+ * The rules decide only whether a value calls for an alarm. Whether (and when) the alarm
+ * starts and ends is up to the datapoint's AlarmFsm - see alarm_fsm.h.
+ */
+
+class AlarmRules {
+
+private:
+    struct RuleSlice {
+        uint16_t first;
+        uint8_t count;
+    };
+
+    std::vector<CompiledRule> rules_;
+    std::vector<RuleSlice> slices_;
+    std::map<String, int16_t> slice_index_;
+
+    static String datapoint_key(const String& data_source, const String& data_name) {
+        return data_source + "/" + data_name;
+    }
+
+    static bool is_broken(rule_op_t op, float value, float threshold) {
+        switch (op) {
+            case RULE_LESS_THAN: return value < threshold;
+            case RULE_AT_MOST: return value <= threshold;
+            case RULE_GREATER_THAN: return value > threshold;
+            case RULE_AT_LEAST: return value >= threshold;
+        }
+        return false;
+    }
+
+public:
+
+    AlarmRules() {
+        static const AlarmRule rule_table[] = ALARM_RULES;
+        load(rule_table, sizeof(rule_table) / sizeof(rule_table[0]));
+    }
+
+    /**
+     * @brief Compile a rule table, replacing the rules there were. Rules for the same
+     * datapoint are checked in the order they're in the table. Datapoints that are already
+     * in PacketList keep the slice they looked up, so load() should be called only at boot.
+     */
+
+    void load(const AlarmRule* table, uint16_t count) {
+        rules_.clear();
+        slices_.clear();
+        slice_index_.clear();
+        std::map<String, std::vector<uint16_t>> by_datapoint;
+        for (uint16_t i = 0; i < count; i++) {
+            by_datapoint[datapoint_key(table[i].data_source, table[i].data_name)].push_back(i);
+        }
+        for (auto& datapoint : by_datapoint) {
+            if (datapoint.second.size() > MAX_RULES_PER_DATAPOINT) {
+                Serial.println("Only the first " + String(MAX_RULES_PER_DATAPOINT) + " alarm rules for "
+                               + datapoint.first + " are used");
+                datapoint.second.resize(MAX_RULES_PER_DATAPOINT);
+            }
+            RuleSlice slice;
+            slice.first = rules_.size();
+            slice.count = datapoint.second.size();
+            for (uint16_t i : datapoint.second) {
+                CompiledRule rule;
+                rule.op = table[i].op;
+                rule.threshold = table[i].threshold;
+                bool low_alarm = rule.op == RULE_LESS_THAN || rule.op == RULE_AT_MOST;
+                rule.clear_threshold = table[i].threshold + (low_alarm ? table[i].hysteresis : -table[i].hysteresis);
+                rule.hold_ms = table[i].for_minutes * 60000UL;
+                rule.alarm_code = table[i].alarm_code;
+                rule.alarm_email_interval = table[i].alarm_email_interval;
+                rule.max_alarm_emails_to_send = table[i].max_alarm_emails_to_send;
+                rules_.push_back(rule);
+            }
+            slice_index_[datapoint.first] = slices_.size();
+            slices_.push_back(slice);
+        }
+    }
+
+    /**
+     * @brief Look up the rules for a datapoint, once, when it's first added to PacketList.
+     *
+     * @return the value for Packet_t::alarm_rules
+     */
+
+    int16_t find_rules(const String& data_source, const String& data_name) {
+        auto it = slice_index_.find(datapoint_key(data_source, data_name));
+        return it == slice_index_.end() ? NO_ALARM_RULES : it->second;
+    }
+
+    /**
+     * @brief Change the threshold of a datapoint's rule (the first one with op), keeping its
+     * hysteresis. Used for the thresholds in RuntimeSettings - see runtime_config.h.
+     *
+     * @return false if the datapoint has no such rule
+     */
+
+    bool set_threshold(const String& data_source, const String& data_name, rule_op_t op, float threshold) {
+        int16_t slice = find_rules(data_source, data_name);
+        if (slice == NO_ALARM_RULES) {
+            return false;
+        }
+        for (uint16_t i = slices_[slice].first; i < slices_[slice].first + slices_[slice].count; i++) {
+            CompiledRule& rule = rules_[i];
+            if (rule.op == op) {
+                rule.clear_threshold += threshold - rule.threshold;
+                rule.threshold = threshold;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Check a new value against its datapoint's rules. The first broken rule sets the
+     * packet's email settings, and how long it has to stay broken to raise the alarm.
+     *
+     * @param packet The new value
+     * @param slice The datapoint's Packet_t::alarm_rules
+     * @param broken The datapoint's Packet_t::alarm_rules_broken, updated
+     * @param raise_dwell_ms Gets the broken rule's for_minutes, in ms
+     * @return the broken rule's alarm_code, or 0 if no rule is broken
+     */
+
+    int16_t evaluate(Packet_t* packet, int16_t slice, uint8_t* broken, uint32_t* raise_dwell_ms) {
+        if (slice < 0 || slice >= (int16_t)slices_.size()) {
+            return 0;
+        }
+        float value = packet->data_value.toFloat();
+        int16_t condition_code = 0;
+        const RuleSlice& rule_slice = slices_[slice];
+        for (uint8_t i = 0; i < rule_slice.count; i++) {
+            const CompiledRule& rule = rules_[rule_slice.first + i];
+            uint8_t bit = 1 << i;
+            bool was_broken = (*broken & bit) != 0;
+            bool is_broken_now = is_broken(rule.op, value, was_broken ? rule.clear_threshold : rule.threshold);
+            *broken = is_broken_now ? (*broken | bit) : (*broken & ~bit);
+            if (is_broken_now && condition_code == 0) {
+                condition_code = rule.alarm_code;
+                *raise_dwell_ms = rule.hold_ms;
+                packet->alarm_email_interval = rule.alarm_email_interval;
+                packet->max_alarm_emails_to_send = rule.max_alarm_emails_to_send;
+            }
+        }
+        return condition_code;
+    }
+
+}; // class AlarmRules
+
+#endif // _ALARM_RULES_H_
@@ -0,0 +1,130 @@
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#include <Arduino.h>
+#include <time.h>
+#include <esp_sntp.h>
+#include "config.h"
+
+#define MIN_VALID_TIME 1672531200   // 1/1/2023: the system clock is earlier than this until it's set
+
+/**
+ * @brief Clock is the base station's wall clock. The local time is worked out (with localtime_r())
+ * only once per minute, and kept, so checking whether the time is valid, or whether it's
+ * daytime, is just a comparison - no getLocalTime(), strftime() or String.
+ *
+ * The time is valid once NTP has set it: the SNTP callback sets a flag. (A clock that survived
+ * a soft restart is valid, too, without waiting for NTP.)
+ *
+ * Any task can use it - the packet task, the email task and loop() all do. localtime_r() is
+ * called without the lock (it can take newlib's time zone lock), and what it worked out is
+ * published, and copied out, under lock_.
+ */
+
+class Clock {
+
+public:
+
+    /**
+     * @brief Start syncing the clock with NTP_SERVER, in TIMEZONE (both in config.h).
+     * Call it once there's wifi. Calling it again restarts the sync.
+     */
+
+    void begin() {
+        sntp_set_time_sync_notification_cb(on_time_sync);
+        configTzTime(TIMEZONE, NTP_SERVER);
+        portENTER_CRITICAL(&lock_);
+        next_refresh_ = 0;
+        portEXIT_CRITICAL(&lock_);
+    }
+
+    /**
+     * @brief Whether the system clock has been set. Use this any time a timestamp
+     * is created or compared to.
+     */
+
+    bool is_valid() {
+        refresh();
+        portENTER_CRITICAL(&lock_);
+        bool valid = valid_;
+        portEXIT_CRITICAL(&lock_);
+        return synced_ || valid;
+    }
+
+    /**
+     * @brief Wait up to timeout_ms for NTP to set the clock, right after begin().
+     *
+     * @return is_valid()
+     */
+
+    bool wait_until_valid(uint32_t timeout_ms) {
+        uint32_t start_ms = millis();
+        while (!is_valid() && millis() - start_ms < timeout_ms) {
+            delay(100);
+        }
+        return is_valid();
+    }
+
+    /**
+     * @brief The local time, as of the start of the current minute. It's a copy, so
+     * another task's refresh() can't change it while it's used.
+     */
+
+    tm local_time() {
+        refresh();
+        portENTER_CRITICAL(&lock_);
+        tm local = local_;
+        portEXIT_CRITICAL(&lock_);
+        return local;
+    }
+
+    /**
+     * @brief Whether the local hour is from start_hour up to (not including) end_hour.
+     * Always false if the clock isn't valid.
+     */
+
+    bool hour_is_between(uint8_t start_hour, uint8_t end_hour) {
+        refresh();
+        portENTER_CRITICAL(&lock_);
+        bool valid = valid_;
+        int hour = local_.tm_hour;
+        portEXIT_CRITICAL(&lock_);
+        return (synced_ || valid) && hour >= start_hour && hour < end_hour;
+    }
+
+private:
+    static volatile bool synced_;
+    portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;  // guards valid_, local_ and next_refresh_
+    bool valid_ = false;
+    tm local_ = {};
+    time_t next_refresh_ = 0;       // the start of the next minute
+
+    static void on_time_sync(struct timeval* tv) {
+        synced_ = true;
+    }
+
+    void refresh() {
+        time_t now = time(NULL);
+        portENTER_CRITICAL(&lock_);
+        time_t next_refresh = next_refresh_;
+        portEXIT_CRITICAL(&lock_);
+        // Also when the clock has jumped (when it's set), so it's never a minute behind
+        if (now < next_refresh && now >= next_refresh - 60) {
+            return;
+        }
+        tm local;
+        localtime_r(&now, &local);
+        // If two tasks get here at once, the last to publish wins - if that's the older time,
+        // across a minute, the next call just refreshes again
+        portENTER_CRITICAL(&lock_);
+        local_ = local;
+        valid_ = now >= MIN_VALID_TIME;
+        next_refresh_ = now - now % 60 + 60;
+        portEXIT_CRITICAL(&lock_);
+    }
+
+}; // class Clock
+
+volatile bool Clock::synced_ = false;
+
+#endif // _CLOCK_H_
@@ -14,7 +14,82 @@
 
 #define BASE_STATION
 
+// The LoRa radio profile, sent to (and verified with) the LoRa by ReyaxLoRa::initialize().
+// See main.cpp for the study these came from, and reyax_lora.h for the possible values.
+// ReyaxLoRa::print_radio_profile() shows the time on air of a profile.
+#define LORA_FREQUENCY 915000000UL // Hz - use the band that's legal where you are
+#define LORA_OUTPUT_POWER 15       // dBm
+#define LORA_SPREAD_FACTOR 9
+#define LORA_BANDWIDTH 7           // 125 kHz
+#define LORA_CODING_RATE 1         // 4/5
+#define LORA_PREAMBLE 4
+
+// A second LoRa module on the base station, on UART1, doubles how many packets it can take in.
+// Give it a different frequency, and point half of the transmitters at that frequency.
+// (Each module needs its own one_time_setup() - see LORA_SETUP_REQUIRED in main.cpp.)
+// #define SECOND_LORA_RADIO
+#define LORA2_RX_PIN 25            // UART1's default pins are used by the flash
+#define LORA2_TX_PIN 26
+#define LORA2_FREQUENCY 923000000UL
+
+// Link quality tracking (see link_quality.h)
+#define LINK_MARGIN_DB 10.0F       // SNR margin to keep when recommending a faster SF or lower power
+#define LINK_BURST_WINDOW_MS 10000 // packets from one transmitter this close together are one report
+
+// Downlink commands to the transmitters (see downlink.h)
+#define DOWNLINK_DUTY_CYCLE_PERCENT 1.0F // share of the time the base station may transmit
+#define DOWNLINK_MAX_BUDGET_MS 36000     // most airtime that can be saved up: one hour at 1%
+
+// The base station's time zone, as a POSIX TZ string, and where it gets the time (see clock.h).
+// US Eastern, with DST from the 2nd Sunday in March to the 1st Sunday in November:
+#define TIMEZONE "EST5EDT,M3.2.0,M11.1.0"
+#define NTP_SERVER "pool.ntp.org"
+
+// FreeRTOS task topology. On the ESP32, the WiFi / LwIP stack (and therefore
+// all TLS work) runs on core 0, and Arduino's loop() runs on core 1 at priority 1.
+// Radio ingest is pinned to core 1 at a priority above loop(), so it preempts the
+// display work there, and never competes with the network stack.
+// Network tasks (InfluxDB, MQTT, the alarm emails, the local HTTP API) are pinned
+// to core 0, under the WiFi task (priority 23). loop() only wakes the email task up.
+// Use tskNO_AFFINITY for either core to let the scheduler choose.
+#define RADIO_TASK_CORE 1
+#define NETWORK_TASK_CORE 0
+#define GET_NEW_PACKETS_PRIORITY 3     // reads Serial2: must never be starved
+#define HANDLE_PACKET_QUEUE_PRIORITY 2 // updates PacketList, above loop() (1)
+#define HANDLE_INFLUX_QUEUE_PRIORITY 1 // writes to InfluxDB and MQTT (see sink.h)
+#define SEND_ALARM_EMAILS_PRIORITY 1   // SMTP/TLS for the alarm emails, woken by loop()
+#define HANDLE_WEB_API_PRIORITY 1      // the local HTTP API (see web_api.h)
+#define GET_NEW_PACKETS_PERIOD_MS 50 // also how often the LoRa command engine runs
+
+// Un-comment to print the wakeup jitter and parse time of the get_new_packets
+// task every TASK_JITTER_REPORT_INTERVAL ms. Useful to see how the task topology
+// above holds up while InfluxDB writes and alarm emails are being sent.
+// #define TASK_JITTER_STATS
+#define TASK_JITTER_REPORT_INTERVAL 60000
+
+// The local HTTP API: GET /datapoints returns every datapoint as JSON - see web_api.h.
+#define WEB_API_PORT 80
+
+// With FAST_BOOT, setup() starts radio ingest as soon as the LoRa is initialized, then
+// brings up the display, BME280, wifi and NTP concurrently in the background, instead of
+// one after the other. The time from boot to the first accepted packet is printed.
+// Comment it out to go back to the old sequential setup().
+#define FAST_BOOT
+
+// Comment out to skip the 4 second "about" screen when the display starts.
+#define SHOW_SPLASH_SCREEN
+
+// loop() blocks between its scheduled jobs, so the idle task can put the ESP32 into
+// automatic light sleep. Un-comment to enable it - it takes effect only if the framework
+// was built with CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE.
+// #define ENABLE_LIGHT_SLEEP
+
 #define TEMP_CALIBRATION -1.0 // my particular BME280 reads 1.0 Fahrenheit too warm
+// The datapoints of the BME280, and their names in the tables below
+#define BME280_DATA_SOURCE "Home"
+#define BME280_TEMP_NAME "Temp (F)"
+#define BME280_PRESSURE_NAME "Pressure"
+#define BME280_HUMIDITY_NAME "Humidity"
 // Home alarm ranges
 #define LOW_TEMP_ALARM_VALUE 73.0F // s/b 73.0
 #define HIGH_TEMP_ALARM_VALUE 88.0F // s/b 88.0
@@ -34,4 +109,83 @@
 #define HUMIDITY_ALARM_EMAIL_INTERVAL 120 // in MINUTES
 #define HUMIDITY_ALARM_MAX_EMAILS 3
 
+// Every datapoint's alarm goes normal -> pending -> active -> clearing -> normal (see alarm_fsm.h).
+// An alarm rule's for_minutes is its raise dwell. These are for everything else.
+#define ALARM_RAISE_DWELL_MS 0        // alarm_codes from transmitters are raised right away
+#define ALARM_CLEAR_DWELL_MS 300000   // an alarm ends only after 5 minutes without its condition
+
+// A datapoint that misses STALE_AFTER_INTERVALS of its expected intervals raises the "no data"
+// alarm, STALE_ALARM_CODE. Its interval is learned from the packets, unless it's in EXPECTED_INTERVALS:
+// {data_source, data_name, seconds}
+#define STALE_ALARM_CODE 111           // short, long, short
+#define STALE_ALARM_EMAIL_INTERVAL 240 // in MINUTES
+#define STALE_ALARM_MAX_EMAILS 2
+#define STALE_AFTER_INTERVALS 3
+#define EXPECTED_INTERVALS { \
+    {BME280_DATA_SOURCE, BME280_TEMP_NAME, 600}, \
+    {BME280_DATA_SOURCE, BME280_PRESSURE_NAME, 600}, \
+    {BME280_DATA_SOURCE, BME280_HUMIDITY_NAME, 600}, \
+}
+
+// A datapoint is sent to InfluxDB only when its value has moved by more than its deadband
+// since the last value sent, when its alarm_code changes, or at least every INFLUX_HEARTBEAT_MINUTES.
+// INFLUX_DEADBANDS: {data_source, data_name, deadband}, in the units of the value.
+// A deadband of 0 drops only repeats of the same value, and -1 sends every value. With the default
+// of 0, a sensor whose value doesn't change is written only once per INFLUX_HEARTBEAT_MINUTES.
+// A value that isn't a number is sent whenever its text changes, whatever its deadband.
+#define INFLUX_HEARTBEAT_MINUTES 60
+#define INFLUX_DEFAULT_DEADBAND 0.0F   // 0: every value that differs from the last one sent
+#define INFLUX_DEADBANDS { \
+    {BME280_DATA_SOURCE, BME280_TEMP_NAME, 0.5F}, \
+    {BME280_DATA_SOURCE, BME280_PRESSURE_NAME, 0.02F}, \
+    {BME280_DATA_SOURCE, BME280_HUMIDITY_NAME, 1.0F}, \
+}
+
+// Chatty datapoints can be sent to InfluxDB as one point per window, in the "aggregates"
+// measurement, with the min, max, mean, count and last value of the window - see aggregator.h.
+// {data_source, data_name, window_minutes, also_raw}, where also_raw true sends every value, too.
+// #define INFLUX_AGGREGATION {{"Pool", "Pump pressure", 5, false}}
+
+// Where the datapoints in the influx queue are sent - see sink.h. Define either one, or both.
+// MQTT_SINK publishes each value, retained, on MQTT_TOPIC_PREFIX/data_source/data_name, at QoS 1,
+// over one persistent connection - see mqtt_sink.h. The broker's address and login are in secret_config.h.
+#define INFLUX_SINK
+// #define MQTT_SINK
+#define MQTT_CLIENT_ID "lora-base-station" // fixed, so the broker keeps the session across reconnects
+#define MQTT_TOPIC_PREFIX "lora"
+#define MQTT_KEEPALIVE_SECONDS 60
+#define MQTT_MAX_IN_FLIGHT 16              // QoS 1 publishes waiting for their PUBACK at once
+#define MQTT_ACK_TIMEOUT_MS 2000           // how long write() waits for one of them to be acknowledged
+
+// Derived datapoints - see derived_metrics.h.
+// DERIVED_STATS: {data_source, data_name, stat, output_name, decimals}, where stat is DERIVED_MEAN,
+// DERIVED_MIN or DERIVED_MAX of the last 16 values, or DERIVED_SLOPE (the rate of change per hour).
+// EXAMPLE: {"Garden", "Tub level (L)", DERIVED_SLOPE, "Tub drain (L/h)", 1}. Un-comment to use it.
+// #define DERIVED_STATS {{"Home", "Pressure", DERIVED_SLOPE, "Pressure trend (/h)", 3}}
+// VIRTUAL_DATAPOINTS: {data_source, data_name, a_source, a_name, op, b_source, b_name, decimals}
+// for data_name = a op b, where op is '+', '-', '*' or '/'. Un-comment to use it.
+// #define VIRTUAL_DATAPOINTS {{"Boat", "Power (W)", "Boat", "Battery voltage", '*', "Boat", "Battery current", 0}}
+
+// PacketList is saved to flash (NVS), and restored at boot, so a restart doesn't re-sound and
+// re-email the alarms that were already going, or blank the display - see snapshot.h.
+// It's checked for changes every SNAPSHOT_CHECK_SECONDS, and saved then if an alarm (or its
+// emails) changed, but if only values changed, at most every SNAPSHOT_VALUES_MINUTES.
+#define SNAPSHOT_CHECK_SECONDS 30
+#define SNAPSHOT_VALUES_MINUTES 60
+
+// Alarm rules, checked at the base station for every value of a datapoint - see alarm_rules.h.
+// {data_source, data_name, op, threshold, hysteresis, for_minutes, alarm_code, alarm_email_interval, max_alarm_emails}
+// op is RULE_LESS_THAN, RULE_AT_MOST, RULE_GREATER_THAN or RULE_AT_LEAST.
+// EXAMPLE: {"Boat", "Battery voltage", RULE_LESS_THAN, 12.1F, 0.2F, 10, 12, 60, 3}
+// raises alarm 12 when the boat's battery has been under 12.1 for 10 minutes, emails every
+// 60 minutes (at most 3 times) while it lasts, and clears only once it's 12.3 or more.
+#define ALARM_RULES { \
+    {BME280_DATA_SOURCE, BME280_TEMP_NAME, RULE_AT_MOST, LOW_TEMP_ALARM_VALUE, 1.0F, 0, TEMP_ALARM_CODE, TEMP_ALARM_EMAIL_INTERVAL, TEMP_ALARM_MAX_EMAILS}, \
+    {BME280_DATA_SOURCE, BME280_TEMP_NAME, RULE_AT_LEAST, HIGH_TEMP_ALARM_VALUE, 1.0F, 0, TEMP_ALARM_CODE, TEMP_ALARM_EMAIL_INTERVAL, TEMP_ALARM_MAX_EMAILS}, \
+    {BME280_DATA_SOURCE, BME280_PRESSURE_NAME, RULE_AT_MOST, LOW_PRESSURE_ALARM_VALUE, 0.05F, 0, PRESSURE_ALARM_CODE, PRESSURE_ALARM_EMAIL_INTERVAL, PRESSURE_ALARM_MAX_EMAILS}, \
+    {BME280_DATA_SOURCE, BME280_PRESSURE_NAME, RULE_AT_LEAST, HIGH_PRESSURE_ALARM_VALUE, 0.05F, 0, PRESSURE_ALARM_CODE, PRESSURE_ALARM_EMAIL_INTERVAL, PRESSURE_ALARM_MAX_EMAILS}, \
+    {BME280_DATA_SOURCE, BME280_HUMIDITY_NAME, RULE_AT_MOST, LOW_HUMIDITY_ALARM_VALUE, 2.0F, 0, HUMIDITY_ALARM_CODE, HUMIDITY_ALARM_EMAIL_INTERVAL, HUMIDITY_ALARM_MAX_EMAILS}, \
+    {BME280_DATA_SOURCE, BME280_HUMIDITY_NAME, RULE_AT_LEAST, HIGH_HUMIDITY_ALARM_VALUE, 2.0F, 0, HUMIDITY_ALARM_CODE, HUMIDITY_ALARM_EMAIL_INTERVAL, HUMIDITY_ALARM_MAX_EMAILS}, \
+}
+
 #endif // _CONFIG_H_
\ No newline at end of file
@@ -37,4 +37,10 @@ const char *GMAIL_APP_PASSWORD = "PasswordYouGenerateInYourGoogleAcctForASingleA
 #define INFLUXDB_USER "YourDBUserHere"
 #define INFLUXDB_PASSWORD "YourDBPasswordHere"
 
+// MQTT broker, if MQTT_SINK is defined in config.h
+#define MQTT_HOST "YourBrokerAddressHere" // e.g. "192.168.1.10", or a mosquitto on your LAN
+#define MQTT_PORT 1883
+#define MQTT_USER "YourBrokerUserHere"     // NULL (and MQTT_PASSWORD NULL) if the broker has no login
+#define MQTT_PASSWORD "YourBrokerPasswordHere"
+
 #endif // _DEFAULT_CONFIG_H_
\ No newline at end of file
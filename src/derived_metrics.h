@@ -0,0 +1,348 @@
+#ifndef _DERIVED_METRICS_H_
+#define _DERIVED_METRICS_H_
+
+#include <Arduino.h>
+#include <map>
+#include <vector>
+#include <deque>
+#include "config.h"
+#include "packet_t.h"
+
+#define ROLLING_WINDOW_SAMPLES 16   // the last this many values of a datapoint
+#define MAX_DERIVED_PER_VALUE 8     // derived datapoints that one new value can update
+
+enum derived_stat_t : uint8_t {DERIVED_MEAN, DERIVED_MIN, DERIVED_MAX, DERIVED_SLOPE};
+
+/**
+ * @brief One row of DERIVED_STATS in config.h: a statistic of the last ROLLING_WINDOW_SAMPLES
+ * values of a datapoint, published as its own datapoint (with the same data_source).
+ * DERIVED_SLOPE is the rate of change per hour.
+ */
+
+struct DerivedStat {
+    const char* data_source;
+    const char* data_name;
+    derived_stat_t stat;
+    const char* output_name;
+    uint8_t decimals;
+};
+
+/**
+ * @brief One row of VIRTUAL_DATAPOINTS in config.h: output = a op b, where a and b are the
+ * latest values of two other datapoints, and op is '+', '-', '*' or '/'.
+ */
+
+struct VirtualDatapoint {
+    const char* data_source;
+    const char* data_name;
+    const char* a_source;
+    const char* a_name;
+    char op;
+    const char* b_source;
+    const char* b_name;
+    uint8_t decimals;
+};
+
+/**
+ * @brief Mean, min, max and least-squares slope of the last ROLLING_WINDOW_SAMPLES values,
+ * all updated in O(1) (amortized, for min and max) when a value is added: the sums are
+ * updated by adding the new value and subtracting the one that falls out of the window,
+ * and min / max come from monotonic queues.
+ */
+
+class RollingStats {
+
+public:
+
+    void add(uint32_t now_ms, float value) {
+        if (added_ == 0) {
+            origin_ms_ = now_ms;
+        }
+        else if (now_ms - origin_ms_ > 0x40000000UL) { // every 12 days, so the times can't overflow
+            rebase(now_ms);
+        }
+        double t = (now_ms - origin_ms_) / 3600000.0; // hours
+        if (count_ == ROLLING_WINDOW_SAMPLES) {
+            remove_oldest();
+        }
+        Sample& sample = samples_[next_];
+        sample.t = t;
+        sample.v = value;
+        sum_t_ += t;
+        sum_v_ += value;
+        sum_tt_ += t * t;
+        sum_tv_ += t * value;
+        while (!min_queue_.empty() && samples_[min_queue_.back()].v >= value) {
+            min_queue_.pop_back();
+        }
+        min_queue_.push_back(next_);
+        while (!max_queue_.empty() && samples_[max_queue_.back()].v <= value) {
+            max_queue_.pop_back();
+        }
+        max_queue_.push_back(next_);
+        next_ = (next_ + 1) % ROLLING_WINDOW_SAMPLES;
+        count_++;
+        added_++;
+    }
+
+    /**
+     * @return false if there aren't enough values yet (two, for the slope)
+     */
+
+    bool get(derived_stat_t stat, float* result) const {
+        if (count_ == 0) {
+            return false;
+        }
+        switch (stat) {
+            case DERIVED_MEAN:
+                *result = sum_v_ / count_;
+                return true;
+            case DERIVED_MIN:
+                *result = samples_[min_queue_.front()].v;
+                return true;
+            case DERIVED_MAX:
+                *result = samples_[max_queue_.front()].v;
+                return true;
+            case DERIVED_SLOPE: {
+                double denominator = count_ * sum_tt_ - sum_t_ * sum_t_;
+                if (count_ < 2 || fabs(denominator) < 1e-12) {
+                    return false;
+                }
+                *result = (count_ * sum_tv_ - sum_t_ * sum_v_) / denominator;
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    struct Sample {
+        double t;
+        float v;
+    };
+
+    Sample samples_[ROLLING_WINDOW_SAMPLES];
+    uint8_t next_ = 0;
+    uint8_t count_ = 0;
+    uint32_t added_ = 0;      // values added since the start
+    uint32_t origin_ms_ = 0;
+    double sum_t_ = 0, sum_v_ = 0, sum_tt_ = 0, sum_tv_ = 0;
+    std::deque<uint8_t> min_queue_;   // positions in samples_, values increasing
+    std::deque<uint8_t> max_queue_;   // positions in samples_, values decreasing
+
+    /**
+     * @brief Move the origin of the times to now_ms, and recompute the sums of the times.
+     * The slope doesn't change, because every time moves by the same amount.
+     */
+
+    void rebase(uint32_t now_ms) {
+        double shift = (now_ms - origin_ms_) / 3600000.0;
+        origin_ms_ = now_ms;
+        sum_t_ = sum_tt_ = sum_tv_ = 0;
+        for (uint8_t i = 0; i < count_; i++) {
+            Sample& sample = samples_[(next_ + ROLLING_WINDOW_SAMPLES - count_ + i) % ROLLING_WINDOW_SAMPLES];
+            sample.t -= shift;
+            sum_t_ += sample.t;
+            sum_tt_ += sample.t * sample.t;
+            sum_tv_ += sample.t * sample.v;
+        }
+    }
+
+    void remove_oldest() {
+        uint8_t oldest = next_; // the window is full, so the next slot holds the oldest sample
+        const Sample& sample = samples_[oldest];
+        sum_t_ -= sample.t;
+        sum_v_ -= sample.v;
+        sum_tt_ -= sample.t * sample.t;
+        sum_tv_ -= sample.t * sample.v;
+        if (!min_queue_.empty() && min_queue_.front() == oldest) {
+            min_queue_.pop_front();
+        }
+        if (!max_queue_.empty() && max_queue_.front() == oldest) {
+            max_queue_.pop_front();
+        }
+        count_--;
+    }
+
+}; // class RollingStats
+
+/**
+ * @brief DerivedMetrics turns new values of datapoints into new values of derived datapoints:
+ * rolling statistics (DERIVED_STATS in config.h) and virtual datapoints (VIRTUAL_DATAPOINTS).
+ * The tables are compiled once, into an input slot for every datapoint they use, holding its
+ * latest value, its RollingStats (if it needs them), and the indexes of what it feeds.
+ * PacketList looks up a datapoint's slot once, and keeps it in Packet_t::derived_inputs.
+ *
+ * Derived datapoints are ordinary packets, so they're displayed, checked by the alarm rules,
+ * and sent to Influx like any other. They aren't themselves inputs, so there are no loops.
+ */
+
+class DerivedMetrics {
+
+private:
+    struct InputSlot {
+        float value = 0;
+        bool has_value = false;
+        RollingStats* stats = NULL;
+        std::vector<uint8_t> derived_stats;     // indexes in stats_
+        std::vector<uint8_t> virtual_outputs;   // indexes in virtuals_
+    };
+
+    struct CompiledVirtual {
+        String data_source;
+        String data_name;
+        int16_t a_slot;
+        int16_t b_slot;
+        char op;
+        uint8_t decimals;
+    };
+
+    struct CompiledStat {
+        String output_name;
+        derived_stat_t stat;
+        uint8_t decimals;
+    };
+
+    std::vector<InputSlot> slots_;
+    std::vector<CompiledStat> stats_;
+    std::vector<CompiledVirtual> virtuals_;
+    std::map<String, int16_t> slot_index_;
+
+    static String datapoint_key(const String& data_source, const String& data_name) {
+        return data_source + "/" + data_name;
+    }
+
+    int16_t slot_for(const String& data_source, const String& data_name) {
+        String key = datapoint_key(data_source, data_name);
+        auto it = slot_index_.find(key);
+        if (it != slot_index_.end()) {
+            return it->second;
+        }
+        slots_.push_back(InputSlot());
+        slot_index_[key] = slots_.size() - 1;
+        return slots_.size() - 1;
+    }
+
+    /**
+     * @param input The new value it was derived from. A virtual datapoint can come from two
+     * transmitters, so it gets a transmitter_address of 0, and a unique_id of its own.
+     */
+
+    static Packet_t derived_packet(const Packet_t& input, bool is_virtual, const String& data_source,
+                                   const String& data_name, float value, uint8_t decimals) {
+        Packet_t packet;
+        packet.transmitter_address = is_virtual ? 0 : input.transmitter_address;
+        packet.data_source = data_source;
+        packet.data_name = data_name;
+        packet.data_value = String(value, (unsigned int)decimals);
+        packet.unique_id = is_virtual ? data_source + "/" + data_name : String(input.transmitter_address) + data_name;
+        packet.RSSI = input.RSSI;
+        packet.SNR = input.SNR;
+        packet.timestamp = input.timestamp;
+        return packet;
+    }
+
+public:
+
+    DerivedMetrics() {
+#ifdef DERIVED_STATS
+        static const DerivedStat stat_table[] = DERIVED_STATS;
+        for (const DerivedStat& row : stat_table) {
+            InputSlot& slot = slots_[slot_for(row.data_source, row.data_name)];
+            if (slot.stats == NULL) {
+                slot.stats = new RollingStats();
+            }
+            CompiledStat stat;
+            stat.output_name = row.output_name;
+            stat.stat = row.stat;
+            stat.decimals = row.decimals;
+            slot.derived_stats.push_back(stats_.size());
+            stats_.push_back(stat);
+        }
+#endif
+#ifdef VIRTUAL_DATAPOINTS
+        static const VirtualDatapoint virtual_table[] = VIRTUAL_DATAPOINTS;
+        for (const VirtualDatapoint& row : virtual_table) {
+            CompiledVirtual compiled;
+            compiled.data_source = row.data_source;
+            compiled.data_name = row.data_name;
+            compiled.a_slot = slot_for(row.a_source, row.a_name);
+            compiled.b_slot = slot_for(row.b_source, row.b_name);
+            compiled.op = row.op;
+            compiled.decimals = row.decimals;
+            slots_[compiled.a_slot].virtual_outputs.push_back(virtuals_.size());
+            if (compiled.b_slot != compiled.a_slot) {
+                slots_[compiled.b_slot].virtual_outputs.push_back(virtuals_.size());
+            }
+            virtuals_.push_back(compiled);
+        }
+#endif
+    }
+
+    /**
+     * @brief Look up a datapoint's input slot, once, when it's first added to PacketList.
+     *
+     * @return the value for Packet_t::derived_inputs: -1 if nothing is derived from it
+     */
+
+    int16_t find_input(const String& data_source, const String& data_name) {
+        auto it = slot_index_.find(datapoint_key(data_source, data_name));
+        return it == slot_index_.end() ? -1 : it->second;
+    }
+
+    /**
+     * @brief Add a datapoint's new value, and get the new values of everything derived from it.
+     *
+     * @param datapoint The datapoint's entry in PacketList
+     * @param outputs Gets the derived packets - room for MAX_DERIVED_PER_VALUE
+     * @return the number of derived packets
+     */
+
+    uint8_t update(const Packet_t& datapoint, Packet_t* outputs) {
+        int16_t index = datapoint.derived_inputs;
+        if (index < 0 || index >= (int16_t)slots_.size()) {
+            return 0;
+        }
+        InputSlot& slot = slots_[index];
+        slot.value = datapoint.data_value.toFloat();
+        slot.has_value = true;
+        uint8_t count = 0;
+        if (slot.stats != NULL) {
+            slot.stats->add(datapoint.timestamp, slot.value);
+            for (uint8_t i : slot.derived_stats) {
+                float result;
+                if (count < MAX_DERIVED_PER_VALUE && slot.stats->get(stats_[i].stat, &result)) {
+                    outputs[count++] = derived_packet(datapoint, false, datapoint.data_source, stats_[i].output_name,
+                                                      result, stats_[i].decimals);
+                }
+            }
+        }
+        for (uint8_t i : slot.virtual_outputs) {
+            const CompiledVirtual& compiled = virtuals_[i];
+            const InputSlot& a = slots_[compiled.a_slot];
+            const InputSlot& b = slots_[compiled.b_slot];
+            if (!a.has_value || !b.has_value || count >= MAX_DERIVED_PER_VALUE) {
+                continue;
+            }
+            float result;
+            switch (compiled.op) {
+                case '+': result = a.value + b.value; break;
+                case '-': result = a.value - b.value; break;
+                case '*': result = a.value * b.value; break;
+                case '/':
+                    if (b.value == 0) {
+                        continue;
+                    }
+                    result = a.value / b.value;
+                    break;
+                default: continue;
+            }
+            outputs[count++] = derived_packet(datapoint, true, compiled.data_source, compiled.data_name,
+                                              result, compiled.decimals);
+        }
+        return count;
+    }
+
+}; // class DerivedMetrics
+
+#endif // _DERIVED_METRICS_H_
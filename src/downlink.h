@@ -0,0 +1,178 @@
+#ifndef _DOWNLINK_H_
+#define _DOWNLINK_H_
+
+#include <Arduino.h>
+#include <map>
+#include <deque>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include "config.h"
+#include "reyax_lora.h"
+
+#define DOWNLINK_MAX_ATTEMPTS 3        // sends of one command before giving up on it
+#define DOWNLINK_MAX_PENDING 4         // commands waiting for one transmitter
+#define DOWNLINK_RESEND_GUARD_MS 2000  // an uplink heard by two radios gets one downlink, not two
+
+// The command types. Each is one character in the downlink payload.
+#define DOWNLINK_ACK 'A'               // acknowledge an uplink: the argument is its sequence number
+#define DOWNLINK_SET_INTERVAL 'I'      // reporting interval, in seconds
+#define DOWNLINK_SET_THRESHOLDS 'T'    // data_name%low alarm value%high alarm value
+#define DOWNLINK_READ_NOW 'R'          // send a reading right away
+
+struct DownlinkCommand {
+    uint8_t message_id = 0;
+    char type = DOWNLINK_READ_NOW;
+    String arguments = "";
+    uint8_t attempts = 0;
+    uint32_t last_sent_ms = 0;
+};
+
+/**
+ * @brief DownlinkQueue sends commands from the base station to the transmitters. Transmitters
+ * spend most of their time asleep, so a command waits in a per-transmitter queue until that
+ * transmitter's next uplink, then it's sent in the receive window right after the uplink.
+ *
+ * A command is sent as the <Data> of an AT+SEND:
+ *    @message_id%type%arguments        for example "@17%I%300"
+ * and the transmitter acknowledges it in the <Data> of its next uplink:
+ *    @message_id                       for example "@17"
+ * Until it's acknowledged, the command is sent again after every uplink, up to
+ * DOWNLINK_MAX_ATTEMPTS times. DOWNLINK_ACK commands aren't acknowledged, so they're sent once.
+ * The same uplink heard by another radio (within DOWNLINK_RESEND_GUARD_MS) doesn't send it again.
+ *
+ * Commands are queued by WebApi's POST /downlink - see web_api.h.
+ *
+ * Every transmission is charged against an airtime budget of DOWNLINK_DUTY_CYCLE_PERCENT
+ * (see config.h), using the time on air of the radio profile of the LoRa that sends it. There's
+ * one budget for the whole base station, however many radios it has. A command that doesn't
+ * fit in the budget waits for a later uplink.
+ */
+
+class DownlinkQueue {
+
+private:
+    std::map<uint16_t, std::deque<DownlinkCommand>> pending_;
+    SemaphoreHandle_t mutex_ = NULL;
+    uint8_t next_message_id_ = 1;
+    float airtime_budget_ms_ = DOWNLINK_MAX_BUDGET_MS;
+    uint32_t budget_updated_ms_ = 0;
+
+    /**
+     * @brief Add the airtime earned since the last update to the budget.
+     */
+
+    void update_budget(uint32_t now_ms) {
+        airtime_budget_ms_ += (now_ms - budget_updated_ms_) * DOWNLINK_DUTY_CYCLE_PERCENT / 100.0;
+        if (airtime_budget_ms_ > DOWNLINK_MAX_BUDGET_MS) {
+            airtime_budget_ms_ = DOWNLINK_MAX_BUDGET_MS;
+        }
+        budget_updated_ms_ = now_ms;
+    }
+
+    bool add_command(uint16_t address, char type, String arguments) {
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        std::deque<DownlinkCommand>& commands = pending_[address];
+        bool added = commands.size() < DOWNLINK_MAX_PENDING;
+        if (added) {
+            DownlinkCommand command;
+            command.message_id = next_message_id_++;
+            if (next_message_id_ == 0) {
+                next_message_id_ = 1; // 0 is never used, so "@0" can't be mistaken for an ack
+            }
+            command.type = type;
+            command.arguments = arguments;
+            commands.push_back(command);
+            Serial.println("Downlink to " + String(address) + " queued: " + String(type) + " " + arguments);
+        }
+        else {
+            Serial.println("Downlink queue for " + String(address) + " is full");
+        }
+        xSemaphoreGive(mutex_);
+        return added;
+    }
+
+public:
+
+    DownlinkQueue() {
+        mutex_ = xSemaphoreCreateMutex();
+    }
+
+    bool set_reporting_interval(uint16_t address, uint32_t seconds) {
+        return add_command(address, DOWNLINK_SET_INTERVAL, String(seconds));
+    }
+
+    bool set_alarm_thresholds(uint16_t address, String data_name, float low, float high) {
+        return add_command(address, DOWNLINK_SET_THRESHOLDS, data_name + "%" + String(low, 2) + "%" + String(high, 2));
+    }
+
+    bool request_reading(uint16_t address) {
+        return add_command(address, DOWNLINK_READ_NOW, "");
+    }
+
+    bool acknowledge(uint16_t address, uint16_t sequence) {
+        return add_command(address, DOWNLINK_ACK, String(sequence));
+    }
+
+    /**
+     * @brief Call right after every uplink from a transmitter, to send it the first
+     * command that's waiting for it, if there is one and the airtime budget allows it.
+     *
+     * @param lora The radio that heard the uplink, which is on the transmitter's frequency
+     */
+
+    void on_uplink(uint16_t address, ReyaxLoRa* lora) {
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        auto it = pending_.find(address);
+        if (it != pending_.end() && !it->second.empty()) {
+            DownlinkCommand& command = it->second.front();
+            uint32_t now_ms = millis();
+            if (command.attempts > 0 && now_ms - command.last_sent_ms < DOWNLINK_RESEND_GUARD_MS) {
+                xSemaphoreGive(mutex_);
+                return;
+            }
+            String data = "@" + String(command.message_id) + "%" + String(command.type);
+            if (command.arguments.length() > 0) {
+                data += "%" + command.arguments;
+            }
+            float airtime_ms = lora->time_on_air_ms(data.length());
+            update_budget(now_ms);
+            if (airtime_ms > airtime_budget_ms_) {
+                Serial.println("Downlink to " + String(address) + " deferred: airtime budget is "
+                               + String(airtime_budget_ms_, 0) + " ms, it needs " + String(airtime_ms, 0) + " ms");
+            }
+            else if (lora->queue_command("AT+SEND=" + String(address) + "," + String(data.length()) + "," + data,
+                                          AT_SEND_TIMEOUT_MS)) {
+                airtime_budget_ms_ -= airtime_ms;
+                command.attempts++;
+                command.last_sent_ms = now_ms;
+                if (command.type == DOWNLINK_ACK) {
+                    it->second.pop_front();
+                }
+                else if (command.attempts >= DOWNLINK_MAX_ATTEMPTS) {
+                    Serial.println("Downlink " + String(command.message_id) + " to " + String(address)
+                                   + " sent for the last time without an acknowledgement");
+                    it->second.pop_front();
+                }
+            }
+        }
+        xSemaphoreGive(mutex_);
+    }
+
+    /**
+     * @brief Handle an uplink whose <Data> is a transmitter's acknowledgement: "@message_id"
+     */
+
+    void on_acknowledgement(uint16_t address, const String& data) {
+        uint8_t message_id = data.substring(1).toInt();
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        auto it = pending_.find(address);
+        if (it != pending_.end() && !it->second.empty() && it->second.front().message_id == message_id) {
+            Serial.println("Downlink " + String(message_id) + " acknowledged by " + String(address));
+            it->second.pop_front();
+        }
+        xSemaphoreGive(mutex_);
+    }
+
+}; // class DownlinkQueue
+
+#endif // _DOWNLINK_H_
@@ -0,0 +1,186 @@
+#ifndef _EVENT_STREAM_H_
+#define _EVENT_STREAM_H_
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <freertos/FreeRTOS.h>
+#include "packet_t.h"
+
+#define EVENT_STREAM_MAX_CLIENTS 4
+#define EVENT_QUEUE_LENGTH 8            // messages waiting to be sent, per client
+#define EVENT_MESSAGE_SIZE 200          // the longest message, with the SSE framing
+#define EVENT_KEEPALIVE_MS 15000        // so dead connections are noticed
+
+/**
+ * @brief EventStream pushes every update of a datapoint to the browsers on the LAN, as
+ * Server-Sent Events (GET /events - see web_api.h), instead of making them poll /datapoints:
+ *
+ *   event: update
+ *   data: {"id":"Home_temp","v":"72.5","a":0,"s":"normal","r":-80,"n":9,"t":120000}
+ *
+ * (value, alarm_code, alarm state, RSSI, SNR, and the time of the update in ms since boot).
+ *
+ * publish() is called by the packet queue task. It renders the message once, copies it into
+ * each client's queue and returns - it never waits for the network. Each client has a queue
+ * of EVENT_QUEUE_LENGTH messages, and a client that can't keep up loses its oldest messages,
+ * not anyone else's. The web task sends the queued messages with send_pending().
+ */
+
+class EventStream {
+
+private:
+    struct EventClient {
+        WiFiClient client;
+        bool active = false;
+        char messages[EVENT_QUEUE_LENGTH][EVENT_MESSAGE_SIZE];
+        uint16_t lengths[EVENT_QUEUE_LENGTH];
+        uint8_t first = 0;
+        uint8_t count = 0;
+        uint32_t last_sent_ms = 0;
+    };
+
+    EventClient clients_[EVENT_STREAM_MAX_CLIENTS];
+    portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;  // guards the queues, not the sockets
+    uint32_t messages_dropped_ = 0;
+
+    /**
+     * @brief Append str, JSON-escaped, to buffer (which holds length of size bytes).
+     * Control characters are left out.
+     */
+
+    static size_t append_escaped(char* buffer, size_t length, size_t size, const char* str) {
+        for (const char* c = str; *c != '\0' && length + 2 < size; c++) {
+            if (*c == '"' || *c == '\\') {
+                buffer[length++] = '\\';
+                buffer[length++] = *c;
+            }
+            else if ((uint8_t)*c >= 0x20) {
+                buffer[length++] = *c;
+            }
+        }
+        buffer[length] = '\0';
+        return length;
+    }
+
+    static size_t render(const Packet_t& datapoint, char* message) {
+        size_t length = snprintf(message, EVENT_MESSAGE_SIZE, "event: update\ndata: {\"id\":\"");
+        length = append_escaped(message, length, EVENT_MESSAGE_SIZE - 80, datapoint.unique_id.c_str());
+        length += snprintf(message + length, EVENT_MESSAGE_SIZE - length, "\",\"v\":\"");
+        length = append_escaped(message, length, EVENT_MESSAGE_SIZE - 70, datapoint.data_value.c_str());
+        length += snprintf(message + length, EVENT_MESSAGE_SIZE - length,
+                           "\",\"a\":%d,\"s\":\"%s\",\"r\":%d,\"n\":%d,\"t\":%u}\n\n",
+                           datapoint.alarm_code, AlarmFsm::state_name(datapoint.alarm_fsm.state()),
+                           datapoint.RSSI, datapoint.SNR, (unsigned)datapoint.timestamp);
+        return length < EVENT_MESSAGE_SIZE ? length : EVENT_MESSAGE_SIZE - 1;
+    }
+
+    void queue(EventClient& event_client, const char* message, size_t length) {
+        if (event_client.count == EVENT_QUEUE_LENGTH) { // drop the oldest
+            event_client.first = (event_client.first + 1) % EVENT_QUEUE_LENGTH;
+            event_client.count--;
+            messages_dropped_++;
+        }
+        uint8_t slot = (event_client.first + event_client.count) % EVENT_QUEUE_LENGTH;
+        memcpy(event_client.messages[slot], message, length);
+        event_client.lengths[slot] = length;
+        event_client.count++;
+    }
+
+public:
+
+    /**
+     * @brief Take over the connection of a GET /events request. Called by the web task.
+     *
+     * @return false if there are already EVENT_STREAM_MAX_CLIENTS clients
+     */
+
+    bool add_client(WiFiClient client) {
+        for (EventClient& event_client : clients_) {
+            if (!event_client.active) {
+                client.setNoDelay(true);
+                client.print("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+                             "Cache-Control: no-cache\r\nConnection: keep-alive\r\n\r\n"
+                             ": connected\n\n");
+                event_client.client = client;
+                portENTER_CRITICAL(&lock_);
+                event_client.first = 0;
+                event_client.count = 0;
+                event_client.active = true;
+                portEXIT_CRITICAL(&lock_);
+                event_client.last_sent_ms = millis();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Queue an update of a datapoint for every client. Never waits.
+     */
+
+    void publish(const Packet_t& datapoint) {
+        char message[EVENT_MESSAGE_SIZE];
+        size_t length = 0;
+        for (EventClient& event_client : clients_) {
+            if (!event_client.active) {
+                continue;
+            }
+            if (length == 0) {
+                length = render(datapoint, message);
+            }
+            portENTER_CRITICAL(&lock_);
+            if (event_client.active) {
+                queue(event_client, message, length);
+            }
+            portEXIT_CRITICAL(&lock_);
+        }
+    }
+
+    /**
+     * @brief Send what's queued for each client, and drop the clients that have gone.
+     * Called by the web task.
+     */
+
+    void send_pending() {
+        char message[EVENT_MESSAGE_SIZE];
+        for (EventClient& event_client : clients_) {
+            if (!event_client.active) {
+                continue;
+            }
+            if (!event_client.client.connected()) {
+                portENTER_CRITICAL(&lock_);
+                event_client.active = false;
+                portEXIT_CRITICAL(&lock_);
+                event_client.client.stop();
+                continue;
+            }
+            while (true) {
+                size_t length = 0;
+                portENTER_CRITICAL(&lock_);
+                if (event_client.count > 0) {
+                    length = event_client.lengths[event_client.first];
+                    memcpy(message, event_client.messages[event_client.first], length);
+                    event_client.first = (event_client.first + 1) % EVENT_QUEUE_LENGTH;
+                    event_client.count--;
+                }
+                portEXIT_CRITICAL(&lock_);
+                if (length == 0) {
+                    break;
+                }
+                event_client.client.write((const uint8_t*)message, length);
+                event_client.last_sent_ms = millis();
+            }
+            if (millis() - event_client.last_sent_ms >= EVENT_KEEPALIVE_MS) {
+                event_client.client.print(": keepalive\n\n");
+                event_client.last_sent_ms = millis();
+            }
+        }
+    }
+
+    uint32_t messages_dropped() {
+        return messages_dropped_;
+    }
+
+}; // class EventStream
+
+#endif // _EVENT_STREAM_H_
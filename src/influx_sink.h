@@ -0,0 +1,67 @@
+#ifndef _INFLUX_SINK_H_
+#define _INFLUX_SINK_H_
+
+#include <Arduino.h>
+#include <InfluxDbClient.h>
+#include "config.h"
+#include "sink.h"
+#include "metrics.h"
+
+/**
+ * @brief InfluxSink writes each value to InfluxDB (v1) as a point in the "packets" measurement,
+ * and each aggregate in the "aggregates" measurement, tagged with its window length.
+ * One HTTP request per point.
+ */
+
+class InfluxSink : public Sink {
+
+private:
+    InfluxDBClient* influxdb_;
+
+    bool write_point(Point& point) {
+        if (!influxdb_->writePoint(point)) {
+            Serial.println("InfluxDB write failed: " + influxdb_->getLastErrorMessage());
+            metrics.influx_writes_failed++;
+            return false;
+        }
+        metrics.influx_writes_ok++;
+        return true;
+    }
+
+public:
+
+    InfluxSink() {
+        influxdb_ = new InfluxDBClient(INFLUXDB_URL, INFLUXDB_DB_NAME);
+        influxdb_->setConnectionParamsV1(INFLUXDB_URL, INFLUXDB_DB_NAME, INFLUXDB_USER, INFLUXDB_PASSWORD);
+    }
+
+    bool write(const Packet_t& packet) override {
+        Point point("packets");
+        point.addTag("source", packet.data_source);
+        point.addTag("name", packet.data_name);
+        point.addField("value", packet.data_value.toFloat());
+        point.addField("alarm", packet.alarm_code);
+        point.addField("rssi", packet.RSSI);
+        point.addField("snr", packet.SNR);
+        return write_point(point);
+    }
+
+    bool write_aggregate(const AggregateWindow& window) override {
+        Point point("aggregates");
+        point.addTag("source", window.data_source);
+        point.addTag("name", window.data_name);
+        point.addTag("window", String(window.window_ms / 60000) + "m");
+        point.addField("min", window.min);
+        point.addField("max", window.max);
+        point.addField("mean", (float)(window.sum / window.count));
+        point.addField("count", (long)window.count);
+        point.addField("last", window.last);
+        point.addField("alarm", window.alarm_code);
+        point.addField("rssi", window.RSSI);
+        point.addField("snr", window.SNR);
+        return write_point(point);
+    }
+
+}; // class InfluxSink
+
+#endif // _INFLUX_SINK_H_
@@ -4,11 +4,20 @@
 #include <Arduino.h>
 #include <WiFi.h>
 #include <HTTPClient.h>
-#include <InfluxDbClient.h>
 #include <EMailSender.h>
+#include <vector>
 #include "config.h"
 #include "ui.h"
 #include "packet_list.h"
+#include "aggregator.h"
+#include "metrics.h"
+#include "sink.h"
+#ifdef INFLUX_SINK
+#include "influx_sink.h"
+#endif
+#ifdef MQTT_SINK
+#include "mqtt_sink.h"
+#endif
 
 /**
  * @brief Class that manages all connections to, and interactions with, the Internet.
@@ -20,20 +29,24 @@ private:
     const char* wifi_ssid_ = SSID;
     const char* wifi_pw_ = PASSWORD;
     UI* ui_;
-    InfluxDBClient* influxdb_;
+    std::vector<Sink*> sinks_;     // where the influx queue goes - see sink.h
     EMailSender* email_sender_;
     EMailSender::EMailMessage email_message_;
     EMailSender::Response email_response_;
+    Aggregator aggregator_;
+    PacketList* packet_list_ = NULL;   // whose alarms are emailed
+    TaskHandle_t email_task_ = NULL;
 
     /**
      * @brief The function that will ultimately be run as a Task,
-     * every 10 seconds. (But only after being called in start_task_impl(), below.)
+     * every 10 seconds - or as soon as an alarm is queued, so alarms reach the sinks
+     * without waiting out the period. (But only after being called in start_task_impl(), below.)
      */
     
     void handle_influx_queue_task() {
         while (1) {
             this->handle_influx_queue();
-            vTaskDelay(10000 / portTICK_RATE_MS);
+            ulTaskNotifyTake(pdTRUE, 10000 / portTICK_RATE_MS);
         }
     }
 
@@ -47,26 +60,81 @@ private:
         static_cast<Internet*>(_this)->handle_influx_queue_task();
     }
 
+    /**
+     * @brief The function that will be run as the alarm email task. It sleeps until
+     * request_alarm_emails() wakes it, so the SMTP/TLS work happens on NETWORK_TASK_CORE,
+     * not in loop() next to radio ingest.
+     */
+
+    void send_alarm_emails_task() {
+        while (1) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            send_alarm_emails();
+        }
+    }
+
+    /**
+     * @brief Allows send_alarm_emails_task(), above, to be called from
+     * within xTaskCreate from inside a class method.
+     * https://stackoverflow.com/questions/45831114
+     */
+
+    static void start_send_alarm_emails_task(void* _this) {
+        static_cast<Internet*>(_this)->send_alarm_emails_task();
+    }
+
+    /**
+     * @brief Allows send_aggregate() to be the Aggregator's sender.
+     */
+
+    static bool send_aggregate_impl(void* _this, const AggregateWindow& window) {
+        return static_cast<Internet*>(_this)->send_aggregate(window);
+    }
+
 public:
     
     /**
      * @brief Construct a new Internet object.
      */
     Internet(UI* ui) : ui_{ui} {
-        influxdb_ = new InfluxDBClient(INFLUXDB_URL, INFLUXDB_DB_NAME);
-        influxdb_->setConnectionParamsV1(INFLUXDB_URL, INFLUXDB_DB_NAME, INFLUXDB_USER, INFLUXDB_PASSWORD);
+#ifdef INFLUX_SINK
+        sinks_.push_back(new InfluxSink());
+#endif
+#ifdef MQTT_SINK
+        sinks_.push_back(new MqttSink());
+#endif
         email_sender_ = new EMailSender(EMAIL_SENDER_ADDRESS, GMAIL_APP_PASSWORD);
         email_message_.subject = "Message from LoRa Receiver";
         email_message_.mime = MIME_TEXT_PLAIN;
     }
 
     /**
-     * @brief Starts the task that sends new packets from the Influx queue to InfluxDB.
+     * @brief Starts the task that sends new packets from the Influx queue to the sinks, and
+     * the task that sends the alarm emails for packet_list. Both are pinned to NETWORK_TASK_CORE,
+     * with the WiFi stack - see the task topology in config.h.
      * https://stackoverflow.com/questions/45831114
      */
     
-    void start_tasks() {
-        xTaskCreate(this->start_handle_influx_queue_task, "handle_influx_queue", 10000, this, 1, NULL);
+    void start_tasks(PacketList* packet_list) {
+        packet_list_ = packet_list;
+        for (Sink* sink : sinks_) {
+            sink->begin();
+        }
+        xTaskCreatePinnedToCore(this->start_handle_influx_queue_task, "handle_influx_queue", 10000, this,
+                                HANDLE_INFLUX_QUEUE_PRIORITY, &send_to_influx_queue.consumer, NETWORK_TASK_CORE);
+        xTaskCreatePinnedToCore(this->start_send_alarm_emails_task, "send_alarm_emails", 12000, this,
+                                SEND_ALARM_EMAILS_PRIORITY, &email_task_, NETWORK_TASK_CORE);
+    }
+
+    /**
+     * @brief Wake up the alarm email task, to look for alarms that need an email.
+     * Returns right away - the emails are sent by that task.
+     */
+
+    void request_alarm_emails() {
+        if (email_task_ != NULL) {
+            xTaskNotifyGive(email_task_);
+        }
     }
 
     /**
@@ -104,8 +172,8 @@ public:
         }
         else {
             Serial.println("Connected to " + WiFi.localIP().toString());
-            configTime(-18000, 3600, "pool.ntp.org"); // Connect to NTP server with -5 TZ offset (-18000), 1 hr DST offset (3600).
-            if (ui_->system_time_is_valid()) {
+            ui_->clock()->begin(); // sync the system time with NTP, in TIMEZONE
+            if (ui_->clock()->wait_until_valid(5000)) {
                 Serial.print("New time: ");
                 ui_->update_bottom_line(ui_->date_time_str());
                 ui_->update_status_lines("Set system time", ui_->date_time_str(), 3);
@@ -122,55 +190,76 @@ public:
 
     /**
      * @brief Set as an xTask to run a few times per minute, to check for new packets in
-     * the influx queue, and send them to InfluxDB.
+     * the influx queue, and send them to the sinks - as they are, or as part of their
+     * datapoint's aggregate (see aggregator.h), or both.
      */
 
     void handle_influx_queue() {
         if (WiFi.status() == WL_CONNECTED) {
+            for (Sink* sink : sinks_) {
+                sink->begin_batch();
+            }
             Packet_t packet;
+            uint16_t sent = 0;
+            uint16_t failed = 0;
             while (read_packet_from_influx_queue(&packet)) {
-                if (!packet.sent_to_influx) {
-                    if (send_one_packet_to_influx(packet.data_source, packet.data_name, packet.data_value, packet.alarm_code,
-                                              packet.RSSI, packet.SNR)) {
-                                                packet.sent_to_influx = true;
-                                              }
+                if (aggregator_.add(packet, send_aggregate_impl, this) && !packet.sent_to_influx) {
+                    if (send_one_packet(packet)) {
+                        packet.sent_to_influx = true;
+                        sent++;
+                    }
+                    else {
+                        failed++;
+                    }
                 }
             }
+            aggregator_.flush(millis(), send_aggregate_impl, this);
+            for (Sink* sink : sinks_) {
+                sink->end_batch();
+            }
+            // One status for the whole batch, shown by loop() - this task never waits for the display
+            if (sent > 0 || failed > 0) {
+                ui_->post_status("Sent " + String(sent) + " values", failed > 0 ? String(failed) + " write fail" : "");
+            }
+        }
+    }
+
+    /**
+     * @brief Sends one window of an aggregated datapoint to every sink.
+     *
+     * @return false if any sink lost it
+     */
+
+    bool send_aggregate(const AggregateWindow& window) {
+        Serial.println("Sending " + String(window.count) + " values of " + window.data_name);
+        bool all_ok = true;
+        for (Sink* sink : sinks_) {
+            all_ok = sink->write_aggregate(window) && all_ok;
         }
+        return all_ok;
     }
 
     /**
-     * @brief Sends one datapoint to InfluxDB 
+     * @brief Sends one datapoint to every sink
+     *
+     * @return false if any sink lost it
      */
 
-    bool send_one_packet_to_influx(String data_source, String data_name, String data_value, uint16_t alarm_code = 0,
-                             int8_t RSSI = 0, int8_t SNR = 0) {
-        Serial.println("Sending one new packet to InfluxDB");
-        ui_->update_status_lines("Sending to Influx", "");
+    bool send_one_packet(const Packet_t& packet) {
+        Serial.println("Sending one new packet");
         if (!connected_to_wifi()) {
             if (!connect_to_wifi()) {
                 return false;
             }
         }
-        Point packet("packets");
-        packet.addTag("source", data_source);
-        packet.addTag("name", data_name);
-        packet.addField("value", data_value.toFloat());
-        packet.addField("alarm", alarm_code);
-        packet.addField("rssi", RSSI);
-        packet.addField("snr", SNR);
-        if (!influxdb_->writePoint(packet)) {
-            Serial.println("InfluxDB write failed: " + influxdb_->getLastErrorMessage());
-            ui_->update_status_lines("Sending to Influx", "Influx write fail", 2);
-            ui_->update_status_lines("Waiting for data", "");
-            return false;
+        bool all_ok = true;
+        for (Sink* sink : sinks_) {
+            all_ok = sink->write(packet) && all_ok;
         }
-        else {
-            Serial.println("InfluxDB write successful");
-            ui_->update_status_lines("Sending to Influx", "Influx write OK", 2);
-            ui_->update_status_lines("Waiting for data", "");
-            return true;
+        if (all_ok) {
+            Serial.println("Data write successful");
         }
+        return all_ok;
     }
 
     String get_ssid() {
@@ -189,12 +278,15 @@ public:
      * condition continues. 
      * 
      * A max_alarm_emails_to_send of 0 means no email will ever be sent.
-     * 
-     * @param first_packet An iterator to PacketList::packets.begin()
-     * @param end_of_packets An iterator to PacketList::packets.end()
+     *
+     * The packet task changes the datapoints all the time, so they're read (and their email
+     * bookkeeping changed) only with packet_list_ locked - but not while an email is being sent,
+     * which takes seconds. The emails that are due are found, and their text made, under the
+     * lock; each one is then sent, and counted under the lock again. (Entries in PacketList are
+     * never removed, so the pointers to them stay good.)
      */
 
-    void send_alarm_emails(Packet_it_t first_packet, Packet_it_t end_of_packets) {
+    void send_alarm_emails() {
         Serial.println("Looking for alarms that need an email sent");
         ui_->update_status_lines("Looking for old", "alarms to text", 2);
         bool email_attempted = false;
@@ -207,7 +299,14 @@ public:
         if (ui_->system_time_is_valid()) { // check again, after connect_to_wifi() has run
             time_t now; // create a time_t (the number of seconds since 1/1/1970) called "now"
             time(&now); // set "now" to the system clock's time
-            for (Packet_it_t it = first_packet; it != end_of_packets; ++it) {
+            struct DueEmail {
+                Packet_t* datapoint;
+                String message_text;
+                bool to_garden;
+            };
+            std::vector<DueEmail> due_emails;
+            packet_list_->lock();
+            for (Packet_it_t it = packet_list_->get_packets_begin(); it != packet_list_->get_packets_end(); ++it) {
                 if (it->alarm_email_interval > 0 && it->max_alarm_emails_to_send > 0 && it->alarm_emails_sent < it->max_alarm_emails_to_send) {
                     
                     // Handle rare case where alarm comes in but system time is invalid, so first_alarm_time gets set to 0
@@ -221,35 +320,48 @@ public:
                         String message_text = ui_->date_time_str() + " (Msg # " + (it->alarm_emails_sent + 1) + ")\n" 
                            + it->data_source + " " + it->data_name + ": " + it->data_value + "\nAlarm condition began on\n" 
                            + ui_->date_time_str(first_alarm);
-                        Serial.println(message_text);
-                        email_message_.message = message_text;
-                        if (!connected_to_wifi()) {
-                            connect_to_wifi();
-                        }
-                        if (connected_to_wifi()) { // check again - connect_to_wifi() might have failed
-                            if (it->data_source != "Garden") {
-                                email_response_ = email_sender_->send(BS_EMAIL, email_message_);
-                            }
-                            else { // Any tower garden-related email goes to BS and FM
-                                const char* arrayOfEmail[] = {BS_EMAIL, FM_EMAIL};
-                                email_response_ = email_sender_->send(arrayOfEmail, 2, email_message_);
-                            }
-                            email_attempted = true;
-                            Serial.println("Sending email");
-                            Serial.println("email_response_.code: " + email_response_.code);
-                            if (email_response_.code.toInt() == 0) { // email sent successfully
-                                it->alarm_emails_sent++;
-                            }
-                            // Don't sound alarm w/ 1st email - it just sounded in display_one_packet().
-                            // (If only the 1st email has been sent, alarm_emails_sent is now 1)
-                            // And don't sound it unless it's daytime
-                            if (it->alarm_emails_sent > 1 && ui_->its_daytime()) {
-                                ui_->sound_alarm(it->alarm_code);
-                            }
-                        } // end of what happens if an alarm email was attempted for this datapoint (packet)
+                        due_emails.push_back({&*it, message_text, it->data_source == "Garden"});
                     } // end of what happens if an alarm email should be sent
                 } // end of what happens if an alarm email is a possibility for this datapoint (packet)
             } // end of processing all the datapoints (packets)
+            packet_list_->unlock();
+            for (DueEmail& due_email : due_emails) {
+                Serial.println(due_email.message_text);
+                email_message_.message = due_email.message_text;
+                if (!connected_to_wifi()) {
+                    connect_to_wifi();
+                }
+                if (!connected_to_wifi()) { // check again - connect_to_wifi() might have failed
+                    break;
+                }
+                if (!due_email.to_garden) {
+                    email_response_ = email_sender_->send(BS_EMAIL, email_message_);
+                }
+                else { // Any tower garden-related email goes to BS and FM
+                    const char* arrayOfEmail[] = {BS_EMAIL, FM_EMAIL};
+                    email_response_ = email_sender_->send(arrayOfEmail, 2, email_message_);
+                }
+                email_attempted = true;
+                Serial.println("Sending email");
+                Serial.println("email_response_.code: " + email_response_.code);
+                packet_list_->lock();
+                if (email_response_.code.toInt() == 0) { // email sent successfully
+                    due_email.datapoint->alarm_emails_sent++;
+                    metrics.emails_sent++;
+                }
+                else {
+                    metrics.emails_failed++;
+                }
+                uint16_t alarm_emails_sent = due_email.datapoint->alarm_emails_sent;
+                int16_t alarm_code = due_email.datapoint->alarm_code;
+                packet_list_->unlock();
+                // Don't sound alarm w/ 1st email - it just sounded in display_one_packet().
+                // (If only the 1st email has been sent, alarm_emails_sent is now 1)
+                // And don't sound it unless it's daytime
+                if (alarm_emails_sent > 1 && ui_->its_daytime()) {
+                    ui_->sound_alarm(alarm_code);
+                }
+            } // end of sending the emails that were due
             if (!email_attempted) {
                 Serial.println("No emails attempted");
             }
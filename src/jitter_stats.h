@@ -0,0 +1,78 @@
+#ifndef _JITTER_STATS_H_
+#define _JITTER_STATS_H_
+
+#include <Arduino.h>
+
+/**
+ * @brief JitterStats measures how late a periodic task wakes up compared to its
+ * schedule, and how long each run takes. Call record() once per run with the
+ * micros() at the start and end of the run, and it prints a summary to Serial
+ * every report_interval_ms.
+ */
+
+class JitterStats {
+
+public:
+
+    /**
+     * @brief Construct a new JitterStats object.
+     *
+     * @param name - Shown in the report, so you know which task it's about.
+     * @param period_ms - How often the task is supposed to run.
+     * @param report_interval_ms - How often to print the report.
+     */
+    JitterStats(const char* name, uint32_t period_ms, uint32_t report_interval_ms)
+        : name_{name}, period_us_{period_ms * 1000}, report_interval_us_{report_interval_ms * 1000} {}
+
+    void record(uint32_t start_us, uint32_t end_us) {
+        if (first_run_) {
+            report_start_us_ = start_us;
+            first_run_ = false;
+        }
+        else {
+            // how far from "one period after the previous start" this run started
+            int32_t late_us = (int32_t)(start_us - previous_start_us_ - period_us_);
+            uint32_t jitter_us = late_us < 0 ? -late_us : late_us;
+            if (jitter_us > max_jitter_us_) {
+                max_jitter_us_ = jitter_us;
+            }
+            total_jitter_us_ += jitter_us;
+            uint32_t run_us = end_us - start_us;
+            if (run_us > max_run_us_) {
+                max_run_us_ = run_us;
+            }
+            total_run_us_ += run_us;
+            runs_++;
+        }
+        previous_start_us_ = start_us;
+
+        if (end_us - report_start_us_ >= report_interval_us_ && runs_ > 0) {
+            Serial.println(String(name_) + " jitter (us): avg " + String((uint32_t)(total_jitter_us_ / runs_))
+                           + ", max " + String(max_jitter_us_) + " | run time (us): avg "
+                           + String((uint32_t)(total_run_us_ / runs_)) + ", max " + String(max_run_us_)
+                           + " | runs: " + String(runs_) + " | core " + String(xPortGetCoreID()));
+            runs_ = 0;
+            max_jitter_us_ = 0;
+            total_jitter_us_ = 0;
+            max_run_us_ = 0;
+            total_run_us_ = 0;
+            report_start_us_ = end_us;
+        }
+    }
+
+private:
+    const char* name_;
+    uint32_t period_us_;
+    uint32_t report_interval_us_;
+    bool first_run_ = true;
+    uint32_t report_start_us_ = 0;
+    uint32_t previous_start_us_ = 0;
+    uint32_t runs_ = 0;
+    uint32_t max_jitter_us_ = 0;
+    uint64_t total_jitter_us_ = 0;
+    uint32_t max_run_us_ = 0;
+    uint64_t total_run_us_ = 0;
+
+}; // class JitterStats
+
+#endif // _JITTER_STATS_H_
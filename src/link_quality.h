@@ -0,0 +1,272 @@
+#ifndef _LINK_QUALITY_H_
+#define _LINK_QUALITY_H_
+
+#include <Arduino.h>
+#include <map>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include "config.h"
+
+#define LINK_EWMA_WEIGHT 0.125F   // weight of the newest sample in every moving average
+#define LINK_MIN_PACKETS_FOR_ADVICE 8
+#define SEQUENCE_WINDOW_SIZE 32      // bits in LinkStats::sequence_window
+#define SEQUENCE_RESTART_GAP 1000    // a jump this big means the transmitter restarted its count
+#define RECENT_FRAME_COUNT 8         // frames per transmitter remembered by accept_frame()
+#define DUPLICATE_FRAME_WINDOW_MS 2000
+
+/**
+ * @brief Everything we know about the radio link from one transmitter.
+ */
+
+struct LinkStats {
+    uint16_t transmitter_address = 0;
+    float rssi = 0.0;                   // exponentially weighted moving averages
+    float snr = 0.0;
+    uint32_t packets_received = 0;
+    uint32_t reports_received = 0;      // bursts of packets sent together, see LINK_BURST_WINDOW_MS
+    uint32_t packets_lost = 0;          // from sequence gaps, or estimated from the report interval
+    uint32_t duplicates = 0;            // packets dropped because they'd already been received
+    bool has_sequence = false;          // true once the transmitter has sent a sequence number
+    uint16_t highest_sequence = 0;
+    uint32_t sequence_window = 0;       // bit n is set if (highest_sequence - n) has been received
+    uint32_t recent_frame_hash[RECENT_FRAME_COUNT] = {};  // see accept_frame()
+    uint32_t recent_frame_ms[RECENT_FRAME_COUNT] = {};
+    uint8_t recent_frame_count = 0;
+    uint32_t last_packet_ms = 0;
+    uint32_t last_report_ms = 0;
+    float report_interval_ms = 0.0;     // moving average of the time between reports
+    float report_jitter_ms = 0.0;       // moving average of |interval - average interval|
+};
+
+/**
+ * @brief What the link from one transmitter could use instead of the current radio profile.
+ */
+
+struct LinkAdvice {
+    int8_t spread_factor;
+    int8_t output_power;
+    float margin_db;                    // SNR above what the current SF needs to demodulate
+};
+
+/**
+ * @brief LinkQualityTable tracks the link quality of every transmitter, from the RSSI and SNR
+ * of each packet received from it, and from how regularly its packets arrive. From that, it
+ * recommends the fastest spreading factor (or the lowest output power) that still leaves
+ * LINK_MARGIN_DB of SNR margin - the same steps as LoRaWAN's adaptive data rate.
+ *
+ * A transmitter usually sends all of its datapoints in a quick burst, so packets that arrive
+ * within LINK_BURST_WINDOW_MS of each other count as one "report" for the interval statistics.
+ *
+ * update() is called by the task that parses packets, and print_link_table() from loop(),
+ * so the table is protected by a mutex.
+ */
+
+class LinkQualityTable {
+
+private:
+    std::map<uint16_t, LinkStats> links_;
+    SemaphoreHandle_t mutex_ = NULL;
+
+    static float ewma(float average, float sample) {
+        return average + LINK_EWMA_WEIGHT * (sample - average);
+    }
+
+    // FNV-1a
+    static uint32_t hash_frame(const String& data) {
+        uint32_t hash = 2166136261UL;
+        for (size_t i = 0; i < data.length(); i++) {
+            hash = (hash ^ (uint8_t)data.charAt(i)) * 16777619UL;
+        }
+        return hash;
+    }
+
+public:
+
+    LinkQualityTable() {
+        mutex_ = xSemaphoreCreateMutex();
+    }
+
+    /**
+     * @brief Add one received packet to the statistics of the transmitter that sent it.
+     */
+
+    void update(uint16_t address, int8_t rssi, int8_t snr, uint32_t now_ms) {
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        LinkStats& link = links_[address];
+        if (link.packets_received == 0) {
+            link.transmitter_address = address;
+            link.rssi = rssi;
+            link.snr = snr;
+            link.reports_received = 1;
+            link.last_report_ms = now_ms;
+        }
+        else {
+            link.rssi = ewma(link.rssi, rssi);
+            link.snr = ewma(link.snr, snr);
+            uint32_t interval_ms = now_ms - link.last_report_ms;
+            if (now_ms - link.last_packet_ms > LINK_BURST_WINDOW_MS) { // the start of a new report
+                if (link.reports_received == 1) {
+                    link.report_interval_ms = interval_ms;
+                }
+                else {
+                    // An interval much longer than usual means reports were lost in between.
+                    // (Not needed if the transmitter sends sequence numbers - they count gaps exactly.)
+                    if (!link.has_sequence && link.report_interval_ms > 0 && interval_ms > 1.5 * link.report_interval_ms) {
+                        link.packets_lost += (uint32_t)(interval_ms / link.report_interval_ms + 0.5) - 1;
+                    }
+                    link.report_jitter_ms = ewma(link.report_jitter_ms, fabs(interval_ms - link.report_interval_ms));
+                    link.report_interval_ms = ewma(link.report_interval_ms, interval_ms);
+                }
+                link.reports_received++;
+                link.last_report_ms = now_ms;
+            }
+        }
+        link.packets_received++;
+        link.last_packet_ms = now_ms;
+        xSemaphoreGive(mutex_);
+    }
+
+    /**
+     * @brief Check the sequence number of a packet against a sliding window of the last
+     * SEQUENCE_WINDOW_SIZE sequence numbers received from the same transmitter. Sequence numbers
+     * are 16 bits, and wrap around. A skipped number counts as a lost packet until (if ever)
+     * it arrives late.
+     *
+     * @return false if this sequence number has already been received (a duplicate, to be dropped)
+     */
+
+    bool accept_sequence(uint16_t address, uint16_t sequence) {
+        bool accepted = true;
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        LinkStats& link = links_[address];
+        link.transmitter_address = address;
+        int16_t ahead = (int16_t)(sequence - link.highest_sequence);
+        if (!link.has_sequence || abs(ahead) >= SEQUENCE_RESTART_GAP) { // first one, or the transmitter restarted
+            link.has_sequence = true;
+            link.highest_sequence = sequence;
+            link.sequence_window = 1;
+        }
+        else if (ahead > 0) { // newer than anything so far
+            link.packets_lost += ahead - 1;
+            link.sequence_window = ahead >= SEQUENCE_WINDOW_SIZE ? 1 : (link.sequence_window << ahead) | 1;
+            link.highest_sequence = sequence;
+        }
+        else if (-ahead < SEQUENCE_WINDOW_SIZE) { // inside the window
+            uint32_t bit = 1UL << -ahead;
+            if (link.sequence_window & bit) {
+                link.duplicates++;
+                accepted = false;
+            }
+            else { // late, but not a duplicate: it's no longer lost
+                link.sequence_window |= bit;
+                if (link.packets_lost > 0) {
+                    link.packets_lost--;
+                }
+            }
+        }
+        // else: older than the window - can't tell if it's a duplicate, so let it through
+        xSemaphoreGive(mutex_);
+        return accepted;
+    }
+
+    /**
+     * @brief Check a frame against the last RECENT_FRAME_COUNT frames from the same transmitter.
+     * When more than one radio can hear a transmitter, each of them hands over its own copy of
+     * every frame, at about the same time - and frames without a sequence number (or schemas,
+     * or acknowledgements) can't be checked by accept_sequence(). So a frame with the same <Data>
+     * as one received within DUPLICATE_FRAME_WINDOW_MS is a copy.
+     *
+     * @return false if it's a copy of a recent frame (to be dropped)
+     */
+
+    bool accept_frame(uint16_t address, const String& data, uint32_t now_ms) {
+        uint32_t hash = hash_frame(data);
+        bool accepted = true;
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        LinkStats& link = links_[address];
+        link.transmitter_address = address;
+        for (uint8_t i = 0; i < link.recent_frame_count && i < RECENT_FRAME_COUNT; i++) {
+            if (link.recent_frame_hash[i] == hash && now_ms - link.recent_frame_ms[i] < DUPLICATE_FRAME_WINDOW_MS) {
+                link.duplicates++;
+                accepted = false;
+                break;
+            }
+        }
+        if (accepted) {
+            uint8_t oldest = link.recent_frame_count++ % RECENT_FRAME_COUNT;
+            link.recent_frame_hash[oldest] = hash;
+            link.recent_frame_ms[oldest] = now_ms;
+            if (link.recent_frame_count == 2 * RECENT_FRAME_COUNT) {
+                link.recent_frame_count = RECENT_FRAME_COUNT; // still full, and can't overflow
+            }
+        }
+        xSemaphoreGive(mutex_);
+        return accepted;
+    }
+
+    /**
+     * @brief The SNR (in dB) below which a packet can't be demodulated at a spreading factor.
+     */
+
+    static float required_snr(int8_t spread_factor) {
+        return -7.5 - 2.5 * (spread_factor - 7); // SF7: -7.5 dB ... SF12: -20 dB
+    }
+
+    /**
+     * @brief Recommend a spreading factor and output power for one link. Every 3 dB of margin
+     * above LINK_MARGIN_DB allows one step: first a lower SF (down to 7), then 3 dB less power
+     * (down to 0 dBm). With a negative margin, the SF goes up instead.
+     */
+
+    static LinkAdvice recommend(const LinkStats& link, int8_t spread_factor, int8_t output_power) {
+        LinkAdvice advice;
+        advice.spread_factor = spread_factor;
+        advice.output_power = output_power;
+        advice.margin_db = link.snr - required_snr(spread_factor);
+        int8_t steps = (int8_t)floor((advice.margin_db - LINK_MARGIN_DB) / 3.0);
+        while (steps > 0 && advice.spread_factor > 7) {
+            advice.spread_factor--;
+            steps--;
+        }
+        while (steps > 0 && advice.output_power > 0) {
+            advice.output_power = advice.output_power > 3 ? advice.output_power - 3 : 0;
+            steps--;
+        }
+        while (steps < 0 && advice.spread_factor < 12) {
+            advice.spread_factor++;
+            steps++;
+        }
+        return advice;
+    }
+
+    /**
+     * @brief Show the statistics and advice for every transmitter in the Serial Monitor.
+     *
+     * @param spread_factor The spreading factor the links are using now
+     * @param output_power The output power the links are using now
+     */
+
+    void print_link_table(int8_t spread_factor, int8_t output_power) {
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        Serial.println("Link quality (" + String(links_.size()) + " transmitters, now SF" + String(spread_factor)
+                       + " at " + String(output_power) + " dBm):");
+        for (auto& entry : links_) {
+            LinkStats& link = entry.second;
+            String line = "   " + String(link.transmitter_address) + ": RSSI " + String(link.rssi, 1)
+                          + ", SNR " + String(link.snr, 1) + ", packets " + String(link.packets_received)
+                          + ", lost " + (link.has_sequence ? "" : "~") + String(link.packets_lost)
+                          + ", duplicates " + String(link.duplicates) + ", every " + String(link.report_interval_ms / 1000.0, 0)
+                          + " +/- " + String(link.report_jitter_ms / 1000.0, 0) + " s";
+            if (link.packets_received >= LINK_MIN_PACKETS_FOR_ADVICE) {
+                LinkAdvice advice = recommend(link, spread_factor, output_power);
+                line += ", margin " + String(advice.margin_db, 1) + " dB -> SF" + String(advice.spread_factor)
+                        + " at " + String(advice.output_power) + " dBm";
+            }
+            Serial.println(line);
+        }
+        xSemaphoreGive(mutex_);
+    }
+
+}; // class LinkQualityTable
+
+#endif // _LINK_QUALITY_H_
@@ -8,8 +8,11 @@
 #include "ui.h"
 #include "queues.h"
 #include "internet.h"
-#include "elapsedMillis.h"
+#include "scheduler.h"
+#include "runtime_config.h"
+#include "web_api.h"
 #include <Adafruit_BME280.h>
+#include <esp_pm.h>
 
 // If you change the NETWORK_ID or BASE_STATION_ADDRESS (in config.h):
 // Un-comment "#define LORA_SETUP_REQUIRED", upload and run once, then
@@ -32,21 +35,25 @@ uint8_t buzzer_pin = 4;
 uint8_t tilt_switch_pin = 13;
 bool cancel_screensaver = false;
  
-uint64_t wifi_check_delay = 30000; // every 30 seconds
-uint64_t bme280_update_delay = 600000; // every 10:00
-bool first_run = true;
-uint64_t packet_display_interval = 3000; // every 3 seconds
-uint64_t alarm_email_delay = 45000;   // every 45 seconds
-uint64_t sys_time_display_delay = 30000; // every 30 seconds
-uint64_t screensaver_delay = 90000; // after 90 seconds
-
-elapsedMillis wifi_check_timer;
-elapsedMillis bme280_timer;
-elapsedMillis packet_display_timer;
-elapsedMillis alarm_email_timer;
-elapsedMillis sys_time_display_timer;
+// The other intervals are settings - see runtime_config.h
+uint32_t sys_time_display_delay = 30000; // every 30 seconds
+
+// The ids of the jobs whose intervals are settings
+uint8_t wifi_check_job;
+uint8_t bme280_update_job;
+uint8_t packet_display_job;
+uint8_t alarm_email_job;
+uint8_t screensaver_job;
+uint8_t link_report_job;
+
+auto* scheduler = new Scheduler();
+
+auto* runtime_config = new RuntimeConfig();
 
 auto* lora = new ReyaxLoRa();
+#ifdef SECOND_LORA_RADIO
+auto* lora2 = new ReyaxLoRa(&Serial1, LORA2_RX_PIN, LORA2_TX_PIN);
+#endif
 
 auto* ui = new UI(buzzer_pin);
 
@@ -54,11 +61,94 @@ auto* net = new Internet(ui);
 
 auto* bme280 = new Adafruit_BME280();
 
-auto* packet_list = new PacketList(ui, bme280);
+auto* packet_list = new PacketList(ui, bme280, lora);
+
+auto* web_api = new WebApi(packet_list, runtime_config);
 
 // to wake up the display with the tilt switch
 void IRAM_ATTR wakeup_isr() {
   cancel_screensaver = true;
+  scheduler->wake_from_isr();
+}
+
+// a task that can't wait for loop() posted a status (or a setting, from HTTP):
+// wake up loop() to show it (or set it)
+void wake_loop(void* context) {
+  scheduler->wake();
+}
+
+// something was typed in the Serial Monitor: wake up loop() to run the settings command.
+// Called by the UART's event task, not from an interrupt.
+void serial_received() {
+  scheduler->wake();
+}
+
+// The periodic jobs run by the scheduler in loop()
+
+// periodically make sure we're still connected to wifi and have a valid system time
+void check_wifi(void* context) {
+  if (!net->connected_to_wifi() || !ui->system_time_is_valid()) {
+    net->connect_to_wifi(); // will connect to wifi and set system time
+  }
+}
+
+// read current bme280 data and add its packets to the queue
+void update_bme280(void* context) {
+  packet_list->update_BME280_packets();
+}
+
+void display_next_packet(void* context) {
+  if (packet_list->packet_list_not_empty()) {
+    ui->display_one_packet(packet_list->advance_one_packet());
+  }
+}
+
+void display_system_time(void* context) {
+  ui->display_system_time();
+}
+
+// the emails themselves are sent by a task on NETWORK_TASK_CORE - see Internet::start_tasks()
+void send_alarm_emails(void* context) {
+  net->request_alarm_emails();
+}
+
+void start_screensaver(void* context) {
+  ui->screensaver(true);
+}
+
+void print_link_table(void* context) {
+  packet_list->print_link_table();
+}
+
+#ifdef FAST_BOOT
+// With FAST_BOOT, radio ingest is started first, and these two tasks bring up
+// everything else in the background, at the same time.
+
+// The display and the BME280 share the I2C bus, so they're initialized in the same task.
+void init_display_and_sensors_task(void* parameters) {
+  ui->prepare_display();
+  packet_list->start_bme280();
+  packet_list->update_BME280_packets();
+  Serial.println("Display and BME280 ready at " + String(millis()) + " ms");
+  vTaskDelete(NULL);
+}
+
+void init_network_task(void* parameters) {
+  net->connect_to_wifi(); // will connect to wifi and set system time
+  Serial.println("Wifi and NTP ready at " + String(millis()) + " ms");
+  vTaskDelete(NULL);
+}
+#endif
+
+// a setting changed: change the intervals and the daytime hours to match
+void apply_settings(void* context, const RuntimeSettings& settings) {
+  scheduler->set_interval(wifi_check_job, settings.wifi_check_ms);
+  scheduler->set_interval(bme280_update_job, settings.bme280_ms);
+  scheduler->set_interval(packet_display_job, settings.display_ms);
+  scheduler->set_interval(alarm_email_job, settings.email_check_ms);
+  scheduler->set_interval(screensaver_job, settings.screensaver_ms);
+  scheduler->set_interval(link_report_job, settings.link_report_ms);
+  ui->set_daytime_hours(settings.day_start_hour, settings.day_end_hour);
 }
 
 void setup() {
@@ -66,76 +156,104 @@ void setup() {
   attachInterrupt(tilt_switch_pin, wakeup_isr, CHANGE);
   // For Serial Monitor display of debug messages
   Serial.begin(115200);
+#ifndef FAST_BOOT
   // Wait for the serial connection
   while (!Serial);
+#endif
+
+  // Everything below uses the settings, so they're loaded first
+  runtime_config->load();
+  const RuntimeSettings& settings = runtime_config->settings();
+  ui->set_daytime_hours(settings.day_start_hour, settings.day_end_hour);
+  packet_list->follow_settings(runtime_config);
 
   lora->initialize();
+#ifdef SECOND_LORA_RADIO
+  lora2->set_frequency(LORA2_FREQUENCY);
+  lora2->initialize();
+  packet_list->add_radio(lora2);
+#endif
 
 #ifdef LORA_SETUP_REQUIRED
   lora->one_time_setup();
+#ifdef SECOND_LORA_RADIO
+  lora2->one_time_setup();
+#endif
 #endif
 
-  // Add the appropriate "set" method(s) here to change most of
-  // the LoRa parameters, if desired. If you do, use the appropriate 
-  // AT command to display the result of the change, to make sure it changed. 
+  // The radio profile in config.h is applied by initialize(). To change part of it
+  // here instead, add the appropriate "set" method(s), then apply_settings(), which
+  // sends them to the LoRa and reads them back to make sure they changed.
   // EXAMPLE: lora->set_output_power(10);
-  //          lora->send_and_reply("AT+CRFOP?");
+  //          lora->apply_settings();
 
   initialize_queues();
+  // Before any packets come in, so they update the datapoints that were saved
+  packet_list->restore_snapshot();
+#ifdef FAST_BOOT
+  // Start reading the radio right away, so no packets pile up in the UARTs while
+  // everything else is initialized in the background.
+  packet_list->start_tasks();
+  Serial.println("Radio ingest started at " + String(millis()) + " ms");
+  net->start_tasks(packet_list);
+  web_api->start_task();
+  xTaskCreatePinnedToCore(init_display_and_sensors_task, "init_display", 10000, NULL, 1, NULL, RADIO_TASK_CORE);
+  xTaskCreatePinnedToCore(init_network_task, "init_network", 10000, NULL, 1, NULL, NETWORK_TASK_CORE);
+#else
   packet_list->start_bme280();
   packet_list->start_tasks();
-  net->start_tasks();
+  net->start_tasks(packet_list);
+  web_api->start_task();
   ui->prepare_display();
 
   // Connect to wifi
   net->connect_to_wifi();
+#endif
+
+  // Every periodic job in loop() is run by the scheduler, which blocks loop()'s task
+  // until the next job is due (or until the tilt switch wakes it up).
+  scheduler->attach_to_current_task();
+  ui->set_status_waker(wake_loop, NULL);
+  runtime_config->set_post_waker(wake_loop, NULL);
+  wifi_check_job = scheduler->add_job("check_wifi", settings.wifi_check_ms, check_wifi);
+  bme280_update_job = scheduler->add_job("update_bme280", settings.bme280_ms, update_bme280, NULL, true);
+  packet_display_job = scheduler->add_job("display_next_packet", settings.display_ms, display_next_packet);
+  scheduler->add_job("display_system_time", sys_time_display_delay, display_system_time);
+  alarm_email_job = scheduler->add_job("send_alarm_emails", settings.email_check_ms, send_alarm_emails);
+  screensaver_job = scheduler->add_job("start_screensaver", settings.screensaver_ms, start_screensaver);
+  link_report_job = scheduler->add_job("print_link_table", settings.link_report_ms, print_link_table);
+  runtime_config->subscribe(apply_settings);
+  // Settings commands wake loop() when they're typed, instead of a job polling for them
+  Serial.onReceive(serial_received);
+
+#if defined(ENABLE_LIGHT_SLEEP) && CONFIG_PM_ENABLE
+  // Requires a framework built with CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE.
+  esp_pm_config_esp32_t pm_config;
+  pm_config.max_freq_mhz = 240;
+  pm_config.min_freq_mhz = 80;
+  pm_config.light_sleep_enable = true;
+  if (esp_pm_configure(&pm_config) != ESP_OK) {
+    Serial.println("esp_pm_configure() failed - light sleep is not enabled");
+  }
+#endif
 
 } // setup()
 
 void loop() {
-  
-  // periodically make sure we're still connected to wifi and have a valid system time
-  if (wifi_check_timer > wifi_check_delay) {
-    if (!net->connected_to_wifi() || !ui->system_time_is_valid()) {
-      net->connect_to_wifi(); // will connect to wifi and set system time
-    }
-    wifi_check_timer = 0;
-  }
-  
-  // read current bme280 data and add its packets to the queue
-  if (first_run || bme280_timer > bme280_update_delay) {
-    packet_list->update_BME280_packets();
-    bme280_timer = 0;
-    first_run = false;
-  }
 
-  if (packet_display_timer > packet_display_interval) {
-    if (packet_list->packet_list_not_empty()) {
-      ui->display_one_packet(packet_list->advance_one_packet());
-    }
-    packet_display_timer = 0;
-  }
+  scheduler->run_due_jobs();
 
-  if (sys_time_display_timer > sys_time_display_delay) {
-    ui->display_system_time();
-    sys_time_display_timer = 0;
-  }  
+  ui->show_posted_status();
 
-  if (alarm_email_timer > alarm_email_delay) {
-    Packet_it_t it_begin = packet_list->get_packets_begin();
-    Packet_it_t it_end = packet_list->get_packets_end();
-    net->send_alarm_emails(it_begin, it_end);
-    alarm_email_timer = 0;
-  }
+  runtime_config->poll_serial();
 
-  if (ui->screensaver_timer_ > screensaver_delay) {
-    ui->screensaver(true);
-    ui->screensaver_timer_ = 0;
-  }
+  runtime_config->apply_posted();
 
   if (ui->screensaver_is_on() && cancel_screensaver) {
     ui->screensaver(false);
     cancel_screensaver = false;
   }
 
+  scheduler->wait_for_next_job();
+
 } // loop()
@@ -0,0 +1,126 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <Arduino.h>
+
+#define METRICS_BUFFER_SIZE 1024
+
+/**
+ * @brief Counters of what the base station has done since boot, for /metrics (see web_api.h).
+ * Each is incremented where it happens, and only read anywhere else.
+ */
+
+struct Metrics {
+    uint32_t frames_received = 0;         // +RCV lines, from every radio
+    uint32_t frames_parsed = 0;           // frames whose readings were queued
+    uint32_t parse_errors = 0;            // frames that couldn't be parsed or decoded
+    uint32_t duplicate_frames = 0;        // heard by two radios, or sent again by the transmitter
+    uint32_t truncated_frames = 0;        // more than MAX_READINGS_PER_FRAME readings: the rest were dropped
+    uint32_t influx_writes_ok = 0;
+    uint32_t influx_writes_failed = 0;
+    uint32_t mqtt_publishes_acked = 0;    // see mqtt_sink.h
+    uint32_t mqtt_publishes_failed = 0;
+    uint32_t emails_sent = 0;
+    uint32_t emails_failed = 0;
+};
+
+Metrics metrics;
+
+typedef void (*metrics_sink_t)(void* context, const char* data, size_t length);
+
+/**
+ * @brief MetricsWriter writes the Prometheus text format into a fixed buffer, and hands the
+ * buffer to sink every time it fills up - so a scrape allocates nothing, however many
+ * datapoints there are. Label sets ({id="...",...}) are rendered by the caller, once.
+ */
+
+class MetricsWriter {
+
+public:
+
+    MetricsWriter(metrics_sink_t sink, void* context) : sink_{sink}, context_{context} {}
+
+    void family(const char* name, const char* type, const char* help) {
+        write("# HELP ");
+        write(name);
+        write(" ");
+        write(help);
+        write("\n# TYPE ");
+        write(name);
+        write(" ");
+        write(type);
+        write("\n");
+    }
+
+    void sample(const char* name, const char* labels, float value) {
+        char number[24];
+        snprintf(number, sizeof(number), "%g", value);
+        sample_start(name, labels);
+        write(number);
+        write("\n");
+    }
+
+    void sample(const char* name, const char* labels, uint32_t value) {
+        char number[12];
+        snprintf(number, sizeof(number), "%u", (unsigned)value);
+        sample_start(name, labels);
+        write(number);
+        write("\n");
+    }
+
+    /**
+     * @brief Hand what's left in the buffer to the sink. Call it at the end.
+     */
+
+    void flush() {
+        if (length_ > 0) {
+            sink_(context_, buffer_, length_);
+            length_ = 0;
+        }
+    }
+
+    /**
+     * @brief Append a label value to labels (of size labels_size), escaped as Prometheus
+     * requires: backslash, double quote and newline.
+     */
+
+    static void append_label_value(char* labels, size_t labels_size, const char* value) {
+        size_t length = strlen(labels);
+        for (const char* c = value; *c != '\0' && length + 3 < labels_size; c++) {
+            if (*c == '\\' || *c == '"' || *c == '\n') {
+                labels[length++] = '\\';
+                labels[length++] = *c == '\n' ? 'n' : *c;
+            }
+            else {
+                labels[length++] = *c;
+            }
+        }
+        labels[length] = '\0';
+    }
+
+private:
+    char buffer_[METRICS_BUFFER_SIZE];
+    size_t length_ = 0;
+    metrics_sink_t sink_;
+    void* context_;
+
+    void sample_start(const char* name, const char* labels) {
+        write(name);
+        if (labels != NULL) {
+            write(labels);
+        }
+        write(" ");
+    }
+
+    void write(const char* str) {
+        while (*str != '\0') {
+            if (length_ == METRICS_BUFFER_SIZE) {
+                flush();
+            }
+            buffer_[length_++] = *str++;
+        }
+    }
+
+}; // class MetricsWriter
+
+#endif // _METRICS_H_
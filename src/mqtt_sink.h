@@ -0,0 +1,189 @@
+#ifndef _MQTT_SINK_H_
+#define _MQTT_SINK_H_
+
+#include <Arduino.h>
+#include <espMqttClient.h>
+#include "config.h"
+#include "sink.h"
+#include "metrics.h"
+
+#define MQTT_TOPIC_SIZE 96
+#define MQTT_PAYLOAD_SIZE 160
+
+/**
+ * @brief MqttSink publishes each value to an MQTT broker, retained, on
+ * MQTT_TOPIC_PREFIX/data_source/data_name - so a new subscriber gets the last value
+ * of every datapoint at once:
+ *
+ *   lora/Home/Temp (F)  ->  {"value":72.5,"alarm":0,"rssi":-80,"snr":9}
+ *
+ * An aggregate (see aggregator.h) goes on the same topic plus its window, e.g.
+ * lora/Pool/Pump pressure/5m, with its min, max, mean, count and last value.
+ *
+ * It keeps one connection to the broker, with a persistent session (a fixed MQTT_CLIENT_ID,
+ * and no clean session), instead of an HTTP request per point. Publishes are QoS 1, and
+ * pipelined: each one is put in espMqttClient's outbox without waiting for its PUBACK, and
+ * up to MQTT_MAX_IN_FLIGHT can be waiting at once. Only then does write() wait for an ack, up to
+ * MQTT_ACK_TIMEOUT_MS. What isn't acknowledged when the connection drops is sent again after
+ * the reconnect. espMqttClient's own task, on NETWORK_TASK_CORE, reads the acks and keeps the
+ * connection alive.
+ *
+ * The in-flight window (counting acks, and starting over when the broker has no session for us)
+ * has been checked only against the stand-in espMqttClient in test/support, by test_mqtt_sink.
+ * That stand-in does what espMqttClient's documentation says about session_present and acks;
+ * how the real client behaves with a real broker hasn't been tested here.
+ */
+
+class MqttSink : public Sink {
+
+private:
+    espMqttClient* client_ = NULL;
+    portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+    uint16_t in_flight_ = 0;      // publishes not acknowledged yet
+
+    /**
+     * @brief Append "/" and level to topic (of size topic_size). The MQTT wildcards, and "/",
+     * are replaced with "_", so a data_name can't add a level of its own.
+     */
+
+    static void append_topic_level(char* topic, size_t topic_size, const String& level) {
+        size_t length = strlen(topic);
+        if (length + 1 < topic_size) {
+            topic[length++] = '/';
+        }
+        for (const char* c = level.c_str(); *c != '\0' && length + 1 < topic_size; c++) {
+            topic[length++] = (*c == '/' || *c == '+' || *c == '#') ? '_' : *c;
+        }
+        topic[length] = '\0';
+    }
+
+    static void make_topic(char* topic, const String& data_source, const String& data_name) {
+        snprintf(topic, MQTT_TOPIC_SIZE, "%s", MQTT_TOPIC_PREFIX);
+        append_topic_level(topic, MQTT_TOPIC_SIZE, data_source);
+        append_topic_level(topic, MQTT_TOPIC_SIZE, data_name);
+    }
+
+    /**
+     * @brief Without a session, the broker has forgotten the publishes it hadn't acknowledged,
+     * so their PUBACKs will never come: stop counting them, or the window would stay shut.
+     */
+
+    void on_connect(bool session_present) {
+        Serial.println(session_present ? "Connected to MQTT broker, session resumed" : "Connected to MQTT broker");
+        if (!session_present) {
+            portENTER_CRITICAL(&lock_);
+            in_flight_ = 0;
+            portEXIT_CRITICAL(&lock_);
+        }
+    }
+
+    void on_publish(uint16_t packet_id) {
+        portENTER_CRITICAL(&lock_);
+        if (in_flight_ > 0) {
+            in_flight_--;
+        }
+        portEXIT_CRITICAL(&lock_);
+        metrics.mqtt_publishes_acked++;
+    }
+
+    uint16_t in_flight() {
+        portENTER_CRITICAL(&lock_);
+        uint16_t count = in_flight_;
+        portEXIT_CRITICAL(&lock_);
+        return count;
+    }
+
+    /**
+     * @brief Wait until fewer than MQTT_MAX_IN_FLIGHT publishes are unacknowledged.
+     * Doesn't wait while there's no connection - nothing will be acknowledged.
+     */
+
+    bool wait_for_window() {
+        uint32_t start_ms = millis();
+        while (in_flight() >= MQTT_MAX_IN_FLIGHT) {
+            if (!client_->connected() || millis() - start_ms >= MQTT_ACK_TIMEOUT_MS) {
+                return false;
+            }
+            vTaskDelay(10 / portTICK_PERIOD_MS);
+        }
+        return true;
+    }
+
+    bool publish(const char* topic, const char* payload) {
+        if (!wait_for_window()) {
+            Serial.println("MQTT publish dropped: " + String(in_flight()) + " not acknowledged");
+            metrics.mqtt_publishes_failed++;
+            return false;
+        }
+        portENTER_CRITICAL(&lock_);
+        in_flight_++;     // before publish(), in case the ack comes first
+        portEXIT_CRITICAL(&lock_);
+        if (client_->publish(topic, 1, true, payload) == 0) {
+            portENTER_CRITICAL(&lock_);
+            in_flight_--;
+            portEXIT_CRITICAL(&lock_);
+            Serial.println("MQTT publish failed");
+            metrics.mqtt_publishes_failed++;
+            return false;
+        }
+        return true;
+    }
+
+public:
+
+    MqttSink() {}
+
+    // Constructor for a sink that uses a client made elsewhere - a fake broker, for example.
+    explicit MqttSink(espMqttClient* client) : client_{client} {}
+
+    void begin() override {
+        if (client_ == NULL) {
+            client_ = new espMqttClient(HANDLE_INFLUX_QUEUE_PRIORITY, NETWORK_TASK_CORE);
+        }
+        client_->setServer(MQTT_HOST, MQTT_PORT);
+        client_->setCredentials(MQTT_USER, MQTT_PASSWORD);
+        client_->setClientId(MQTT_CLIENT_ID);
+        client_->setCleanSession(false);
+        client_->setKeepAlive(MQTT_KEEPALIVE_SECONDS);
+        client_->onConnect([this](bool session_present) { on_connect(session_present); });
+        client_->onDisconnect([](espMqttClientTypes::DisconnectReason reason) {
+            Serial.println("Disconnected from MQTT broker: " + String((int)reason));
+        });
+        client_->onPublish([this](uint16_t packet_id) { on_publish(packet_id); });
+    }
+
+    /**
+     * @brief (Re)connect, if there's no connection. espMqttClient's task does the connecting,
+     * so this doesn't wait - the batch is queued in the outbox meanwhile.
+     */
+
+    void begin_batch() override {
+        if (!client_->connected()) {
+            client_->connect();
+        }
+    }
+
+    bool write(const Packet_t& packet) override {
+        char topic[MQTT_TOPIC_SIZE];
+        char payload[MQTT_PAYLOAD_SIZE];
+        make_topic(topic, packet.data_source, packet.data_name);
+        snprintf(payload, sizeof(payload), "{\"value\":%g,\"alarm\":%d,\"rssi\":%d,\"snr\":%d}",
+                 packet.data_value.toFloat(), packet.alarm_code, packet.RSSI, packet.SNR);
+        return publish(topic, payload);
+    }
+
+    bool write_aggregate(const AggregateWindow& window) override {
+        char topic[MQTT_TOPIC_SIZE];
+        char payload[MQTT_PAYLOAD_SIZE];
+        make_topic(topic, window.data_source, window.data_name);
+        append_topic_level(topic, sizeof(topic), String(window.window_ms / 60000) + "m");
+        snprintf(payload, sizeof(payload),
+                 "{\"min\":%g,\"max\":%g,\"mean\":%g,\"count\":%u,\"last\":%g,\"alarm\":%d,\"rssi\":%d,\"snr\":%d}",
+                 window.min, window.max, (float)(window.sum / window.count), (unsigned)window.count, window.last,
+                 window.alarm_code, window.RSSI, window.SNR);
+        return publish(topic, payload);
+    }
+
+}; // class MqttSink
+
+#endif // _MQTT_SINK_H_
@@ -3,11 +3,43 @@
 
 #include <Arduino.h>
 #include <list>
+#include <vector>
 #include "packet_t.h"
 #include "config.h"
 #include "alarm.h"
 #include "ui.h"
 #include "queues.h"
+#include "reyax_lora.h"
+#include "link_quality.h"
+#include "schema_registry.h"
+#include "downlink.h"
+#include "alarm_rules.h"
+#include "derived_metrics.h"
+#include "aggregator.h"
+#include "snapshot.h"
+#include "runtime_config.h"
+#include "metrics.h"
+#include "jitter_stats.h"
+
+#define MAX_READINGS_PER_FRAME 8
+#define STALE_TIMER_TICK_MS 1000
+#define INTERVAL_EWMA_WEIGHT 0.25F  // weight of the newest interval in a datapoint's expected interval
+
+// One row of EXPECTED_INTERVALS in config.h
+struct ExpectedInterval {
+    const char* data_source;
+    const char* data_name;
+    uint32_t seconds;
+};
+
+// One row of INFLUX_DEADBANDS in config.h
+struct InfluxDeadband {
+    const char* data_source;
+    const char* data_name;
+    float deadband;
+};
+
+typedef void (*datapoint_listener_t)(void* context, const Packet_t& datapoint);
 
 #include <Adafruit_BME280.h>
 
@@ -17,7 +49,7 @@
  * sensors attached to the receiver PCB, and they can be used to show the status of things (like
  * info about the last web update). A packet contains all we want to know about a single datapoint, 
  * such as "Boat voltage" or "Pool water temperature". This class handles the
- * receipt of a new packet through Serial2 (via the LoRa radio) and the adding or updating of the new
+ * receipt of a new packet from the LoRa radio (as the LoRa's receive handler) and the adding or updating of the new
  * packet in the std::list of packets. It also provides a way to add packets that don't come in from
  * the LoRa radio.
  */
@@ -30,16 +62,55 @@ private:
     Packet_it_t loop_iterator_ = packets_.begin();
     UI* ui_;
     Adafruit_BME280* bme280_;
+    ReyaxLoRa* lora_;                  // the first radio - its profile is the one in the link report
+
+    /**
+     * @brief One LoRa module, and the task that reads it.
+     */
+
+    struct RadioIngest {
+        PacketList* packet_list;
+        ReyaxLoRa* lora;
+        char task_name[24];
+#ifdef TASK_JITTER_STATS
+        JitterStats* jitter_stats;
+#endif
+    };
+
+    std::vector<RadioIngest*> radios_;
+    LinkQualityTable link_table_;
+    SchemaRegistry schema_registry_;
+    DownlinkQueue downlink_;
+    AlarmRules alarm_rules_;
+    DerivedMetrics derived_metrics_;
+    TimerWheel stale_timers_{STALE_TIMER_TICK_MS};
+    PacketSnapshot snapshot_;
+    bool bme280_started_ = false;
+    bool first_packet_accepted_ = false;
+    uint32_t influx_points_suppressed_ = 0;
+    SemaphoreHandle_t list_mutex_;     // held while the packet queue task changes the list
+    datapoint_listener_t update_listener_ = NULL;
+    void* update_listener_context_ = NULL;
+    uint32_t alarm_clear_dwell_ms_ = ALARM_CLEAR_DWELL_MS;
+    uint32_t influx_heartbeat_ms_ = INFLUX_HEARTBEAT_MINUTES * 60000UL;
 
     /**
-     * @brief The function that will ultimately be run as a Task,
-     * every 500 ms. (But only after being called in start_task_impl(), below.)
+     * @brief The function that will ultimately be run as a Task, once per radio,
+     * every GET_NEW_PACKETS_PERIOD_MS. (But only after being called in start_task_impl(), below.)
+     * vTaskDelayUntil() keeps the period fixed, no matter how long the radio's poll() takes.
      */
     
-    void get_new_packets_task() {
+    static void get_new_packets_task(RadioIngest* radio) {
+        TickType_t last_wake_time = xTaskGetTickCount();
         while (1) {
-            this->get_new_packets();
-            vTaskDelay(250 / portTICK_RATE_MS);
+#ifdef TASK_JITTER_STATS
+            uint32_t start_us = micros();
+            radio->lora->poll();
+            radio->jitter_stats->record(start_us, micros());
+#else
+            radio->lora->poll();
+#endif
+            vTaskDelayUntil(&last_wake_time, GET_NEW_PACKETS_PERIOD_MS / portTICK_RATE_MS);
         }
     }
 
@@ -56,8 +127,8 @@ private:
      * https://stackoverflow.com/questions/45831114
      */
     
-    static void start_get_new_packets_task_impl(void* _this) {
-        static_cast<PacketList*>(_this)->get_new_packets_task();
+    static void start_get_new_packets_task_impl(void* _radio) {
+        get_new_packets_task(static_cast<RadioIngest*>(_radio));
     }
 
     /**
@@ -70,34 +141,221 @@ private:
         static_cast<PacketList*>(_this)->handle_packet_queue_task();
     }
 
+    /**
+     * @brief Allows on_stale_data() to be the stale_timers_ callback.
+     */
+
+    static void on_stale_data_impl(TimerNode* timer, void* _this) {
+        static_cast<PacketList*>(_this)->on_stale_data(static_cast<Packet_t*>(timer->owner));
+    }
+
+    /**
+     * @brief Allows apply_settings() to be a RuntimeConfig subscriber.
+     */
+
+    static void apply_settings_impl(void* _this, const RuntimeSettings& settings) {
+        static_cast<PacketList*>(_this)->apply_settings(settings);
+    }
+
+    /**
+     * @brief Allows parse_rcv_line() to be the receive handler of every radio.
+     */
+
+    static void handle_rcv_line_impl(void* _radio, const String& line) {
+        RadioIngest* radio = static_cast<RadioIngest*>(_radio);
+        metrics.frames_received++;
+        radio->packet_list->parse_rcv_line(line, radio->lora);
+    }
+
 public:
    /**
     * @brief Construct a new PacketList object.
     */
 
-    PacketList(UI* ui, Adafruit_BME280* bme280) : ui_{ui}, bme280_{bme280} {}
+    PacketList(UI* ui, Adafruit_BME280* bme280, ReyaxLoRa* lora) : ui_{ui}, bme280_{bme280}, lora_{lora} {
+        list_mutex_ = xSemaphoreCreateMutex();
+        add_radio(lora);
+    }
+
+    /**
+     * @brief Add another LoRa module (on its own UART) to read packets from. Every radio feeds
+     * the same queues, through its own task, so with each radio on a different frequency (or
+     * network ID) the base station can take in that many times more packets. A frame heard by
+     * more than one radio is added only once - see LinkQualityTable::accept_frame().
+     * Must be called before start_tasks().
+     */
+
+    void add_radio(ReyaxLoRa* lora) {
+        RadioIngest* radio = new RadioIngest();
+        radio->packet_list = this;
+        radio->lora = lora;
+        snprintf(radio->task_name, sizeof(radio->task_name), "get_new_packets_%u", (unsigned)radios_.size() + 1);
+#ifdef TASK_JITTER_STATS
+        radio->jitter_stats = new JitterStats(radio->task_name, GET_NEW_PACKETS_PERIOD_MS, TASK_JITTER_REPORT_INTERVAL);
+#endif
+        lora->set_receive_handler(handle_rcv_line_impl, radio);
+        radios_.push_back(radio);
+    }
 
     /**
-     * @brief Starts the task that reads new packets coming in from the LoRa,
+     * @brief Starts one task per radio that reads new packets coming in from it,
      * and the task that moves new packets from the new task queue into PacketList.
+     * All are pinned to RADIO_TASK_CORE - see the task topology in config.h.
      * https://stackoverflow.com/questions/45831114
      */
     
     void start_tasks() {
-        xTaskCreate(this->start_get_new_packets_task_impl, "get_new_packets", 10000, this, 2, NULL);
-        xTaskCreate(this->start_handle_packet_queue_task, "handle_packet_queue", 10000, this, 1, NULL);
+        for (RadioIngest* radio : radios_) {
+            xTaskCreatePinnedToCore(this->start_get_new_packets_task_impl, radio->task_name, 10000, radio,
+                                    GET_NEW_PACKETS_PRIORITY, NULL, RADIO_TASK_CORE);
+        }
+        xTaskCreatePinnedToCore(this->start_handle_packet_queue_task, "handle_packet_queue", 10000, this,
+                                HANDLE_PACKET_QUEUE_PRIORITY, NULL, RADIO_TASK_CORE);
     }
 
     /**
      * @brief Setup this method in an xTask to run a few times per second, to check for new packets in
-     * the new packet queue, and add them to (or update them in) PacketList.
+     * the new packet queue, and add them to (or update them in) PacketList. Each one goes to
+     * send_to_influx() after that, so Influx gets the alarm_code from the alarm rules, too. Then
+     * the datapoints derived from it (see derived_metrics.h) get the same treatment.
+     * It also moves the stale-data timers along - see watch_for_stale_data() - and saves
+     * PacketList to flash when it's due - see snapshot.h.
+     * The list is locked only while it's being changed, not while waiting for the queue.
      */
 
     void handle_packet_queue() {
+       lock();
+       // First, so the stale timers restarted below start from now
+       stale_timers_.advance(millis(), on_stale_data_impl, this);
+       unlock();
        Packet_t packet;
+       Packet_t derived[MAX_DERIVED_PER_VALUE];
        while (read_packet_from_queue(&packet)) {
-           add_packet_to_list(&packet);
+           lock();
+           Packet_t* datapoint = add_packet_to_list(&packet);
+           send_to_influx(datapoint);
+           notify_update(datapoint);
+           uint8_t derived_count = derived_metrics_.update(*datapoint, derived);
+           for (uint8_t i = 0; i < derived_count; i++) {
+               Packet_t* derived_datapoint = add_packet_to_list(&derived[i]);
+               send_to_influx(derived_datapoint);
+               notify_update(derived_datapoint);
+           }
+           unlock();
         }
+       lock();
+       bool snapshot_due = snapshot_.prepare_if_due(packets_, millis());
+       unlock();
+       if (snapshot_due) {
+           snapshot_.save_prepared(millis()); // the flash write doesn't hold up the other tasks
+       }
+    }
+
+    /**
+     * @brief Call listener (with context) every time a datapoint in the list is updated, from
+     * the packet queue task, with the list locked. It must not wait for anything - see event_stream.h.
+     * Must be called before start_tasks().
+     */
+
+    void set_update_listener(datapoint_listener_t listener, void* context) {
+       update_listener_ = listener;
+       update_listener_context_ = context;
+    }
+
+    void notify_update(Packet_t* datapoint) {
+       if (update_listener_ != NULL) {
+           update_listener_(update_listener_context_, *datapoint);
+       }
+    }
+
+    /**
+     * @brief Lock the list against changes by the packet queue task, to read it from another
+     * task - see web_api.h. Keep it short: ingest waits while it's locked.
+     */
+
+    void lock() {
+       xSemaphoreTake(list_mutex_, portMAX_DELAY);
+    }
+
+    void unlock() {
+       xSemaphoreGive(list_mutex_);
+    }
+
+    /**
+     * @brief Put back the datapoints saved before the last restart (see snapshot.h), with their
+     * alarms and alarm bookkeeping, so ongoing alarms aren't sounded and emailed again.
+     * Call it once, in setup(), before start_tasks().
+     */
+
+    void restore_snapshot() {
+       std::vector<Packet_t> saved;
+       snapshot_.load(&saved);
+       for (Packet_t& packet : saved) {
+           packet.alarm_rules = alarm_rules_.find_rules(packet.data_source, packet.data_name);
+           if (packet.alarm_rules < 0) {
+               packet.alarm_rules_broken = 0; // its rules were taken out of the build
+           }
+           packet.derived_inputs = derived_metrics_.find_input(packet.data_source, packet.data_name);
+           packet.timestamp = millis(); // so a datapoint that doesn't come back goes stale
+           add_new_datapoint(&packet);
+       }
+       if (!saved.empty()) {
+           Serial.println("Restored " + String(saved.size()) + " datapoints at " + String(millis()) + " ms");
+       }
+    }
+
+    /**
+     * @brief Queue a datapoint's latest value for InfluxDB - but only if it has moved by more
+     * than the datapoint's deadband since the last value that was sent, or its alarm_code has
+     * changed, or the last one was sent more than INFLUX_HEARTBEAT_MINUTES (influx_hb_min) ago.
+     * See INFLUX_DEADBANDS in config.h. A deadband of 0 leaves out only repeats of the value
+     * last sent (so an unchanging value is sent once per heartbeat); -1 sends every value.
+     * A value that isn't a number (a status like "OK" or "FAULT") has no deadband: it's sent
+     * whenever its text changes.
+     *
+     * @param datapoint The datapoint's entry in PacketList
+     */
+
+    void send_to_influx(Packet_t* datapoint) {
+       const char* text = datapoint->data_value.c_str();
+       char* end;
+       float value = strtof(text, &end);
+       bool numeric = end != text && *end == '\0';
+       bool unchanged;
+       if (numeric) {
+           unchanged = datapoint->influx_last_numeric
+                       && fabs(value - datapoint->influx_last_value) <= datapoint->influx_deadband;
+       }
+       else {
+           unchanged = !datapoint->influx_last_numeric && datapoint->influx_deadband >= 0
+                       && datapoint->data_value == datapoint->influx_last_text;
+       }
+       uint32_t now = millis();
+       if (datapoint->influx_sent_once && unchanged
+           && datapoint->alarm_code == datapoint->influx_last_alarm_code
+           && now - datapoint->influx_last_sent_ms < influx_heartbeat_ms_) {
+           influx_points_suppressed_++;
+           return;
+       }
+       bool alarm_changed = datapoint->influx_sent_once && datapoint->alarm_code != datapoint->influx_last_alarm_code;
+       if (!add_packets_to_influx_queue(datapoint, 1, alarm_changed)) {
+           Serial.println("Influx queue full, dropped " + datapoint->unique_id);
+           return;
+       }
+       datapoint->influx_sent_once = true;
+       datapoint->influx_last_value = value;
+       datapoint->influx_last_numeric = numeric;
+       datapoint->influx_last_text = numeric ? String() : datapoint->data_value;
+       datapoint->influx_last_alarm_code = datapoint->alarm_code;
+       datapoint->influx_last_sent_ms = now;
+    }
+
+    /**
+     * @brief How many values send_to_influx() has left out, since boot.
+     */
+
+    uint32_t influx_points_suppressed() {
+       return influx_points_suppressed_;
     }
 
     /**
@@ -107,6 +365,7 @@ public:
 
     void start_bme280() {
         bool success = bme280_->begin(0x76);
+        bme280_started_ = true;
         if (!success) {
           Serial.println("Could not find a valid BME280 sensor, check wiring!");
           ui_->update_status_lines("BME280 error:", "check wiring");
@@ -117,137 +376,295 @@ public:
     }
    
     /**
-    * @brief Populate a new Packet_t from the data coming in through Serial2, then add it
-    * to, or update it in, the list of packets.
+    * @brief Run the command engine of every radio, which calls parse_rcv_line() for every
+    * "+RCV=" line that has come in through its UART. (The tasks from start_tasks() do this
+    * for one radio each.)
     */
 
-    bool get_new_packets() {
-       Packet_t new_packet;
-       bool new_packet_received = false;
-       String temp_str = "";
-       
-       while (Serial2.available()) {
-           // If there are two packets in the Serial2 buffer, make sure the second one
-           // starts at the right place. If it doesn't find a "+", it won't find a valid packet.
-           String init_str = Serial2.readStringUntil('+');
-           Serial.println("New data coming in");
-           ui_->update_status_lines("New LoRa data", "coming in", 2);
-           // see if the next 4 characters == "RCV="
-           if (Serial2.readStringUntil('=') == "RCV") {
-               Serial.println("It's a LoRa packet");
-               initialize_packet(&new_packet);
-               // make sure this is from one of OUR transmitters:
-               new_packet.transmitter_address = Serial2.readStringUntil(',').toInt();
-               Serial.println("Transmitter address = " + String(new_packet.transmitter_address));
-               if (new_packet.transmitter_address >= ADDRESS_RANGE_LOWER 
-                   && new_packet.transmitter_address <= ADDRESS_RANGE_UPPER) {
-                   // now we know it's OK to process this packet
-                   temp_str = Serial2.readStringUntil(',');
-                   if (temp_str.length() == 0) {
-                       Serial.println("Error reading data_length from Serial2.");
-                       return false;
-                   }
-                   else {
-                       Serial.println("Data length = " + temp_str);
-                       new_packet.data_length = temp_str.toInt();
-                   }
-                   // Now we're into the <Data> portion of the packet, which is separated into smaller bits of
-                   // data by the % separator.
-                   new_packet.data_source = Serial2.readStringUntil('%'); // "Bessie", "Pool", etc.
-                   Serial.println("Transmitter name = " + new_packet.data_source);
-                   if (new_packet.data_source.length() == 0) {
-                       Serial.println("Error reading data_source from Serial2.");
-                       return false;
-                   }
-                   new_packet.data_name = Serial2.readStringUntil('%'); // "Battery voltage", "Water temp", etc.
-                   Serial.println("Data name = " + new_packet.data_name);
-                   if (new_packet.data_name.length() == 0) {
-                       Serial.println("Error reading data_name from Serial2.");
-                       return false;
-                   }
-                   new_packet.data_value = Serial2.readStringUntil('%');
-                   Serial.println("Data value = " + new_packet.data_value);
-                   if (new_packet.data_value.length() == 0) {
-                       Serial.println("Error reading data_value from Serial2.");
-                       return false;
-                   }
-                   temp_str = Serial2.readStringUntil('%');
-                   if (temp_str.length() == 0) {
-                       Serial.println("Error reading alarm_code from Serial2.");
-                       return false;
-                   }
-                   else {
-                       Serial.println("Alarm code = " + temp_str);
-                       new_packet.alarm_code = temp_str.toInt();
-                       if (new_packet.alarm_code > 0) {
-                           if (ui_->system_time_is_valid()) {
-                               time(&new_packet.first_alarm_time); // set to current time
-                               char *date = ctime(&new_packet.first_alarm_time);
-                               Serial.println("First alarm time: " + String(date));
-                           }
-                           else {
-                               new_packet.first_alarm_time = 0;
-                               Serial.println("System time invalid, first_alarm_time set to 0");
-                               ui_->update_bottom_line("Invalid sys time");
-                               ui_->update_status_lines("Invalid sys time", "", 3);
-                               ui_->update_status_lines("Waiting for data", "");
-                           }
-                       }
-                   }
-                   temp_str = Serial2.readStringUntil('%');
-                   if (temp_str.length() == 0) {
-                       Serial.println("Error reading alarm_email_interval from Serial2.");
-                       return false;
-                   }
-                   else {
-                       Serial.println("Alarm email interval = " + temp_str);
-                       new_packet.alarm_email_interval = temp_str.toInt();
-                   }
-                   // this is the last bit of data in the <Data> portion, so we go back to "," as the separator
-                   temp_str = Serial2.readStringUntil(',');
-                   if (temp_str.length() == 0) {
-                       Serial.println("Error reading max_alarm_emails from Serial2.");
-                       return false;
-                   }
-                   else {
-                       Serial.println("Max alarm emails = " + temp_str);
-                       new_packet.max_alarm_emails_to_send = temp_str.toInt();
-                   }
-                   temp_str = Serial2.readStringUntil(',');
-                   if (temp_str.length() == 0) {
-                       Serial.println("Error reading RSSI from Serial2.");
-                       return false;
-                   }
-                   else {
-                       Serial.println("RSSI = " + temp_str);
-                       new_packet.RSSI = temp_str.toInt();
-                   }
-                   // last bit of data in the Packet, so read until '\n'
-                   temp_str = Serial2.readStringUntil('\n');
-                   if (temp_str.length() == 0) {
-                       Serial.println("Error reading SNR from Serial2.");
-                       return false;
-                   }
-                   else {
-                       Serial.println("SNR = " + temp_str);
-                       new_packet.SNR = temp_str.toInt();
-                   }
-                   new_packet.unique_id = String(new_packet.transmitter_address) + new_packet.data_name;
-                   new_packet.timestamp = millis();
-                   
-                   add_packet_to_queue(new_packet);
-                   add_packet_to_influx_queue(new_packet);
-                   new_packet_received = true;
-                   ui_->update_status_lines("Waiting for data", "");
+    void get_new_packets() {
+       for (RadioIngest* radio : radios_) {
+           radio->lora->poll();
+       }
+    }
+
+    /**
+    * @brief Populate a new Packet_t for every reading in one "+RCV=" line from the LoRa, then add
+    * them to the new packet queue (to be added to, or updated in, the list of packets) and the influx queue.
+    * It's the receive handler of the radios, so it never waits for the display - see UI::post_status().
+    * Format: +RCV=<Address>,<Length>,<Data>,<RSSI>,<SNR>
+    *
+    * @param lora The radio that received it - any downlink to the transmitter goes back through it
+    */
+
+    bool parse_rcv_line(const String& line, ReyaxLoRa* lora) {
+       Packet_t frame; // the fields that every reading in this LoRa frame shares
+       Serial.println("New data coming in");
+       int field_start = 5; // just past "+RCV="
+       // make sure this is from one of OUR transmitters:
+       String temp_str = next_field(line, &field_start, ',');
+       frame.transmitter_address = temp_str.toInt();
+       Serial.println("Transmitter address = " + String(frame.transmitter_address));
+       if (temp_str.length() == 0 || frame.transmitter_address < ADDRESS_RANGE_LOWER 
+           || frame.transmitter_address > ADDRESS_RANGE_UPPER) {
+           return false;
+       }
+       // The transmitter listens for only a moment after every uplink - the only time it can get
+       // a command - so that comes first. If this uplink acknowledges the last command, the next
+       // one can go out now. (See downlink.h - a copy of this frame from another radio is harmless.)
+       int data_start = line.indexOf(',', field_start) + 1;
+       if (data_start > 0 && line.charAt(data_start) == '@') {
+           downlink_.on_acknowledgement(frame.transmitter_address, next_field(line, &data_start, ','));
+       }
+       downlink_.on_uplink(frame.transmitter_address, lora);
+       // now we know it's OK to process this packet
+       temp_str = next_field(line, &field_start, ',');
+       if (temp_str.length() == 0) {
+           Serial.println("Error reading data_length from LoRa packet.");
+           metrics.parse_errors++;
+           return false;
+       }
+       else {
+           Serial.println("Data length = " + temp_str);
+           frame.data_length = temp_str.toInt();
+       }
+       // <Data> is exactly data_length characters long, so nothing in it can be mistaken
+       // for the "," before <RSSI>.
+       String data = line.substring(field_start, field_start + frame.data_length);
+       field_start += frame.data_length;
+       if (data.length() != frame.data_length || line.charAt(field_start) != ',') {
+           Serial.println("Error reading data from LoRa packet.");
+           metrics.parse_errors++;
+           return false;
+       }
+       field_start++;
+       temp_str = next_field(line, &field_start, ',');
+       if (temp_str.length() == 0) {
+           Serial.println("Error reading RSSI from LoRa packet.");
+           metrics.parse_errors++;
+           return false;
+       }
+       else {
+           Serial.println("RSSI = " + temp_str);
+           frame.RSSI = temp_str.toInt();
+       }
+       // last bit of data in the Packet
+       temp_str = next_field(line, &field_start, ',');
+       if (temp_str.length() == 0) {
+           Serial.println("Error reading SNR from LoRa packet.");
+           metrics.parse_errors++;
+           return false;
+       }
+       else {
+           Serial.println("SNR = " + temp_str);
+           frame.SNR = temp_str.toInt();
+       }
+       // The same frame, heard by another radio (or re-sent by the transmitter)
+       if (!link_table_.accept_frame(frame.transmitter_address, data, millis())) {
+           Serial.println("Duplicate frame dropped");
+           metrics.duplicate_frames++;
+           return false;
+       }
+       link_table_.update(frame.transmitter_address, frame.RSSI, frame.SNR, millis());
+
+       // '@' is a transmitter acknowledging a downlink command, handled above
+       if (data.charAt(0) == '@') {
+           return true;
+       }
+       // The first character of <Data> tells which format it's in - see schema_registry.h
+       if (data.charAt(0) == '!') {
+           return schema_registry_.register_schema(frame.transmitter_address, data);
+       }
+       Packet_t new_packets[MAX_READINGS_PER_FRAME];
+       uint8_t reading_count = 0;
+       if (data.charAt(0) == '$') {
+           // decode() counts its own failures: as parse errors, or as unknown_schema_packets()
+           reading_count = schema_registry_.decode(frame.transmitter_address, data, &frame, new_packets, MAX_READINGS_PER_FRAME);
+           if (reading_count == 0) {
+               return false;
+           }
+           for (uint8_t i = 0; i < reading_count; i++) {
+               if (new_packets[i].alarm_code > 0) {
+                   set_first_alarm_time(&new_packets[i]);
                }
            }
        }
-       if (new_packet_received) {
-           return true;
+       else {
+           reading_count = parse_data(data, &frame, new_packets);
+           if (reading_count == 0) {
+               metrics.parse_errors++;
+               return false;
+           }
+       }
+       // Drop retries (and copies from repeaters) before they use up queue slots and Influx writes
+       if (frame.sequence >= 0 && !link_table_.accept_sequence(frame.transmitter_address, frame.sequence)) {
+           Serial.println("Duplicate packet dropped, sequence = " + String(frame.sequence));
+           metrics.duplicate_frames++;
+           return false;
+       }
+       uint32_t now = millis();
+       for (uint8_t i = 0; i < reading_count; i++) {
+           new_packets[i].transmitter_address = frame.transmitter_address;
+           new_packets[i].data_length = frame.data_length;
+           new_packets[i].data_source = frame.data_source;
+           new_packets[i].RSSI = frame.RSSI;
+           new_packets[i].SNR = frame.SNR;
+           new_packets[i].sequence = frame.sequence;
+           new_packets[i].unique_id = String(frame.transmitter_address) + new_packets[i].data_name;
+           new_packets[i].timestamp = now;
+       }
+       
+       if (!add_packets_to_queue(new_packets, reading_count)) {
+           Serial.println("New packet queue full, dropped " + String(reading_count) + " readings");
        }
        else {
+           metrics.frames_parsed++;
+       }
+       if (!first_packet_accepted_) {
+           first_packet_accepted_ = true;
+           Serial.println("Time to first packet accepted: " + String(now) + " ms after boot");
+       }
+       // Shown by loop() - the radio task never waits for the display
+       ui_->post_status("New LoRa data", "from " + frame.data_source);
+       return true;
+    }
+
+    /**
+    * @brief Parse the <Data> portion of a LoRa packet in the text format, which comes in one of two forms.
+    * Within each, smaller bits of data are separated by the % separator.
+    *
+    * One reading:
+    *   data_source%data_name%data_value%alarm_code%alarm_email_interval%max_alarm_emails[%sequence]
+    * Several readings that share the data_source (and sequence), each reading separated by |:
+    *   data_source[%sequence]|data_name%data_value%alarm_code%alarm_email_interval%max_alarm_emails|...
+    *
+    * The sequence number (0 - 65535, counting up with every packet the transmitter sends) is optional.
+    *
+    * @param frame Gets the data_source and sequence
+    * @param packets Gets one reading each - room for MAX_READINGS_PER_FRAME
+    * @return the number of readings, or 0 if the data couldn't be parsed
+    */
+
+    uint8_t parse_data(const String& data, Packet_t* frame, Packet_t* packets) {
+       int field_start = 0;
+       bool multi_reading = data.indexOf('|') >= 0;
+       frame->data_source = next_field(data, &field_start, multi_reading ? '|' : '%'); // "Bessie", "Pool", etc.
+       if (multi_reading) {
+           // the header may include the sequence number: data_source%sequence
+           int header_start = 0;
+           String header = frame->data_source;
+           frame->data_source = next_field(header, &header_start, '%');
+           parse_sequence(next_field(header, &header_start, '%'), frame);
+       }
+       Serial.println("Transmitter name = " + frame->data_source);
+       if (frame->data_source.length() == 0) {
+           Serial.println("Error reading data_source from LoRa packet.");
+           return 0;
+       }
+       if (!multi_reading) {
+           if (!parse_reading(data, &field_start, &packets[0])) {
+               return 0;
+           }
+           // the optional last bit of data in the <Data> portion
+           parse_sequence(next_field(data, &field_start, '%'), frame);
+           return 1;
+       }
+       uint8_t reading_count = 0;
+       while (field_start < (int)data.length()) {
+           if (reading_count == MAX_READINGS_PER_FRAME) {
+               Serial.println("Too many readings in one LoRa packet, only " + String(reading_count) + " used.");
+               metrics.truncated_frames++;
+               break;
+           }
+           String reading = next_field(data, &field_start, '|');
+           int reading_start = 0;
+           if (!parse_reading(reading, &reading_start, &packets[reading_count])) {
+               return 0;
+           }
+           reading_count++;
+       }
+       return reading_count;
+    }
+
+    /**
+    * @brief Fill in a Packet_t from one reading:
+    * data_name%data_value%alarm_code%alarm_email_interval%max_alarm_emails
+    *
+    * @param field_start Where the reading starts in data, moved past the reading
+    */
+
+    bool parse_reading(const String& data, int* field_start, Packet_t* packet) {
+       packet->data_name = next_field(data, field_start, '%'); // "Battery voltage", "Water temp", etc.
+       Serial.println("Data name = " + packet->data_name);
+       if (packet->data_name.length() == 0) {
+           Serial.println("Error reading data_name from LoRa packet.");
+           return false;
+       }
+       packet->data_value = next_field(data, field_start, '%');
+       Serial.println("Data value = " + packet->data_value);
+       if (packet->data_value.length() == 0) {
+           Serial.println("Error reading data_value from LoRa packet.");
+           return false;
+       }
+       String temp_str = next_field(data, field_start, '%');
+       if (temp_str.length() == 0) {
+           Serial.println("Error reading alarm_code from LoRa packet.");
+           return false;
+       }
+       else {
+           Serial.println("Alarm code = " + temp_str);
+           packet->alarm_code = temp_str.toInt();
+           if (packet->alarm_code > 0) {
+               set_first_alarm_time(packet);
+           }
+       }
+       temp_str = next_field(data, field_start, '%');
+       if (temp_str.length() == 0) {
+           Serial.println("Error reading alarm_email_interval from LoRa packet.");
+           return false;
+       }
+       else {
+           Serial.println("Alarm email interval = " + temp_str);
+           packet->alarm_email_interval = temp_str.toInt();
+       }
+       temp_str = next_field(data, field_start, '%');
+       if (temp_str.length() == 0) {
+           Serial.println("Error reading max_alarm_emails from LoRa packet.");
            return false;
        }
+       else {
+           Serial.println("Max alarm emails = " + temp_str);
+           packet->max_alarm_emails_to_send = temp_str.toInt();
+       }
+       return true;
+    }
+
+    /**
+    * @brief Set the sequence number of a frame, if the transmitter sent one.
+    */
+
+    void parse_sequence(const String& sequence_str, Packet_t* frame) {
+       if (sequence_str.length() > 0) {
+           Serial.println("Sequence = " + sequence_str);
+           frame->sequence = (uint16_t)sequence_str.toInt();
+       }
+    }
+
+    /**
+    * @brief Set a new alarm's first_alarm_time to the current time, or to 0 if the
+    * system time isn't valid yet.
+    */
+
+    void set_first_alarm_time(Packet_t* packet) {
+       if (ui_->system_time_is_valid()) {
+           time(&packet->first_alarm_time); // set to current time
+           char *date = ctime(&packet->first_alarm_time);
+           Serial.println("First alarm time: " + String(date));
+       }
+       else {
+           packet->first_alarm_time = 0;
+           Serial.println("System time invalid, first_alarm_time set to 0");
+           ui_->post_status("Invalid sys time", ""); // called from the radio and packet queue tasks, too
+       }
     }
 
     /**
@@ -271,6 +688,7 @@ public:
        packet->SNR = 0;
        packet->timestamp = 0;
        packet->sent_to_influx = false;
+       packet->sequence = -1;
     }
    
     /**
@@ -293,76 +711,248 @@ public:
        new_packet.data_value = value;
        new_packet.alarm_code = alarm;
        if (new_packet.alarm_code > 0) {
-           if (ui_->system_time_is_valid()) {
-              time(&new_packet.first_alarm_time); // set first alarm time to current time
-           }
-           else {
-              new_packet.first_alarm_time = 0;
-              Serial.println("System time invalid, first_alarm_time set to 0");
-              ui_->update_bottom_line("Invalid sys time");
-              ui_->update_status_lines("Invalid sys time", "", 3);
-              ui_->update_status_lines("Waiting for data", "");
-           }
+           set_first_alarm_time(&new_packet);
        }
        new_packet.alarm_email_interval = alarm_interval;
        new_packet.max_alarm_emails_to_send = max_alarm_emails;
        new_packet.timestamp = millis();
        add_packet_to_queue(new_packet);
-       add_packet_to_influx_queue(new_packet);
     }
    
+    /**
+    * @brief Run a new value through its datapoint's alarm state machine (see alarm_fsm.h). The
+    * condition is the alarm_code from the transmitter or, if it didn't send one, from the alarm
+    * rules (see alarm_rules.h). Afterwards, packet->alarm_code is the alarm to show.
+    *
+    * @param datapoint The datapoint's entry in PacketList (or packet itself, if it's a new datapoint)
+    * @param condition_code Gets the condition
+    */
+
+    alarm_event_t update_alarm_state(Packet_t* datapoint, Packet_t* packet, int16_t* condition_code) {
+       uint32_t raise_dwell_ms = ALARM_RAISE_DWELL_MS;
+       *condition_code = packet->alarm_code;
+       if (*condition_code == 0) {
+           *condition_code = alarm_rules_.evaluate(packet, datapoint->alarm_rules, &datapoint->alarm_rules_broken,
+                                                  &raise_dwell_ms);
+       }
+       // New data ends a "no data" alarm right away
+       uint32_t clear_dwell_ms = datapoint->alarm_fsm.alarm_code() == STALE_ALARM_CODE ? 0 : alarm_clear_dwell_ms_;
+       alarm_state_t old_state = datapoint->alarm_fsm.state();
+       alarm_event_t event = datapoint->alarm_fsm.update(*condition_code, raise_dwell_ms, clear_dwell_ms, millis());
+       if (datapoint->alarm_fsm.state() != old_state) {
+           Serial.println(packet->unique_id + " alarm: " + AlarmFsm::state_name(old_state) + " -> "
+                          + AlarmFsm::state_name(datapoint->alarm_fsm.state()));
+       }
+       packet->alarm_code = datapoint->alarm_fsm.alarm_code();
+       return event;
+    }
+
     /**
     * @brief Add a new packet to the list, or update the list if there is already a packet in it for
-    * the same datapoint as the new packet.
+    * the same datapoint as the new packet. Either way, it goes through the alarm state machine first.
+    *
+    * @return the datapoint's entry in the list
     */
 
-    void add_packet_to_list(Packet_t* packet) {
-       if (packets_.empty()) {
-           packets_.push_back(*packet); // add it to the list
-           uint8_t list_size = packets_.size();
-       }
-       else { // look for the packet in the list
-           bool message_found = false;
-           for (Packet_it_t it = packets_.begin(); it != packets_.end(); ++it) {
-               if (it->unique_id == packet->unique_id) { // this packet is already in the list
-                   // update the data that's different with each packet from the same datapoint
-                   it->data_value = packet->data_value;
-                   if (!packet->alarm_code) { // there is no alarm
-                       it->first_alarm_time = 0;
-                       it->alarm_emails_sent = 0;
-                   }
-                   else if (!it->alarm_code && packet->alarm_code) { // alarm code is going from 0 to non-zero
-                       it->alarm_has_sounded = false;
-                       it->first_alarm_time = packet->first_alarm_time;
-                   }
-                   else if (packet->max_alarm_emails_to_send == 1) { // one-time alarms like "garden fill": reset so email will send
-                       it->alarm_emails_sent = 0;
-                       it->alarm_has_sounded = false;
-                       it->first_alarm_time = packet->first_alarm_time;
-                   }
-                   // edge case: datapoint has been in an alarm state, but the system time has been invalid,
-                   // so first_alarm_time has not been set yet. See if the system time is now valid, and if
-                   // it is, set first_alarm_time.
-                   else if (it->alarm_code && packet->alarm_code && it->first_alarm_time == 0) {
-                       if (ui_->system_time_is_valid()) {
-                           time(&it->first_alarm_time); // set first alarm time to current time
-                       }
+    Packet_t* add_packet_to_list(Packet_t* packet) {
+       int16_t condition_code = 0;
+       for (Packet_it_t it = packets_.begin(); it != packets_.end(); ++it) {
+           if (it->unique_id == packet->unique_id) { // this packet is already in the list
+               alarm_event_t event = update_alarm_state(&*it, packet, &condition_code);
+               learn_interval(&*it, packet->timestamp);
+               // update the data that's different with each packet from the same datapoint
+               it->data_value = packet->data_value;
+               if (event == ALARM_RAISED) {
+                   it->alarm_has_sounded = false;
+                   it->alarm_emails_sent = 0;
+                   set_first_alarm_time(&*it);
+               }
+               else if (event == ALARM_CLEARED) {
+                   it->first_alarm_time = 0;
+                   it->alarm_emails_sent = 0;
+               }
+               else if (condition_code && packet->max_alarm_emails_to_send == 1) { // one-time alarms like "garden fill": reset so email will send
+                   it->alarm_emails_sent = 0;
+                   it->alarm_has_sounded = false;
+                   set_first_alarm_time(&*it);
+               }
+               // edge case: datapoint has been in an alarm state, but the system time has been invalid,
+               // so first_alarm_time has not been set yet. See if the system time is now valid, and if
+               // it is, set first_alarm_time.
+               else if (packet->alarm_code && it->first_alarm_time == 0) {
+                   if (ui_->system_time_is_valid()) {
+                       time(&it->first_alarm_time); // set first alarm time to current time
                    }
-                   it->alarm_code = packet->alarm_code;
-                   it->RSSI = packet->RSSI;
-                   it->SNR = packet->SNR;
-                   it->timestamp = packet->timestamp;
-                   it->sent_to_influx = false;
-                   message_found = true;
-                   break;
                }
+               it->alarm_code = packet->alarm_code;
+               if (condition_code) { // keep the email settings of the alarm while it's clearing
+                   it->alarm_email_interval = packet->alarm_email_interval; // a rule may have changed them
+                   it->max_alarm_emails_to_send = packet->max_alarm_emails_to_send;
+               }
+               it->RSSI = packet->RSSI;
+               it->SNR = packet->SNR;
+               it->timestamp = packet->timestamp;
+               it->sent_to_influx = false;
+               it->revision++;
+               watch_for_stale_data(&*it);
+               return &*it;
+           }
+       }
+       // it's not already in the list
+       packet->alarm_rules = alarm_rules_.find_rules(packet->data_source, packet->data_name);
+       packet->derived_inputs = derived_metrics_.find_input(packet->data_source, packet->data_name);
+       if (update_alarm_state(packet, packet, &condition_code) == ALARM_RAISED) {
+           packet->alarm_has_sounded = false;
+           set_first_alarm_time(packet);
+       }
+       else {
+           packet->first_alarm_time = 0; // pending, not an alarm yet
+       }
+       return add_new_datapoint(packet);
+    }
+
+    /**
+    * @brief Add a datapoint that isn't in the list yet, with its settings from config.h,
+    * and start watching it for stale data.
+    *
+    * @return the datapoint's entry in the list
+    */
+
+    Packet_t* add_new_datapoint(Packet_t* packet) {
+       packets_.push_back(*packet); // add it to the list
+       Packet_t* datapoint = &packets_.back();
+       datapoint->revision++;
+       datapoint->stale_timer.owner = datapoint;
+       static const InfluxDeadband influx_deadbands[] = INFLUX_DEADBANDS;
+       datapoint->influx_deadband = INFLUX_DEFAULT_DEADBAND;
+       for (const InfluxDeadband& deadband : influx_deadbands) {
+           if (datapoint->data_source == deadband.data_source && datapoint->data_name == deadband.data_name) {
+               datapoint->influx_deadband = deadband.deadband;
+           }
+       }
+#ifdef INFLUX_AGGREGATION
+       // An aggregate needs every value, so aggregated datapoints skip the deadband
+       static const AggregationConfig aggregation[] = INFLUX_AGGREGATION;
+       for (const AggregationConfig& config : aggregation) {
+           if (datapoint->data_source == config.data_source && datapoint->data_name == config.data_name) {
+               datapoint->influx_deadband = -1;
            }
-           if (!message_found) { // it's not already in the list
-               packets_.push_back(*packet); // add it to the list
-               uint8_t list_size = packets_.size();
+       }
+#endif
+       static const ExpectedInterval expected_intervals[] = EXPECTED_INTERVALS;
+       for (const ExpectedInterval& expected : expected_intervals) {
+           if (datapoint->data_source == expected.data_source && datapoint->data_name == expected.data_name) {
+               datapoint->expected_interval_ms = expected.seconds * 1000;
+               datapoint->interval_configured = true;
            }
        }
+       watch_for_stale_data(datapoint);
        // print_packet_list_contents(); // needed only for troubleshooting
+       return datapoint;
+    }
+
+    /**
+    * @brief Update a datapoint's expected interval (a moving average of the time between its
+    * packets) with the time since its last packet. A gap long enough to be an outage isn't
+    * an interval, so it's left out.
+    */
+
+    void learn_interval(Packet_t* datapoint, uint32_t now) {
+       uint32_t interval_ms = now - datapoint->timestamp;
+       if (datapoint->interval_configured || interval_ms == 0) {
+           return;
+       }
+       if (datapoint->expected_interval_ms == 0) {
+           datapoint->expected_interval_ms = interval_ms;
+       }
+       else if (interval_ms < STALE_AFTER_INTERVALS * datapoint->expected_interval_ms) {
+           datapoint->expected_interval_ms += INTERVAL_EWMA_WEIGHT * ((float)interval_ms - datapoint->expected_interval_ms);
+       }
+    }
+
+    /**
+    * @brief (Re)start the timer that raises the "no data" alarm if the datapoint misses
+    * STALE_AFTER_INTERVALS of its expected intervals. Until its interval is known, it isn't watched.
+    */
+
+    void watch_for_stale_data(Packet_t* datapoint) {
+       if (datapoint->expected_interval_ms > 0) {
+           stale_timers_.schedule(&datapoint->stale_timer, STALE_AFTER_INTERVALS * datapoint->expected_interval_ms);
+       }
+    }
+
+    /**
+    * @brief A datapoint's stale timer expired: raise its "no data" alarm, through its alarm
+    * state machine like any other alarm, so it's shown, sounded, emailed and sent to Influx.
+    */
+
+    void on_stale_data(Packet_t* datapoint) {
+       Serial.println(datapoint->unique_id + ": no data for " + String((millis() - datapoint->timestamp) / 1000) + " s");
+       if (datapoint->alarm_fsm.update(STALE_ALARM_CODE, 0, alarm_clear_dwell_ms_, millis()) == ALARM_RAISED) {
+           datapoint->alarm_has_sounded = false;
+           datapoint->alarm_emails_sent = 0;
+           set_first_alarm_time(datapoint);
+       }
+       datapoint->alarm_code = datapoint->alarm_fsm.alarm_code();
+       datapoint->alarm_email_interval = STALE_ALARM_EMAIL_INTERVAL;
+       datapoint->max_alarm_emails_to_send = STALE_ALARM_MAX_EMAILS;
+       datapoint->revision++;
+       send_to_influx(datapoint);
+       notify_update(datapoint);
+    }
+
+    /**
+     * @brief Use the settings from RuntimeConfig (see runtime_config.h): called once at boot,
+     * and then every time a setting changes. It runs in loop()'s task, while the packet task
+     * evaluates the same rules, so it holds the lock.
+     */
+
+    void apply_settings(const RuntimeSettings& settings) {
+        lock();
+        alarm_clear_dwell_ms_ = settings.clear_dwell_ms;
+        influx_heartbeat_ms_ = settings.influx_hb_min * 60000UL;
+        alarm_rules_.set_threshold(BME280_DATA_SOURCE, BME280_TEMP_NAME, RULE_AT_MOST, settings.low_temp);
+        alarm_rules_.set_threshold(BME280_DATA_SOURCE, BME280_TEMP_NAME, RULE_AT_LEAST, settings.high_temp);
+        alarm_rules_.set_threshold(BME280_DATA_SOURCE, BME280_PRESSURE_NAME, RULE_AT_MOST, settings.low_pressure);
+        alarm_rules_.set_threshold(BME280_DATA_SOURCE, BME280_PRESSURE_NAME, RULE_AT_LEAST, settings.high_pressure);
+        alarm_rules_.set_threshold(BME280_DATA_SOURCE, BME280_HUMIDITY_NAME, RULE_AT_MOST, settings.low_humidity);
+        alarm_rules_.set_threshold(BME280_DATA_SOURCE, BME280_HUMIDITY_NAME, RULE_AT_LEAST, settings.high_humidity);
+        unlock();
+    }
+
+    /**
+     * @brief Apply the settings now, and every time they change.
+     */
+
+    void follow_settings(RuntimeConfig* runtime_config) {
+        apply_settings(runtime_config->settings());
+        runtime_config->subscribe(apply_settings_impl, this);
+    }
+
+    /**
+     * @brief Binary packets dropped because their transmitter's schema isn't known yet
+     */
+
+    uint32_t unknown_schema_packets() {
+        return schema_registry_.unknown_schema_packets();
+    }
+
+    /**
+     * @brief The commands waiting to be sent to the transmitters - see downlink.h
+     */
+
+    DownlinkQueue* downlink() {
+        return &downlink_;
+    }
+
+    /**
+     * @brief Print out the link quality of every transmitter, with the radio profile
+     * each one could use instead of the current one.
+     */
+
+    void print_link_table() {
+        RadioProfile profile = lora_->get_radio_profile();
+        link_table_.print_link_table(profile.spread_factor, profile.output_power);
     }
 
     /**
@@ -390,36 +980,24 @@ public:
     */
 
     void update_BME280_packets() {
+       if (!bme280_started_) { // with FAST_BOOT, start_bme280() might not have run yet
+           return;
+       }
        Serial.println("Updating Home Data");
        ui_->update_status_lines("Updating Home", "       Data", 3);
-       int16_t alarm = 0;
+       // The alarm thresholds are in the ALARM_RULES in config.h
        float data = (bme280_->readTemperature() * 1.8) + 32.0;
        data = data + TEMP_CALIBRATION; // Corrects for individual BME280 - see config.h
        Serial.println("temperature: " + String(data, 1));
-       if (data <= LOW_TEMP_ALARM_VALUE || data >= HIGH_TEMP_ALARM_VALUE) {
-           alarm = (uint16_t)TEMP_ALARM_CODE;
-       }
-       create_generic_packet("Home_temp","Home", "Temp (F)", String(data, 0), alarm,
-                             (uint16_t)TEMP_ALARM_EMAIL_INTERVAL, (uint16_t)TEMP_ALARM_MAX_EMAILS);
-       alarm = 0;
+       create_generic_packet("Home_temp", BME280_DATA_SOURCE, BME280_TEMP_NAME, String(data, 0), 0);
        
        data = (bme280_->readPressure() * 0.0002953); // convert from Pascals to inches of mercury
        Serial.println("pressure: " + String(data, 2));
-       if (data <= LOW_PRESSURE_ALARM_VALUE || data >= HIGH_PRESSURE_ALARM_VALUE) {
-           alarm = (uint16_t)PRESSURE_ALARM_CODE;
-       }
-       create_generic_packet("Home_press", "Home", "Pressure", String(data, 2), alarm,
-                             (uint16_t)PRESSURE_ALARM_EMAIL_INTERVAL, (uint16_t)PRESSURE_ALARM_MAX_EMAILS);
-       alarm = 0;
+       create_generic_packet("Home_press", BME280_DATA_SOURCE, BME280_PRESSURE_NAME, String(data, 2), 0);
 
        data = (bme280_->readHumidity());
        Serial.println("humidity: " + String(data, 1));
-       if (data <= LOW_HUMIDITY_ALARM_VALUE || data >= HIGH_HUMIDITY_ALARM_VALUE) {
-           alarm = (uint16_t)HUMIDITY_ALARM_CODE;
-       }
-       create_generic_packet("Home_humid", "Home", "Humidity", String(data, 0), alarm,
-                             (uint16_t)HUMIDITY_ALARM_EMAIL_INTERVAL, (uint16_t)HUMIDITY_ALARM_MAX_EMAILS);
-       alarm = 0;
+       create_generic_packet("Home_humid", BME280_DATA_SOURCE, BME280_HUMIDITY_NAME, String(data, 0), 0);
        
        ui_->update_status_lines("Waiting for data", "");
     }
@@ -4,11 +4,13 @@
 #include <Arduino.h>
 #include <list>
 #include "time.h"
+#include "alarm_fsm.h"
+#include "timer_wheel.h"
 
 struct Packet_t {
         String unique_id = "";
         uint16_t transmitter_address = 0;
-        int8_t data_length = 0;
+        uint8_t data_length = 0; // up to 240
         String data_source = "";
         String data_name = "";
         String data_value = "";
@@ -23,8 +25,40 @@ struct Packet_t {
         int8_t SNR = 0;
         uint32_t timestamp = 0;
         bool sent_to_influx = false;
+        int32_t sequence = -1; // optional sequence number from the transmitter, -1 if it didn't send one
+        int16_t alarm_rules = -1; // this datapoint's slice of AlarmRules, -1 if it has none (see alarm_rules.h)
+        uint8_t alarm_rules_broken = 0; // bit i: the i-th rule in that slice is broken (and waiting for its hysteresis)
+        int16_t derived_inputs = -1; // this datapoint's slot in DerivedMetrics, -1 if nothing is derived from it
+        AlarmFsm alarm_fsm;       // used only in the datapoint's entry in PacketList
+        TimerNode stale_timer;    // also only in PacketList - see PacketList::watch_for_stale_data()
+        uint32_t expected_interval_ms = 0; // between packets: learned, or from EXPECTED_INTERVALS in config.h
+        bool interval_configured = false;
+        float influx_deadband = 0;          // the rest are for PacketList::send_to_influx()
+        float influx_last_value = 0;
+        bool influx_last_numeric = true;
+        String influx_last_text;            // only when the value sent wasn't a number
+        int16_t influx_last_alarm_code = 0;
+        uint32_t influx_last_sent_ms = 0;
+        bool influx_sent_once = false;
+        uint32_t revision = 0;    // changes every time the entry in PacketList does (see web_api.h)
 };
 
 typedef std::list<Packet_t>::iterator Packet_it_t;
 
+/**
+* @brief Return the part of str from *start up to the next separator (or to the end
+* of str), and move *start past that separator. Used to take apart every payload
+* format - see PacketList::parse_rcv_line() and SchemaRegistry.
+*/
+
+inline String next_field(const String& str, int* start, char separator) {
+    int end = str.indexOf(separator, *start);
+    if (end < 0) {
+        end = str.length();
+    }
+    String field = str.substring(*start, end);
+    *start = end + 1;
+    return field;
+}
+
 #endif // #ifndef _PACKET_T_H_
\ No newline at end of file
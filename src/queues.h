@@ -4,25 +4,116 @@
 #include <Arduino.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 #include "packet_t.h"
 
-QueueHandle_t new_packet_queue_handle = NULL;
-QueueHandle_t send_to_influx_queue_handle = NULL;
+#define NEW_PACKET_QUEUE_LENGTH 16      // room for two full multi-reading LoRa frames
+#define INFLUX_QUEUE_LENGTH 16
+#define ALARM_LANE_LENGTH 8             // reserved for alarms, in each queue
+#define QUEUE_SEND_TIMEOUT_MS 100
+
+enum queue_lane_t : uint8_t {ALARM_LANE, ROUTINE_LANE, LANE_COUNT};
+
+/**
+ * @brief A queue of packets with two lanes: packets with an alarm (or an alarm that just
+ * changed) go in the alarm lane, which has room of its own and is always read first, so a
+ * burst of routine readings can neither crowd out an alarm nor hold it up.
+ *
+ * The lanes hold pointers to packets on the heap, not the packets themselves: a Packet_t
+ * has Strings, which can't be copied byte-for-byte in and out of a FreeRTOS queue.
+ */
+
+struct PacketQueue {
+    QueueHandle_t lanes[LANE_COUNT] = {NULL, NULL};
+    uint32_t dropped[LANE_COUNT] = {0, 0};     // packets that didn't fit, since boot
+    TaskHandle_t consumer = NULL;              // if set, woken when an alarm is added
+    // Held while adding to this queue, so all of the packets from one LoRa frame go in together
+    SemaphoreHandle_t producer_mutex = NULL;
+};
+
+PacketQueue new_packet_queue;
+PacketQueue send_to_influx_queue;
+
+void create_packet_queue(PacketQueue* queue, UBaseType_t routine_length, const char* name) {
+    queue->lanes[ALARM_LANE] = xQueueCreate(ALARM_LANE_LENGTH, sizeof(Packet_t*));
+    queue->lanes[ROUTINE_LANE] = xQueueCreate(routine_length, sizeof(Packet_t*));
+    queue->producer_mutex = xSemaphoreCreateMutex();
+    if (queue->lanes[ALARM_LANE] == NULL || queue->lanes[ROUTINE_LANE] == NULL || queue->producer_mutex == NULL) {
+        /* The queue was not created successfully as there was not enough
+        heap memory available.*/
+        Serial.println(String(name) + " was not created successfully");
+    }
+}
 
 void initialize_queues() {
-  new_packet_queue_handle = xQueueCreate(5, sizeof(Packet_t));
-  if(new_packet_queue_handle == NULL) {
-      /* The queue was not created successfully as there was not enough
-      heap memory available.*/
-      Serial.println("new_packet_queue_handle was not created successfully");
-   }
+    create_packet_queue(&new_packet_queue, NEW_PACKET_QUEUE_LENGTH, "new_packet_queue");
+    create_packet_queue(&send_to_influx_queue, INFLUX_QUEUE_LENGTH, "send_to_influx_queue");
+}
+
+queue_lane_t lane_for(const Packet_t& packet, bool alarm_changed) {
+    return (alarm_changed || packet.alarm_code > 0) ? ALARM_LANE : ROUTINE_LANE;
+}
+
+/**
+ * @brief Add count packets to a queue, all or none: wait up to timeout_ms for there to be
+ * room for all of them, each in its own lane. If there isn't, they're counted as dropped
+ * in their lanes. The queue's producer_mutex is held only while checking for room and adding,
+ * never while waiting, so a full queue doesn't hold up the producers of the other queue.
+ *
+ * @param alarm_changed true to put them all in the alarm lane, even if they have no alarm
+ * @param timeout_ms 0 to drop them at once if there's no room
+ */
+
+bool add_packets_to(PacketQueue* queue, Packet_t* packets, uint8_t count, bool alarm_changed = false,
+                    uint32_t timeout_ms = QUEUE_SEND_TIMEOUT_MS) {
+    UBaseType_t needed[LANE_COUNT] = {0, 0};
+    for (uint8_t i = 0; i < count; i++) {
+        needed[lane_for(packets[i], alarm_changed)]++;
+    }
+    bool added = false;
+    bool timed_out = false;
+    uint32_t start_ms = millis();
+    while (!added && !timed_out) {
+        timed_out = millis() - start_ms >= timeout_ms;
+        xSemaphoreTake(queue->producer_mutex, portMAX_DELAY);
+        if (uxQueueSpacesAvailable(queue->lanes[ALARM_LANE]) >= needed[ALARM_LANE]
+            && uxQueueSpacesAvailable(queue->lanes[ROUTINE_LANE]) >= needed[ROUTINE_LANE]) {
+            for (uint8_t i = 0; i < count; i++) {
+                Packet_t* packet = new Packet_t(packets[i]);
+                xQueueSend(queue->lanes[lane_for(packets[i], alarm_changed)], &packet, 0);
+            }
+            added = true;
+        }
+        else if (timed_out) {
+            queue->dropped[ALARM_LANE] += needed[ALARM_LANE];
+            queue->dropped[ROUTINE_LANE] += needed[ROUTINE_LANE];
+        }
+        xSemaphoreGive(queue->producer_mutex);
+        if (!added && !timed_out) {
+            vTaskDelay(10 / portTICK_RATE_MS);
+        }
+    }
+    if (added && needed[ALARM_LANE] > 0 && queue->consumer != NULL) {
+        xTaskNotifyGive(queue->consumer);
+    }
+    return added;
+}
+
+/**
+ * @brief Read a single packet from a queue: from the alarm lane if there's one there,
+ * otherwise from the routine lane, waiting up to 10 ticks for one.
+ */
 
-  send_to_influx_queue_handle = xQueueCreate(10, sizeof(Packet_t));
-  if(send_to_influx_queue_handle == NULL) {
-      /* The queue was not created successfully as there was not enough
-      heap memory available.*/
-      Serial.println("send_to_influx_queue_handle was not created successfully");
-   }
+bool read_packet_from(PacketQueue* queue, Packet_t* packet) {
+    Packet_t* queued = NULL;
+    if (xQueueReceive(queue->lanes[ALARM_LANE], &queued, 0) != pdPASS
+        && xQueueReceive(queue->lanes[ROUTINE_LANE], &queued, 10) != pdPASS) {
+        return false;
+    }
+    *packet = *queued;
+    delete queued;
+    return true;
 }
 
 /**
@@ -30,7 +121,16 @@ void initialize_queues() {
  */
 
 void add_packet_to_queue(Packet_t packet) {
-    xQueueSend(new_packet_queue_handle, &packet, 100 / portTICK_RATE_MS);
+    add_packets_to(&new_packet_queue, &packet, 1);
+}
+
+/**
+ * @brief Add all of the packets from one LoRa frame to the new_packet_queue,
+ * in one operation.
+ */
+
+bool add_packets_to_queue(Packet_t* packets, uint8_t count) {
+    return add_packets_to(&new_packet_queue, packets, count);
 }
 
 /**
@@ -38,15 +138,29 @@ void add_packet_to_queue(Packet_t packet) {
  */
 
 bool read_packet_from_queue(Packet_t* packet) {
-    return xQueueReceive(new_packet_queue_handle, &(*packet), 10) == pdPASS;
+    return read_packet_from(&new_packet_queue, packet);
 }
 
 /**
- * @brief Add a single packet to the influx_queue
+ * @brief Add a single packet to the influx_queue. Like add_packets_to_influx_queue(),
+ * it never waits.
  */
 
 void add_packet_to_influx_queue(Packet_t packet) {
-    xQueueSend(send_to_influx_queue_handle, &packet, 100 / portTICK_RATE_MS);
+    add_packets_to(&send_to_influx_queue, &packet, 1, false, 0);
+}
+
+/**
+ * @brief Add packets to the influx_queue, in one operation. It's called with PacketList
+ * locked, so it never waits: if the queue is full, they're dropped at once (and counted
+ * in its dropped[] - see queue_drops()).
+ *
+ * @param alarm_changed true if their alarm_code just changed (to 0, too), so the
+ * change reaches InfluxDB ahead of the routine readings
+ */
+
+bool add_packets_to_influx_queue(Packet_t* packets, uint8_t count, bool alarm_changed = false) {
+    return add_packets_to(&send_to_influx_queue, packets, count, alarm_changed, 0);
 }
 
 /**
@@ -54,7 +168,15 @@ void add_packet_to_influx_queue(Packet_t packet) {
  */
 
 bool read_packet_from_influx_queue(Packet_t* packet) {
-    return xQueueReceive(send_to_influx_queue_handle, &(*packet), 10) == pdPASS;
+    return read_packet_from(&send_to_influx_queue, packet);
+}
+
+/**
+ * @brief Packets dropped from a queue's lane since boot, because there was no room
+ */
+
+uint32_t queue_drops(const PacketQueue& queue, queue_lane_t lane) {
+    return queue.dropped[lane];
 }
 
-#endif // #ifndef _QUEUES_H_
\ No newline at end of file
+#endif // #ifndef _QUEUES_H_
@@ -3,6 +3,71 @@
 
 #include "Arduino.h"
 #include "config.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+#define AT_COMMAND_TIMEOUT_MS 1000  // most commands reply within a few ms
+#define AT_SEND_TIMEOUT_MS 10000    // AT+SEND replies after the transmission: up to 8.4 s at SF12 / 125 kHz
+#define AT_COMMAND_QUEUE_LENGTH 8
+#define AT_MAX_LINE_LENGTH 300      // longest +RCV line is ~270 characters (240 bytes of data)
+
+enum at_result_t { AT_PENDING, AT_OK, AT_ERROR, AT_TIMEOUT };
+
+/**
+ * @brief One AT command waiting in (or sent from) the command queue.
+ * If delete_when_done is true, nobody is waiting for the result (see ReyaxLoRa::queue_command()),
+ * and the command is deleted when it completes.
+ */
+
+struct AtCommand {
+    String command = "";           // without the trailing "\r\n"
+    uint32_t timeout_ms = AT_COMMAND_TIMEOUT_MS;
+    at_result_t result = AT_PENDING;
+    int16_t error_code = 0;        // the n from "+ERR=n"
+    String reply = "";             // the whole reply line, e.g. "+PARAMETER=9,7,1,4"
+    SemaphoreHandle_t done = NULL;  // given when the command completes, if not NULL
+    bool delete_when_done = false;
+};
+
+/**
+ * @brief All of the radio parameters that AT+PARAMETER, AT+BAND and AT+CRFOP control.
+ * The defaults come from config.h. See the set_...() methods of ReyaxLoRa for the values.
+ */
+
+struct RadioProfile {
+    uint32_t frequency = LORA_FREQUENCY;
+    int8_t output_power = LORA_OUTPUT_POWER;
+    int8_t spread_factor = LORA_SPREAD_FACTOR;
+    int8_t bandwidth = LORA_BANDWIDTH;
+    int8_t coding_rate = LORA_CODING_RATE;
+    int8_t preamble = LORA_PREAMBLE;
+
+    bool operator==(const RadioProfile& other) const {
+        return frequency == other.frequency && output_power == other.output_power
+               && spread_factor == other.spread_factor && bandwidth == other.bandwidth
+               && coding_rate == other.coding_rate && preamble == other.preamble;
+    }
+};
+
+// Called for every unsolicited "+RCV=..." line. See set_receive_handler().
+typedef void (*rcv_handler_t)(void* context, const String& rcv_line);
+
+/**
+ * @brief ReyaxLoRa controls one Reyax RYLR89x LoRa module through its AT commands.
+ *
+ * All traffic to and from the module goes through a small command engine: commands are queued,
+ * sent one at a time, and each one is completed by the reply line that matches it ("+OK", "+ERR=n",
+ * or the "+NAME=value" response to a "AT+NAME?" query), or by its own timeout. Unsolicited "+RCV="
+ * lines are handed to the receive handler as soon as they're read, even while a command is
+ * waiting for its reply, so the radio can be reconfigured (or can send) while packets keep coming in.
+ *
+ * The engine runs in whichever task calls poll() - on the base station, that's the get_new_packets
+ * task. Any other task can use send_command() (which blocks until the reply) or queue_command()
+ * (which doesn't). Before any task is polling, send_command() drives the engine itself.
+ * The module is reached only through the Stream it was given, so it can be driven by a scripted
+ * Stream instead of a real module.
+ */
 
 class ReyaxLoRa {
 public:
@@ -15,11 +80,24 @@ public:
     ReyaxLoRa()
     {}
 
+    // Constructor for a receiver's LoRa on any UART - the base station can have one on
+    // UART1 and another on UART2. (UART1's default pins are used by the flash, so
+    // the pins always have to be given.)
+    ReyaxLoRa(HardwareSerial* uart, int8_t rx_pin, int8_t tx_pin)
+        : port_{uart}, uart_{uart}, rx_pin_{rx_pin}, tx_pin_{tx_pin}
+    {}
+
+    // Constructor for a LoRa reached through any Stream - a scripted fake modem, for example.
+    // initialize() won't start a UART.
+    explicit ReyaxLoRa(Stream* port)
+        : port_{port}, uart_{NULL}
+    {}
+
     /**
      * @brief - initialize() sends power to the LoRa radio if pin_ has been set
      * to something other than 0 in the constructor (which should be done ONLY
      * for a transmitter - the receiver's radio is always powered on), then it
-     * starts Serial2, then it wakes up the radio.
+     * starts the LoRa's UART, then it wakes up the radio.
      */
 
     void initialize() {
@@ -31,18 +109,25 @@ public:
             delay(200);
         }
 
-        // Serial2 is defined in HardwareSerial.cpp as txPin = 17 and rxPin = 16
-        Serial2.begin(115200);
-        read_reply(); // the reply comes from Serial2.begin()
-        delay(500);
+        if (command_queue_ == NULL) {
+            command_queue_ = xQueueCreate(AT_COMMAND_QUEUE_LENGTH, sizeof(AtCommand*));
+            if (command_queue_ == NULL) {
+                Serial.println("command_queue_ was not created successfully");
+            }
+        }
+
+        if (uart_ != NULL) {
+            uart_->begin(baud_rate_, SERIAL_8N1, rx_pin_, tx_pin_);
+            delay(500);
+        }
+        poll_once(); // show anything the LoRa sent when its UART started
 
         // Wake up the LoRa and show the responses in the Serial Monitor
         send_and_read_reply("AT");
         send_and_read_reply("AT+VER?");
-        send_and_read_reply("AT+PARAMETER=9,7,1,4"); // SF, BW, CR, Preamble
         send_and_read_reply("AT+NETWORKID?");
         send_and_read_reply("AT+ADDRESS?");
-        send_and_read_reply("AT+PARAMETER?");
+        apply_settings();
     }
 
     
@@ -72,36 +157,37 @@ public:
 
     /**
      * @brief set_frequency() is used only to change the default
-     * frequency of 915000000 
+     * frequency of LORA_FREQUENCY. Like all of the set_...() methods, it takes
+     * effect only when apply_settings() is called.
      */
 
-    void set_frequency(int64_t freq) {
-        frequency_ = freq;
+    void set_frequency(uint32_t freq) {
+        profile_.frequency = freq;
     }
 
     /**
      * @brief set_output_power() is used only to change the default
-     * of 15
+     * of LORA_OUTPUT_POWER. Values are 0 - 15 (dBm).
      */
     
     void set_output_power(int8_t power) {
-        output_power_ = power;
+        profile_.output_power = power;
     }
 
     /**
      * @brief set_spread_factor() is used only to change the default
-     * of 12. The larger the SF is, the better the sensitivity is. But the transmission
+     * of LORA_SPREAD_FACTOR. The larger the SF is, the better the sensitivity is. But the transmission
      * time will take longer.
      * Possible values are 7 - 12.
      */
     
     void set_spread_factor(int8_t spread) {
-        spread_factor_ = spread;
+        profile_.spread_factor = spread;
     }
 
     /**
      * @brief set_bandwidth() is used only to change the default
-     * of 7.
+     * of LORA_BANDWIDTH.
      * <Bandwidth>0~9 list as below
      * 0 : 7.8KHz (not recommended, over spec.)
      * 1 : 10.4KHz (not recommended, over spec.)
@@ -116,60 +202,284 @@ public:
      */
 
     void set_bandwidth(int8_t bandwidth) {
-        bandwidth_ = bandwidth;
+        profile_.bandwidth = bandwidth;
     }
 
     /**
      * @brief set_coding_rate() is used only to change the default
-     * of 1. A higher coding rate will not increase range, but will make a link more reliable,
+     * of LORA_CODING_RATE. A higher coding rate will not increase range, but will make a link more reliable,
      * and will slow down the transmission.
-     * Values are 1 - 4. (Representing 4/5, 4/6, 4/7, and 4/8, I THINK)
+     * Values are 1 - 4, representing 4/5, 4/6, 4/7, and 4/8.
      */
 
     void set_coding_rate(int8_t rate) {
-        coding_rate_ = rate;
+        profile_.coding_rate = rate;
     }
     
     /**
      * @brief set_preamble() is used only to change the default
-     * of 4
+     * of LORA_PREAMBLE. Values are 4 - 7.
      */
     
     void set_preamble(int8_t preamble) {
-        preamble_ = preamble;
+        profile_.preamble = preamble;
     }
 
     /**
-     * @brief - If delay_ms is > 0, does a delay(delay_ms), then reads whatever is in the
-     * Serial2 buffer (typically, it's a reply from an AT command that was just sent), then displays
-     * it on Serial. Some of the AT commands seem to need the delay before reading the reply.
-     * (AT+SEND is one of them.)
+     * @brief Send everything set with the set_...() methods to the LoRa, and verify it.
+     * See apply_radio_profile().
      */
 
-    void read_reply(int delay_ms = 0) {
-        if (delay_ms)
-            delay(delay_ms);
-        Serial.println(Serial2.readStringUntil('\n'));
+    bool apply_settings() {
+        return apply_radio_profile(profile_);
+    }
+
+    /**
+     * @brief Send a whole radio profile to the LoRa (AT+PARAMETER, AT+BAND, AT+CRFOP), then
+     * read it back to make sure the LoRa is really using it. If any part of that fails,
+     * the last profile that was verified is sent again, so the LoRa is never left with
+     * half of a profile.
+     *
+     * @return true if the LoRa is now using the new profile
+     */
+
+    bool apply_radio_profile(const RadioProfile& profile) {
+        if (profile.spread_factor < 7 || profile.spread_factor > 12 || profile.bandwidth < 0
+            || profile.bandwidth > 9 || profile.coding_rate < 1 || profile.coding_rate > 4
+            || profile.preamble < 4 || profile.output_power < 0 || profile.output_power > 15) {
+            Serial.println("Invalid radio profile - not applied");
+            return false;
+        }
+        if (profile_mutex_ == NULL) {
+            profile_mutex_ = xSemaphoreCreateMutex();
+        }
+        xSemaphoreTake(profile_mutex_, portMAX_DELAY);
+        RadioProfile actual;
+        bool success = write_radio_profile(profile) && read_radio_profile(&actual) && actual == profile;
+        if (success) {
+            applied_ = profile;
+            profile_ = profile;
+            profile_verified_ = true;
+            print_radio_profile(applied_);
+        }
+        else {
+            Serial.println("Radio profile was not applied");
+            if (profile_verified_) {
+                Serial.println("Going back to the last verified radio profile");
+                write_radio_profile(applied_);
+            }
+        }
+        xSemaphoreGive(profile_mutex_);
+        return success;
+    }
+
+    /**
+     * @brief Ask the LoRa what radio profile it's using.
+     *
+     * @return false if any of the queries failed
+     */
+
+    bool read_radio_profile(RadioProfile* profile) {
+        String reply;
+        if (send_command("AT+PARAMETER?", &reply) != AT_OK) {
+            return false;
+        }
+        // +PARAMETER=<SF>,<BW>,<CR>,<Preamble>
+        int start = reply.indexOf('=') + 1;
+        int values[4];
+        for (int i = 0; i < 4; i++) {
+            int end = reply.indexOf(',', start);
+            if (end < 0) {
+                end = reply.length();
+            }
+            values[i] = reply.substring(start, end).toInt();
+            start = end + 1;
+        }
+        profile->spread_factor = values[0];
+        profile->bandwidth = values[1];
+        profile->coding_rate = values[2];
+        profile->preamble = values[3];
+
+        if (send_command("AT+BAND?", &reply) != AT_OK) {
+            return false;
+        }
+        profile->frequency = strtoul(reply.substring(reply.indexOf('=') + 1).c_str(), NULL, 10);
+
+        if (send_command("AT+CRFOP?", &reply) != AT_OK) {
+            return false;
+        }
+        profile->output_power = reply.substring(reply.indexOf('=') + 1).toInt();
+        return true;
+    }
+
+    /**
+     * @brief The radio profile the LoRa was last verified to be using.
+     */
+
+    RadioProfile get_radio_profile() {
+        return applied_;
+    }
+
+    /**
+     * @brief Convert a bandwidth code (0 - 9, see set_bandwidth()) to Hz.
+     */
+
+    static float bandwidth_hz(int8_t bandwidth) {
+        static const float bandwidths[] = {7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000};
+        if (bandwidth < 0 || bandwidth > 9) {
+            return bandwidths[7];
+        }
+        return bandwidths[bandwidth];
+    }
+
+    /**
+     * @brief How long it takes to transmit a payload with a radio profile, using the formula
+     * in Semtech's "LoRa Modem Designer's Guide" (AN1200.13): explicit header, CRC on, and
+     * low data rate optimization whenever a symbol is longer than 16 ms.
+     * The LoRa module adds a few bytes of its own (the addresses) to every payload.
+     *
+     * @param payload_bytes Length of the <Data> in AT+SEND
+     * @return time on air, in milliseconds
+     */
+
+    static float time_on_air_ms(const RadioProfile& profile, uint8_t payload_bytes) {
+        float symbol_ms = (float)(1UL << profile.spread_factor) / bandwidth_hz(profile.bandwidth) * 1000.0;
+        int low_data_rate_optimize = symbol_ms > 16.0 ? 1 : 0;
+        float preamble_ms = (profile.preamble + 4.25) * symbol_ms;
+        int32_t numerator = 8 * payload_bytes - 4 * profile.spread_factor + 28 + 16; // 16 for the CRC
+        int32_t denominator = 4 * (profile.spread_factor - 2 * low_data_rate_optimize);
+        int32_t payload_symbols = 8;
+        if (numerator > 0) {
+            payload_symbols += ((numerator + denominator - 1) / denominator) * (profile.coding_rate + 4);
+        }
+        return preamble_ms + payload_symbols * symbol_ms;
+    }
+
+    /**
+     * @brief time_on_air_ms() for the radio profile the LoRa is using now.
+     */
+
+    float time_on_air_ms(uint8_t payload_bytes) {
+        return time_on_air_ms(applied_, payload_bytes);
+    }
+
+    /**
+     * @brief Show a radio profile in the Serial Monitor, with its time on air and
+     * throughput for a short and a maximum-length payload.
+     */
+
+    static void print_radio_profile(const RadioProfile& profile) {
+        Serial.println("Radio profile: " + String(profile.frequency) + " Hz, " + String(profile.output_power)
+                       + " dBm, SF" + String(profile.spread_factor) + ", BW " + String(bandwidth_hz(profile.bandwidth) / 1000.0, 1)
+                       + " kHz, CR 4/" + String(profile.coding_rate + 4) + ", preamble " + String(profile.preamble));
+        const uint8_t payload_sizes[] = {32, 240};
+        for (uint8_t payload_bytes : payload_sizes) {
+            float toa_ms = time_on_air_ms(profile, payload_bytes);
+            Serial.println("   " + String(payload_bytes) + " bytes: " + String(toa_ms, 1) + " ms on air, "
+                           + String(payload_bytes * 8 * 1000.0 / toa_ms, 0) + " bps");
+        }
+    }
+
+    /**
+     * @brief Set the function that's called with every "+RCV=" line that comes in from
+     * the LoRa. context is passed back to it - typically the "this" of the object that
+     * parses the packets.
+     */
+
+    void set_receive_handler(rcv_handler_t handler, void* context) {
+        rcv_handler_ = handler;
+        rcv_context_ = context;
+    }
+
+    /**
+     * @brief Run the command engine: read and dispatch every complete line from the LoRa,
+     * time out the command that's waiting for a reply, and send the next queued command.
+     * Call this frequently from ONE task; it never blocks.
+     */
+
+    void poll() {
+        if (engine_task_ == NULL) {
+            engine_task_ = xTaskGetCurrentTaskHandle();
+        }
+        poll_once();
+    }
+
+    /**
+     * @brief Queue an AT command without waiting for its reply. The reply is
+     * shown in the Serial Monitor when it comes in.
+     *
+     * @return false if the command queue is full
+     */
+
+    bool queue_command(String command, uint32_t timeout_ms = AT_COMMAND_TIMEOUT_MS) {
+        AtCommand* at_command = new AtCommand();
+        at_command->command = command;
+        at_command->timeout_ms = timeout_ms;
+        at_command->delete_when_done = true;
+        if (command_queue_ == NULL || xQueueSend(command_queue_, &at_command, 0) != pdPASS) {
+            Serial.println("AT command queue full, dropped: " + command);
+            delete at_command;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Send an AT command and wait for the reply that matches it.
+     *
+     * @param command The AT command, without "\r\n"
+     * @param reply If not NULL, gets the reply line (e.g. "+ADDRESS=65000")
+     * @param timeout_ms How long to wait for the reply, once the command has been sent
+     * @return AT_OK, AT_ERROR (the error number is in the reply), or AT_TIMEOUT
+     */
+
+    at_result_t send_command(String command, String* reply = NULL, uint32_t timeout_ms = AT_COMMAND_TIMEOUT_MS) {
+        AtCommand at_command;
+        at_command.command = command;
+        at_command.timeout_ms = timeout_ms;
+        AtCommand* at_command_ptr = &at_command;
+        if (command_queue_ == NULL) {
+            Serial.println("ReyaxLoRa::initialize() has not run, dropped: " + command);
+            return AT_ERROR;
+        }
+        if (engine_task_ == NULL || engine_task_ == xTaskGetCurrentTaskHandle()) {
+            // Nobody else is running the engine, so run it here until this command completes.
+            // Anything already in the queue goes first.
+            if (xQueueSend(command_queue_, &at_command_ptr, 0) != pdPASS) {
+                Serial.println("AT command queue full, dropped: " + command);
+                return AT_ERROR;
+            }
+            while (at_command.result == AT_PENDING) {
+                poll_once();
+                delay(1);
+            }
+        }
+        else {
+            at_command.done = xSemaphoreCreateBinary();
+            if (at_command.done == NULL || xQueueSend(command_queue_, &at_command_ptr, portMAX_DELAY) != pdPASS) {
+                Serial.println("Unable to queue AT command: " + command);
+                return AT_ERROR;
+            }
+            // The engine always completes a command - with a timeout, if nothing else.
+            xSemaphoreTake(at_command.done, portMAX_DELAY);
+            vSemaphoreDelete(at_command.done);
+        }
+        if (reply != NULL) {
+            *reply = at_command.reply;
+        }
+        return at_command.result;
     }
 
-    
     /**
-     * @brief Sends an AT command to the LoRa, then reads the reply from the LoRa
-     * and displays it in the serial monitor.
+     * @brief Sends an AT command to the LoRa, then waits for the reply from the LoRa.
+     * The command and the reply are displayed in the serial monitor.
      * 
      * @param send_string The AT command string you want to send to the LoRa
-     * @param delay_ms Delay between sending the AT command and trying to read the reply.
-     * See read_reply(), above.
+     * @param timeout_ms How long to wait for the reply.
      */
 
-    void send_and_read_reply(String send_string, int delay_ms = 0) {
-        String command = send_string + "\r\n";
-        String sending = "Sending: " + command;
-        // Display it on the serial monitor
-        Serial.println(sending);
-        // Now send it to the LoRa
-        Serial2.print(command);
-        read_reply(delay_ms);
+    void send_and_read_reply(String send_string, uint32_t timeout_ms = AT_COMMAND_TIMEOUT_MS) {
+        send_command(send_string, NULL, timeout_ms);
     }
 
     #ifndef BASE_STATION
@@ -192,7 +502,7 @@ public:
         String payload = "AT+SEND=" + String(address) + ","
                          + String(data_length) + "," 
                          + data_str;
-        send_and_read_reply(payload, 500);
+        send_and_read_reply(payload, AT_SEND_TIMEOUT_MS);
     }
     #endif
 
@@ -202,15 +512,126 @@ public:
 
 private:
     uint8_t pin_ = 0;
-    // All variables below are set to the factory defaults.
-    // Change any of them with the appropriate "set" method.
-    int64_t frequency_ = 915000000;
+    Stream* port_ = &Serial2;
+    HardwareSerial* uart_ = &Serial2;   // NULL if port_ isn't a UART this class should start
+    int8_t rx_pin_ = 16;                // Serial2's default pins
+    int8_t tx_pin_ = 17;
+    String line_buffer_ = "";
+    QueueHandle_t command_queue_ = NULL;
+    AtCommand* in_flight_ = NULL;  // the command that's been sent and is waiting for its reply
+    uint32_t in_flight_sent_ms_ = 0;
+    TaskHandle_t engine_task_ = NULL;
+    rcv_handler_t rcv_handler_ = NULL;
+    void* rcv_context_ = NULL;
     int32_t baud_rate_ = 115200;
-    int8_t output_power_ = 15;
-    int8_t spread_factor_ = 12;
-    int8_t bandwidth_ = 7;
-    int8_t coding_rate_ = 1;
-    int8_t preamble_ = 4;
+    // The radio profile to use, set to the defaults in config.h.
+    // Change any of it with the appropriate "set" method, then apply_settings().
+    RadioProfile profile_;
+    RadioProfile applied_;   // the profile the LoRa was last verified to be using
+    bool profile_verified_ = false;
+    SemaphoreHandle_t profile_mutex_ = NULL;
+
+    /**
+     * @brief Send the three commands that make up a radio profile.
+     */
+
+    bool write_radio_profile(const RadioProfile& profile) {
+        String parameters = "AT+PARAMETER=" + String(profile.spread_factor) + "," + String(profile.bandwidth)
+                            + "," + String(profile.coding_rate) + "," + String(profile.preamble);
+        return send_command(parameters) == AT_OK
+               && send_command("AT+BAND=" + String(profile.frequency)) == AT_OK
+               && send_command("AT+CRFOP=" + String(profile.output_power)) == AT_OK;
+    }
+
+    /**
+     * @brief One pass of the command engine. See poll().
+     */
+
+    void poll_once() {
+        while (port_->available()) {
+            char c = port_->read();
+            if (c == '\n') {
+                process_line(line_buffer_);
+                line_buffer_ = "";
+            }
+            else if (c != '\r' && line_buffer_.length() < AT_MAX_LINE_LENGTH) {
+                line_buffer_ += c;
+            }
+        }
+        if (in_flight_ != NULL && millis() - in_flight_sent_ms_ > in_flight_->timeout_ms) {
+            complete_command(AT_TIMEOUT);
+        }
+        if (in_flight_ == NULL && command_queue_ != NULL
+            && xQueueReceive(command_queue_, &in_flight_, 0) == pdPASS) {
+            Serial.println("Sending: " + in_flight_->command);
+            port_->print(in_flight_->command + "\r\n");
+            in_flight_sent_ms_ = millis();
+        }
+    }
+
+    /**
+     * @brief Dispatch one complete line from the LoRa: "+RCV=" lines go to the receive
+     * handler, and the reply to the command in flight completes it.
+     */
+
+    void process_line(const String& line) {
+        if (line.length() == 0) {
+            return;
+        }
+        if (line.startsWith("+RCV=")) {
+            if (rcv_handler_ != NULL) {
+                rcv_handler_(rcv_context_, line);
+            }
+            else {
+                Serial.println("No receive handler for: " + line);
+            }
+            return;
+        }
+        if (in_flight_ != NULL) {
+            if (line == "+OK") {
+                in_flight_->reply = line;
+                complete_command(AT_OK);
+                return;
+            }
+            if (line.startsWith("+ERR=")) {
+                in_flight_->reply = line;
+                in_flight_->error_code = line.substring(5).toInt();
+                complete_command(AT_ERROR);
+                return;
+            }
+            // The reply to a query like "AT+ADDRESS?" is "+ADDRESS=<value>"
+            const String& command = in_flight_->command;
+            if (command.endsWith("?") && command.startsWith("AT+")
+                && line.startsWith(command.substring(2, command.length() - 1) + "=")) {
+                in_flight_->reply = line;
+                complete_command(AT_OK);
+                return;
+            }
+        }
+        Serial.println("Unsolicited: " + line); // "+READY" after a reset, for example
+    }
+
+    /**
+     * @brief Finish the command in flight, and wake up whoever is waiting for it.
+     */
+
+    void complete_command(at_result_t result) {
+        AtCommand* at_command = in_flight_;
+        in_flight_ = NULL;
+        if (result == AT_TIMEOUT) {
+            Serial.println("Timeout waiting for reply to: " + at_command->command);
+        }
+        else {
+            Serial.println(at_command->reply);
+        }
+        at_command->result = result;
+        if (at_command->delete_when_done) {
+            delete at_command;
+        }
+        else if (at_command->done != NULL) {
+            xSemaphoreGive(at_command->done);
+        }
+    }
 
 }; // class ReyaxLoRa
 
@@ -0,0 +1,392 @@
+#ifndef _RUNTIME_CONFIG_H_
+#define _RUNTIME_CONFIG_H_
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <stddef.h>
+#include <vector>
+#include "config.h"
+
+#define RUNTIME_CONFIG_VERSION 1
+#define RUNTIME_CONFIG_NAMESPACE "settings"
+#define SERIAL_COMMAND_MAX_LENGTH 64
+#define SETTINGS_QUEUE_LENGTH 4     // settings post()ed (over HTTP) and waiting for loop()
+
+/**
+ * @brief The settings that can be changed without a rebuild. The defaults are the values that
+ * used to be compiled in. Everything that uses them reads this struct, not NVS.
+ */
+
+struct RuntimeSettings {
+    // Intervals of the jobs in loop() - see main.cpp
+    uint32_t wifi_check_ms = 30000;
+    uint32_t bme280_ms = 600000;
+    uint32_t display_ms = 3000;
+    uint32_t email_check_ms = 45000;
+    uint32_t screensaver_ms = 90000;
+    uint32_t link_report_ms = 900000;
+    // The alarm is sounded (and alarm texts after the first are sent) only in the daytime
+    uint8_t day_start_hour = 8;
+    uint8_t day_end_hour = 22;
+    uint32_t clear_dwell_ms = ALARM_CLEAR_DWELL_MS;
+    uint32_t influx_hb_min = INFLUX_HEARTBEAT_MINUTES;
+    // Thresholds of the Home (BME280) alarm rules
+    float low_temp = LOW_TEMP_ALARM_VALUE;
+    float high_temp = HIGH_TEMP_ALARM_VALUE;
+    float low_pressure = LOW_PRESSURE_ALARM_VALUE;
+    float high_pressure = HIGH_PRESSURE_ALARM_VALUE;
+    float low_humidity = LOW_HUMIDITY_ALARM_VALUE;
+    float high_humidity = HIGH_HUMIDITY_ALARM_VALUE;
+};
+
+enum setting_type_t : uint8_t {SETTING_U32, SETTING_U8, SETTING_FLOAT};
+
+/**
+ * @brief How a member of RuntimeSettings is named (in NVS, and in commands), typed and limited.
+ * NVS keys can be at most 15 characters long.
+ */
+
+struct SettingInfo {
+    const char* name;
+    setting_type_t type;
+    size_t offset;
+    float min;
+    float max;
+};
+
+#define SETTING(member, type, min, max) {#member, type, offsetof(RuntimeSettings, member), min, max}
+
+static const SettingInfo setting_table[] = {
+    SETTING(wifi_check_ms, SETTING_U32, 5000, 3600000),
+    SETTING(bme280_ms, SETTING_U32, 10000, 86400000),
+    SETTING(display_ms, SETTING_U32, 500, 60000),
+    SETTING(email_check_ms, SETTING_U32, 5000, 3600000),
+    SETTING(screensaver_ms, SETTING_U32, 5000, 3600000),
+    SETTING(link_report_ms, SETTING_U32, 60000, 86400000),
+    SETTING(day_start_hour, SETTING_U8, 0, 23),
+    SETTING(day_end_hour, SETTING_U8, 1, 24),
+    SETTING(clear_dwell_ms, SETTING_U32, 0, 86400000),
+    SETTING(influx_hb_min, SETTING_U32, 1, 1440),
+    SETTING(low_temp, SETTING_FLOAT, -100, 200),
+    SETTING(high_temp, SETTING_FLOAT, -100, 200),
+    SETTING(low_pressure, SETTING_FLOAT, 20, 40),
+    SETTING(high_pressure, SETTING_FLOAT, 20, 40),
+    SETTING(low_humidity, SETTING_FLOAT, 0, 100),
+    SETTING(high_humidity, SETTING_FLOAT, 0, 100),
+};
+
+typedef void (*settings_callback_t)(void* context, const RuntimeSettings& settings);
+
+// Called when post() has queued a setting for apply_posted(). See set_post_waker().
+typedef void (*settings_waker_t)(void* context);
+
+/**
+ * @brief RuntimeConfig keeps the RuntimeSettings in NVS, one key per setting, so settings
+ * added later just start with their defaults. A different RUNTIME_CONFIG_VERSION (for a change
+ * in what a setting means) throws away what's stored.
+ *
+ * load() reads NVS once, at boot. After that, set() changes a setting in the struct and in NVS,
+ * and calls every subscriber with the new settings, so intervals and thresholds change at once.
+ * set(), poll_serial() and apply_posted() are called only from loop()'s task, and so are the
+ * subscribers. Other tasks (the HTTP server - see web_api.h) post() a setting instead: it's
+ * queued, loop() is woken up, and apply_posted() sets it.
+ *
+ * A value must be all number, within its setting's range, and mustn't conflict with the other
+ * settings: day_start_hour is before day_end_hour, and each low alarm threshold is below its high one.
+ *
+ * Serial commands, ended by a newline:
+ *   settings             - print every setting
+ *   set <name> <value>   - change a setting
+ *   defaults             - put every setting back to its default
+ */
+
+class RuntimeConfig {
+
+private:
+    RuntimeSettings settings_;
+    struct Subscriber {
+        settings_callback_t callback;
+        void* context;
+    };
+    std::vector<Subscriber> subscribers_;
+    String line_;
+    struct PostedSetting {
+        uint8_t index;      // in setting_table
+        double value;       // from parse()
+    };
+    QueueHandle_t posted_queue_;
+    settings_waker_t post_waker_ = NULL;
+    void* post_waker_context_ = NULL;
+
+    static void* member(RuntimeSettings* settings, const SettingInfo& info) {
+        return reinterpret_cast<uint8_t*>(settings) + info.offset;
+    }
+
+    String value_string(const SettingInfo& info) {
+        switch (info.type) {
+            case SETTING_U32: return String(*static_cast<uint32_t*>(member(&settings_, info)));
+            case SETTING_U8: return String(*static_cast<uint8_t*>(member(&settings_, info)));
+            case SETTING_FLOAT: return String(*static_cast<float*>(member(&settings_, info)), 2);
+        }
+        return "";
+    }
+
+    /**
+     * @brief What's wrong with settings as a whole, or NULL if nothing is.
+     */
+
+    static const char* conflict(const RuntimeSettings& settings) {
+        if (settings.day_start_hour >= settings.day_end_hour) {
+            return "day_start_hour must be before day_end_hour";
+        }
+        if (settings.low_temp >= settings.high_temp) {
+            return "low_temp must be below high_temp";
+        }
+        if (settings.low_pressure >= settings.high_pressure) {
+            return "low_pressure must be below high_pressure";
+        }
+        if (settings.low_humidity >= settings.high_humidity) {
+            return "low_humidity must be below high_humidity";
+        }
+        return NULL;
+    }
+
+    void notify() {
+        for (Subscriber& subscriber : subscribers_) {
+            subscriber.callback(subscriber.context, settings_);
+        }
+    }
+
+    void run_command(String command) {
+        command.trim();
+        if (command == "settings") {
+            print_settings();
+        }
+        else if (command.startsWith("set ")) {
+            int space = command.indexOf(' ', 4);
+            if (space < 0 || !set(command.substring(4, space), command.substring(space + 1))) {
+                Serial.println("Usage: set <name> <value> - \"settings\" lists the names");
+            }
+        }
+        else if (command == "defaults") {
+            reset_to_defaults();
+        }
+        else if (command.length() > 0) {
+            Serial.println("Unknown command: " + command);
+        }
+    }
+
+public:
+
+    RuntimeConfig() {
+        posted_queue_ = xQueueCreate(SETTINGS_QUEUE_LENGTH, sizeof(PostedSetting));
+    }
+
+    /**
+     * @brief Read the settings from NVS. Call it once, at the start of setup(), before
+     * anything uses the settings. If what's stored conflicts (see conflict()), every
+     * setting goes back to its default.
+     */
+
+    void load() {
+        Preferences preferences;
+        preferences.begin(RUNTIME_CONFIG_NAMESPACE, false);
+        if (preferences.getUInt("version", 0) != RUNTIME_CONFIG_VERSION) {
+            preferences.clear();
+            preferences.putUInt("version", RUNTIME_CONFIG_VERSION);
+        }
+        for (const SettingInfo& info : setting_table) {
+            if (!preferences.isKey(info.name)) {
+                continue;
+            }
+            void* setting = member(&settings_, info);
+            switch (info.type) {
+                case SETTING_U32: *static_cast<uint32_t*>(setting) = preferences.getUInt(info.name); break;
+                case SETTING_U8: *static_cast<uint8_t*>(setting) = preferences.getUChar(info.name); break;
+                case SETTING_FLOAT: *static_cast<float*>(setting) = preferences.getFloat(info.name); break;
+            }
+            Serial.println("Setting " + String(info.name) + " = " + value_string(info));
+        }
+        preferences.end();
+        const char* problem = conflict(settings_);
+        if (problem != NULL) {
+            Serial.println("Saved settings ignored: " + String(problem));
+            reset_to_defaults();
+        }
+    }
+
+    const RuntimeSettings& settings() {
+        return settings_;
+    }
+
+    /**
+     * @brief Call callback (with context) every time a setting changes.
+     */
+
+    void subscribe(settings_callback_t callback, void* context = NULL) {
+        subscribers_.push_back({callback, context});
+    }
+
+    /**
+     * @brief Call waker (with context) every time post() queues a setting, so the
+     * task that calls apply_posted() can wake up and set it.
+     */
+
+    void set_post_waker(settings_waker_t waker, void* context) {
+        post_waker_ = waker;
+        post_waker_context_ = context;
+    }
+
+    /**
+     * @brief Find the setting called name, and parse value_str for it. All of value_str
+     * must be a number (an integer, unless it's a float setting), within the setting's range.
+     * It uses only setting_table, so any task can call it.
+     *
+     * @param value The number, for apply() or post()
+     * @param error Why it's NULL
+     * @return The setting, or NULL if there's no such setting, or value_str can't be used
+     */
+
+    static const SettingInfo* parse(const String& name, const String& value_str, double* value, String* error) {
+        for (const SettingInfo& info : setting_table) {
+            if (name != info.name) {
+                continue;
+            }
+            const char* text = value_str.c_str();
+            char* end;
+            if (info.type == SETTING_FLOAT) {
+                *value = strtof(text, &end);
+            }
+            else {
+                *value = strtol(text, &end, 10);
+            }
+            if (end == text || *end != '\0' || *value < info.min || *value > info.max) {
+                *error = name + " must be " + (info.type == SETTING_FLOAT ? "a number" : "a whole number")
+                         + " from " + String(info.min, 0) + " to " + String(info.max, 0);
+                return NULL;
+            }
+            return &info;
+        }
+        *error = "No setting called " + name;
+        return NULL;
+    }
+
+    /**
+     * @brief Change a setting to a value from parse(), save it, and tell the subscribers.
+     *
+     * @return false if the new value conflicts with the other settings
+     */
+
+    bool apply(const SettingInfo& info, double value) {
+        RuntimeSettings changed = settings_;
+        void* setting = member(&changed, info);
+        switch (info.type) {
+            case SETTING_U32: *static_cast<uint32_t*>(setting) = (uint32_t)value; break;
+            case SETTING_U8: *static_cast<uint8_t*>(setting) = (uint8_t)value; break;
+            case SETTING_FLOAT: *static_cast<float*>(setting) = (float)value; break;
+        }
+        const char* problem = conflict(changed);
+        if (problem != NULL) {
+            Serial.println(String(info.name) + " not changed: " + problem);
+            return false;
+        }
+        settings_ = changed;
+        Preferences preferences;
+        preferences.begin(RUNTIME_CONFIG_NAMESPACE, false);
+        switch (info.type) {
+            case SETTING_U32: preferences.putUInt(info.name, *static_cast<uint32_t*>(setting)); break;
+            case SETTING_U8: preferences.putUChar(info.name, *static_cast<uint8_t*>(setting)); break;
+            case SETTING_FLOAT: preferences.putFloat(info.name, *static_cast<float*>(setting)); break;
+        }
+        preferences.end();
+        Serial.println("Setting " + String(info.name) + " = " + value_string(info));
+        notify();
+        return true;
+    }
+
+    /**
+     * @brief Change a setting, save it, and tell the subscribers.
+     *
+     * @return false if there's no such setting, or the value can't be used - see parse() and apply()
+     */
+
+    bool set(const String& name, const String& value_str) {
+        double value;
+        String error;
+        const SettingInfo* info = parse(name, value_str, &value, &error);
+        if (info == NULL) {
+            Serial.println(error);
+            return false;
+        }
+        return apply(*info, value);
+    }
+
+    /**
+     * @brief From any task: queue a setting, with a value from parse(), for apply_posted().
+     *
+     * @return false if SETTINGS_QUEUE_LENGTH settings are already waiting
+     */
+
+    bool post(const SettingInfo& info, double value) {
+        PostedSetting posted{(uint8_t)(&info - setting_table), value};
+        if (xQueueSend(posted_queue_, &posted, 0) != pdPASS) {
+            return false;
+        }
+        if (post_waker_ != NULL) {
+            post_waker_(post_waker_context_);
+        }
+        return true;
+    }
+
+    /**
+     * @brief apply() every setting that's been post()ed. Call it from loop().
+     */
+
+    void apply_posted() {
+        PostedSetting posted;
+        while (xQueueReceive(posted_queue_, &posted, 0) == pdPASS) {
+            apply(setting_table[posted.index], posted.value);
+        }
+    }
+
+    /**
+     * @brief Put every setting back to its default, in NVS too, and tell the subscribers.
+     */
+
+    void reset_to_defaults() {
+        Preferences preferences;
+        preferences.begin(RUNTIME_CONFIG_NAMESPACE, false);
+        preferences.clear();
+        preferences.putUInt("version", RUNTIME_CONFIG_VERSION);
+        preferences.end();
+        settings_ = RuntimeSettings();
+        Serial.println("Settings are back to their defaults");
+        notify();
+    }
+
+    void print_settings() {
+        for (const SettingInfo& info : setting_table) {
+            Serial.println(String(info.name) + " = " + value_string(info));
+        }
+    }
+
+    /**
+     * @brief Read whatever has come in on Serial, and run each complete command.
+     */
+
+    void poll_serial() {
+        while (Serial.available() > 0) {
+            char c = Serial.read();
+            if (c == '\n' || c == '\r') {
+                run_command(line_);
+                line_ = "";
+            }
+            else if (line_.length() < SERIAL_COMMAND_MAX_LENGTH) {
+                line_ += c;
+            }
+        }
+    }
+
+}; // class RuntimeConfig
+
+#endif // _RUNTIME_CONFIG_H_
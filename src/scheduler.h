@@ -0,0 +1,148 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <Arduino.h>
+#include <vector>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+typedef void (*job_callback_t)(void* context);
+
+struct ScheduledJob {
+    const char* name;
+    uint32_t interval_ms;
+    uint32_t next_run_ms;
+    job_callback_t callback;
+    void* context;
+};
+
+/**
+ * @brief Scheduler runs periodic jobs from a single task (the Arduino loopTask), and blocks
+ * that task between jobs instead of spinning on a set of elapsedMillis timers. Each job
+ * registers its interval once, and runs only when it's due. While it's blocked, the
+ * task uses no CPU, so the idle task (and automatic light sleep, if it's enabled) can run.
+ *
+ * An ISR (or another task) can wake the scheduler early with wake_from_isr() / wake(),
+ * for things that shouldn't wait for the next job, like the tilt switch.
+ */
+
+class Scheduler {
+
+private:
+    std::vector<ScheduledJob> jobs_;
+    TaskHandle_t task_ = NULL;
+
+    static bool is_due(uint32_t now, uint32_t when) {
+        return (int32_t)(now - when) >= 0; // works across millis() rollover
+    }
+
+public:
+
+    /**
+     * @brief Must be called from the task that will call run_due_jobs() and
+     * wait_for_next_job() - setup() and loop() both run in the loopTask.
+     */
+
+    void attach_to_current_task() {
+        task_ = xTaskGetCurrentTaskHandle();
+    }
+
+    /**
+     * @brief Register a periodic job.
+     *
+     * @param name - Shown in the Serial Monitor when the job is added.
+     * @param interval_ms - How often to run the job.
+     * @param callback - The function to run.
+     * @param context - Passed to callback.
+     * @param run_now - true to run the job the first time run_due_jobs() is called,
+     * instead of waiting for the first interval to pass.
+     * @return the job's id, for set_interval()
+     */
+
+    uint8_t add_job(const char* name, uint32_t interval_ms, job_callback_t callback,
+                    void* context = NULL, bool run_now = false) {
+        ScheduledJob job;
+        job.name = name;
+        job.interval_ms = interval_ms;
+        job.next_run_ms = run_now ? millis() : millis() + interval_ms;
+        job.callback = callback;
+        job.context = context;
+        jobs_.push_back(job);
+        Serial.println("Scheduled job " + String(name) + " every " + String(interval_ms) + " ms");
+        return jobs_.size() - 1;
+    }
+
+    /**
+     * @brief Change the interval of a job. The new interval starts now.
+     * If it's the same as the old one, nothing changes.
+     */
+
+    void set_interval(uint8_t job_id, uint32_t interval_ms) {
+        if (job_id < jobs_.size() && jobs_[job_id].interval_ms != interval_ms) {
+            jobs_[job_id].interval_ms = interval_ms;
+            jobs_[job_id].next_run_ms = millis() + interval_ms;
+            wake();
+        }
+    }
+
+    /**
+     * @brief Run every job that's due. The next run of a job is scheduled one interval
+     * after it finishes, just like resetting an elapsedMillis timer after the job.
+     */
+
+    void run_due_jobs() {
+        for (ScheduledJob& job : jobs_) {
+            if (is_due(millis(), job.next_run_ms)) {
+                job.callback(job.context);
+                job.next_run_ms = millis() + job.interval_ms;
+            }
+        }
+    }
+
+    /**
+     * @brief Block the calling task until the next job is due, or until wake() or
+     * wake_from_isr() is called, whichever comes first.
+     */
+
+    void wait_for_next_job() {
+        uint32_t now = millis();
+        uint32_t wait_ms = portMAX_DELAY;
+        for (ScheduledJob& job : jobs_) {
+            if (is_due(now, job.next_run_ms)) {
+                return;
+            }
+            uint32_t ms_until_due = job.next_run_ms - now;
+            if (ms_until_due < wait_ms) {
+                wait_ms = ms_until_due;
+            }
+        }
+        ulTaskNotifyTake(pdTRUE, wait_ms == portMAX_DELAY ? portMAX_DELAY : wait_ms / portTICK_PERIOD_MS + 1);
+    }
+
+    /**
+     * @brief Wake up the scheduler's task from another task.
+     */
+
+    void wake() {
+        if (task_ != NULL) {
+            xTaskNotifyGive(task_);
+        }
+    }
+
+    /**
+     * @brief Wake up the scheduler's task from an interrupt.
+     */
+
+    void IRAM_ATTR wake_from_isr() {
+        if (task_ != NULL) {
+            BaseType_t higher_priority_task_woken = pdFALSE;
+            vTaskNotifyGiveFromISR(task_, &higher_priority_task_woken);
+            if (higher_priority_task_woken) {
+                portYIELD_FROM_ISR();
+            }
+        }
+    }
+
+}; // class Scheduler
+
+#endif // _SCHEDULER_H_
@@ -0,0 +1,200 @@
+#ifndef _SCHEMA_REGISTRY_H_
+#define _SCHEMA_REGISTRY_H_
+
+#include <Arduino.h>
+#include <map>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <mbedtls/base64.h>
+#include "packet_t.h"
+#include "metrics.h"
+
+#define MAX_SCHEMA_READINGS 16      // reading ids are 0 - 15
+#define BINARY_RECORD_BYTES 7       // id (1), alarm_code (2), value (4)
+#define BINARY_HEADER_BYTES 3       // schema version (1), sequence (2)
+#define MAX_BINARY_BYTES 180        // 240 characters of base64
+
+/**
+ * @brief What a transmitter told us, once, about one of its readings, so it doesn't
+ * have to send the name (or the alarm email settings) with every value.
+ */
+
+struct ReadingSchema {
+    bool defined = false;
+    String data_name = "";            // includes the unit, if there is one: "Battery voltage (V)"
+    uint8_t decimals = 0;             // the value is sent as an integer: value * 10^decimals
+    uint16_t alarm_email_interval = 1;
+    uint16_t max_alarm_emails_to_send = 0;
+};
+
+struct TransmitterSchema {
+    uint8_t version = 0;
+    String data_source = "";
+    ReadingSchema readings[MAX_SCHEMA_READINGS];
+};
+
+/**
+ * @brief SchemaRegistry holds the schema of every transmitter that uses the compact
+ * binary payload format, keyed by transmitter_address. PacketList picks the format of
+ * every LoRa packet from the first character of its <Data>:
+ *
+ * '!' registers (or adds to) a schema, in text:
+ *    !version|data_source|id%name%unit%decimals%alarm_email_interval%max_alarm_emails|id%name%...
+ *    A schema that doesn't fit in one packet can be sent in several, with the same version.
+ *    A new version replaces the old schema completely.
+ * '$' is followed by base64 of packed little-endian binary:
+ *    version (uint8), sequence (uint16), then for each reading:
+ *    id (uint8), alarm_code (uint16), value * 10^decimals (int32)
+ *    That's 7 bytes (about 10 characters) per reading, instead of a name and a value in text.
+ * Anything else is the text format - see PacketList::parse_data().
+ *
+ * Values from a transmitter whose schema we don't have (yet) are dropped, so transmitters
+ * should re-send their schema every so often, and whenever they boot.
+ */
+
+class SchemaRegistry {
+
+private:
+    std::map<uint16_t, TransmitterSchema> schemas_;
+    SemaphoreHandle_t mutex_ = NULL;
+    uint32_t unknown_schema_packets_ = 0;
+
+    static uint16_t read_uint16(const uint8_t* bytes) {
+        return bytes[0] | (bytes[1] << 8);
+    }
+
+    static int32_t read_int32(const uint8_t* bytes) {
+        return (int32_t)((uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24));
+    }
+
+public:
+
+    SchemaRegistry() {
+        mutex_ = xSemaphoreCreateMutex();
+    }
+
+    /**
+     * @brief Register a schema from a '!' packet.
+     *
+     * @return false if it couldn't be parsed
+     */
+
+    bool register_schema(uint16_t address, const String& data) {
+        int field_start = 1; // just past the '!'
+        String version_str = next_field(data, &field_start, '|');
+        String data_source = next_field(data, &field_start, '|');
+        if (version_str.length() == 0 || data_source.length() == 0) {
+            Serial.println("Error reading schema header from LoRa packet.");
+            return false;
+        }
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        TransmitterSchema& schema = schemas_[address];
+        uint8_t version = version_str.toInt();
+        if (schema.version != version || schema.data_source != data_source) {
+            schema = TransmitterSchema();
+            schema.version = version;
+            schema.data_source = data_source;
+        }
+        bool success = true;
+        while (field_start < (int)data.length()) {
+            String reading = next_field(data, &field_start, '|');
+            int reading_start = 0;
+            String id_str = next_field(reading, &reading_start, '%');
+            uint8_t id = id_str.toInt();
+            if (id_str.length() == 0 || id >= MAX_SCHEMA_READINGS) {
+                Serial.println("Invalid reading id in schema: " + reading);
+                success = false;
+                continue;
+            }
+            ReadingSchema& reading_schema = schema.readings[id];
+            reading_schema.data_name = next_field(reading, &reading_start, '%');
+            String unit = next_field(reading, &reading_start, '%');
+            if (unit.length() > 0) {
+                reading_schema.data_name += " (" + unit + ")";
+            }
+            reading_schema.decimals = next_field(reading, &reading_start, '%').toInt();
+            reading_schema.alarm_email_interval = next_field(reading, &reading_start, '%').toInt();
+            reading_schema.max_alarm_emails_to_send = next_field(reading, &reading_start, '%').toInt();
+            reading_schema.defined = reading_schema.data_name.length() > 0;
+            Serial.println("Schema " + String(address) + " v" + String(version) + " reading " + String(id)
+                           + ": " + reading_schema.data_name);
+        }
+        xSemaphoreGive(mutex_);
+        return success;
+    }
+
+    /**
+     * @brief Decode a '$' packet into one Packet_t per reading. A packet that can't be
+     * decoded is counted once: in unknown_schema_packets() if its schema isn't registered,
+     * otherwise in metrics.parse_errors. Readings past max_packets are dropped, and the
+     * packet is counted in metrics.truncated_frames.
+     *
+     * @param frame Gets the data_source and sequence
+     * @param packets Gets one reading each
+     * @param max_packets Room in packets
+     * @return the number of readings, or 0 if the packet couldn't be decoded
+     */
+
+    uint8_t decode(uint16_t address, const String& data, Packet_t* frame, Packet_t* packets, uint8_t max_packets) {
+        uint8_t bytes[MAX_BINARY_BYTES];
+        size_t length = 0;
+        if (mbedtls_base64_decode(bytes, sizeof(bytes), &length, (const unsigned char*)data.c_str() + 1, data.length() - 1) != 0
+            || length < BINARY_HEADER_BYTES || (length - BINARY_HEADER_BYTES) % BINARY_RECORD_BYTES != 0) {
+            Serial.println("Error decoding binary LoRa packet.");
+            metrics.parse_errors++;
+            return 0;
+        }
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        auto it = schemas_.find(address);
+        if (it == schemas_.end() || it->second.version != bytes[0]) {
+            xSemaphoreGive(mutex_);
+            unknown_schema_packets_++;
+            Serial.println("No schema v" + String(bytes[0]) + " for " + String(address) + " yet - packet dropped.");
+            return 0;
+        }
+        TransmitterSchema& schema = it->second;
+        frame->data_source = schema.data_source;
+        frame->sequence = read_uint16(&bytes[1]);
+        uint8_t reading_count = 0;
+        for (size_t offset = BINARY_HEADER_BYTES; offset < length; offset += BINARY_RECORD_BYTES) {
+            uint8_t id = bytes[offset];
+            if (id >= MAX_SCHEMA_READINGS || !schema.readings[id].defined) {
+                Serial.println("Reading id " + String(id) + " is not in the schema - skipped.");
+                continue;
+            }
+            if (reading_count == max_packets) {
+                Serial.println("Too many readings in one LoRa packet, only " + String(reading_count) + " used.");
+                metrics.truncated_frames++;
+                break;
+            }
+            ReadingSchema& reading_schema = schema.readings[id];
+            Packet_t& packet = packets[reading_count++];
+            packet.data_name = reading_schema.data_name;
+            packet.alarm_code = read_uint16(&bytes[offset + 1]);
+            double value = read_int32(&bytes[offset + 3]);
+            for (uint8_t i = 0; i < reading_schema.decimals; i++) {
+                value /= 10.0;
+            }
+            packet.data_value = String(value, (unsigned int)reading_schema.decimals);
+            packet.alarm_email_interval = reading_schema.alarm_email_interval;
+            packet.max_alarm_emails_to_send = reading_schema.max_alarm_emails_to_send;
+            Serial.println(packet.data_name + " = " + packet.data_value + ", alarm " + String(packet.alarm_code));
+        }
+        xSemaphoreGive(mutex_);
+        if (reading_count == 0) {
+            metrics.parse_errors++;
+        }
+        return reading_count;
+    }
+
+    /**
+     * @brief How many binary packets were dropped because their schema wasn't registered.
+     */
+
+    uint32_t unknown_schema_packets() {
+        return unknown_schema_packets_;
+    }
+
+}; // class SchemaRegistry
+
+#endif // _SCHEMA_REGISTRY_H_
@@ -0,0 +1,41 @@
+#ifndef _SINK_H_
+#define _SINK_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "packet_t.h"
+#include "aggregator.h"
+
+/**
+ * @brief Sink is somewhere the datapoints from the influx queue are sent: InfluxDB (see influx_sink.h),
+ * an MQTT broker (see mqtt_sink.h), or both - INFLUX_SINK and MQTT_SINK in config.h. Only the task
+ * that reads the influx queue uses them. Each time it wakes up, it calls begin_batch(), then
+ * write() and write_aggregate() for what it read from the queue, then end_batch().
+ */
+
+class Sink {
+
+public:
+    virtual ~Sink() {}
+
+    /**
+     * @brief Called once, by Internet::start_tasks().
+     */
+
+    virtual void begin() {}
+
+    virtual void begin_batch() {}
+
+    /**
+     * @return false if the value was lost
+     */
+
+    virtual bool write(const Packet_t& packet) = 0;
+
+    virtual bool write_aggregate(const AggregateWindow& window) = 0;
+
+    virtual void end_batch() {}
+
+}; // class Sink
+
+#endif // _SINK_H_
@@ -0,0 +1,261 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <list>
+#include <vector>
+#include "config.h"
+#include "packet_t.h"
+
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_NAMESPACE "packet_list"
+#define SNAPSHOT_KEY "snapshot"
+#define SNAPSHOT_HEADER_SIZE 7      // version (1), datapoint count (2), CRC-32 of the records (4)
+
+/**
+ * @brief PacketSnapshot saves the datapoints in PacketList to NVS, and reads them back at boot.
+ *
+ * The snapshot is one blob: a header, then one record per datapoint, with what it takes to pick
+ * up where it left off - its latest value, its alarm state and alarm bookkeeping (first_alarm_time,
+ * alarm_emails_sent, alarm_has_sounded), which of its alarm rules are broken (so a value inside a
+ * rule's hysteresis doesn't clear or raise the alarm again), and its learned interval. Strings are length-prefixed, and
+ * numbers are little-endian, so a record is about 60 bytes plus the strings. A snapshot with a
+ * different SNAPSHOT_VERSION, or a bad CRC, is ignored.
+ *
+ * NVS spreads its writes over its pages, but every write still wears the flash, so prepare_if_due()
+ * writes only when something has changed: within SNAPSHOT_CHECK_SECONDS if it's an alarm, but
+ * at most every SNAPSHOT_VALUES_MINUTES if it's only values. Values are what the next packet
+ * replaces anyway.
+ */
+
+class PacketSnapshot {
+
+public:
+
+    /**
+     * @brief Serialize the datapoints, if they've changed enough since the last save.
+     * Called often, with PacketList locked - it does nothing until SNAPSHOT_CHECK_SECONDS
+     * have passed. Writing flash takes milliseconds, so it's left to save_prepared(),
+     * after PacketList is unlocked.
+     *
+     * @return true if there's a snapshot for save_prepared() to save
+     */
+
+    bool prepare_if_due(const std::list<Packet_t>& packets, uint32_t now_ms) {
+        if (now_ms - last_check_ms_ < SNAPSHOT_CHECK_SECONDS * 1000UL) {
+            return false;
+        }
+        last_check_ms_ = now_ms;
+        serialize(packets, &blob_, &blob_alarm_crc_);
+        blob_crc_ = crc32(0, blob_.data() + SNAPSHOT_HEADER_SIZE, blob_.size() - SNAPSHOT_HEADER_SIZE);
+        bool alarms_changed = blob_alarm_crc_ != saved_alarm_crc_;
+        bool values_due = blob_crc_ != saved_crc_ && now_ms - last_save_ms_ >= SNAPSHOT_VALUES_MINUTES * 60000UL;
+        return alarms_changed || values_due;
+    }
+
+    /**
+     * @brief Write what prepare_if_due() serialized to NVS. Call it from the same task,
+     * without the lock.
+     */
+
+    void save_prepared(uint32_t now_ms) {
+        Preferences preferences;
+        preferences.begin(SNAPSHOT_NAMESPACE, false);
+        size_t written = preferences.putBytes(SNAPSHOT_KEY, blob_.data(), blob_.size());
+        preferences.end();
+        if (written != blob_.size()) {
+            Serial.println("Snapshot of PacketList could not be saved");
+            return;
+        }
+        saved_crc_ = blob_crc_;
+        saved_alarm_crc_ = blob_alarm_crc_;
+        last_save_ms_ = now_ms;
+        Serial.println("Snapshot of PacketList saved: " + String(blob_.size()) + " bytes");
+    }
+
+    /**
+     * @brief Read the saved datapoints. Only what's in a record is set - everything else
+     * in the packets has its default value.
+     *
+     * @return false if there's no snapshot, or it can't be used
+     */
+
+    bool load(std::vector<Packet_t>* packets) {
+        Preferences preferences;
+        preferences.begin(SNAPSHOT_NAMESPACE, true);
+        size_t length = preferences.getBytesLength(SNAPSHOT_KEY);
+        std::vector<uint8_t> blob(length);
+        if (length > 0) {
+            preferences.getBytes(SNAPSHOT_KEY, blob.data(), length);
+        }
+        preferences.end();
+        if (length < SNAPSHOT_HEADER_SIZE) {
+            Serial.println("No snapshot of PacketList");
+            return false;
+        }
+        Reader reader{blob.data(), blob.data() + length};
+        uint8_t version = reader.get_u8();
+        uint16_t count = reader.get_u16();
+        uint32_t crc = reader.get_u32();
+        if (version != SNAPSHOT_VERSION || crc != crc32(0, reader.next, reader.end - reader.next)) {
+            Serial.println("Snapshot of PacketList ignored: version " + String(version) + ", or bad CRC");
+            return false;
+        }
+        for (uint16_t i = 0; i < count && reader.ok; i++) {
+            Packet_t packet;
+            packet.unique_id = reader.get_string();
+            packet.data_source = reader.get_string();
+            packet.data_name = reader.get_string();
+            packet.data_value = reader.get_string();
+            packet.transmitter_address = reader.get_u16();
+            packet.alarm_code = (int16_t)reader.get_u16();
+            packet.alarm_has_sounded = reader.get_u8() != 0;
+            packet.first_alarm_time = (time_t)reader.get_u32();
+            packet.alarm_email_interval = reader.get_u16();
+            packet.alarm_emails_sent = reader.get_u16();
+            packet.max_alarm_emails_to_send = reader.get_u16();
+            packet.RSSI = (int8_t)reader.get_u8();
+            packet.SNR = (int8_t)reader.get_u8();
+            packet.sequence = (int32_t)reader.get_u32();
+            alarm_state_t state = (alarm_state_t)reader.get_u8();
+            int16_t fsm_code = (int16_t)reader.get_u16();
+            packet.alarm_fsm.restore(state, fsm_code, millis());
+            packet.alarm_rules_broken = reader.get_u8();
+            packet.expected_interval_ms = reader.get_u32();
+            if (reader.ok) {
+                packets->push_back(packet);
+            }
+        }
+        // What was loaded is what's saved, so there's nothing to save until something changes
+        std::vector<uint8_t> loaded;
+        serialize(*packets, &loaded, &saved_alarm_crc_);
+        saved_crc_ = crc;
+        last_save_ms_ = millis();
+        return reader.ok;
+    }
+
+private:
+    uint32_t last_check_ms_ = 0;
+    uint32_t last_save_ms_ = 0;
+    uint32_t saved_crc_ = 0;
+    uint32_t saved_alarm_crc_ = 0;
+    std::vector<uint8_t> blob_;     // from prepare_if_due(), for save_prepared()
+    uint32_t blob_crc_ = 0;
+    uint32_t blob_alarm_crc_ = 0;
+
+    /**
+     * @brief Reads the records of a snapshot, without ever reading past its end:
+     * after a read that would, ok is false, and every read returns 0.
+     */
+
+    struct Reader {
+        const uint8_t* next;
+        const uint8_t* end;
+        bool ok = true;
+
+        uint32_t get(uint8_t size) {
+            if (end - next < size) {
+                ok = false;
+                return 0;
+            }
+            uint32_t value = 0;
+            for (uint8_t i = 0; i < size; i++) {
+                value |= (uint32_t)next[i] << (8 * i);
+            }
+            next += size;
+            return value;
+        }
+
+        uint8_t get_u8() { return get(1); }
+        uint16_t get_u16() { return get(2); }
+        uint32_t get_u32() { return get(4); }
+
+        String get_string() {
+            uint8_t length = get_u8();
+            if (end - next < length) {
+                ok = false;
+                return "";
+            }
+            String str;
+            str.reserve(length);
+            for (uint8_t i = 0; i < length; i++) {
+                str += (char)next[i];
+            }
+            next += length;
+            return str;
+        }
+    };
+
+    static void put(std::vector<uint8_t>* blob, uint32_t value, uint8_t size) {
+        for (uint8_t i = 0; i < size; i++) {
+            blob->push_back((value >> (8 * i)) & 0xFF);
+        }
+    }
+
+    static void put_string(std::vector<uint8_t>* blob, const String& str) {
+        uint8_t length = str.length() > 255 ? 255 : str.length();
+        blob->push_back(length);
+        blob->insert(blob->end(), str.c_str(), str.c_str() + length);
+    }
+
+    /**
+     * @brief The whole snapshot, with the CRC in the header, and (in alarm_crc) a CRC
+     * of just the alarm part of every record, to tell alarm changes from value changes.
+     */
+
+    template <typename Packets>
+    static void serialize(const Packets& packets, std::vector<uint8_t>* blob, uint32_t* alarm_crc) {
+        blob->clear();
+        put(blob, SNAPSHOT_VERSION, 1);
+        put(blob, packets.size(), 2);
+        put(blob, 0, 4); // the CRC, below
+        *alarm_crc = 0;
+        for (const Packet_t& packet : packets) {
+            put_string(blob, packet.unique_id);
+            put_string(blob, packet.data_source);
+            put_string(blob, packet.data_name);
+            put_string(blob, packet.data_value);
+            put(blob, packet.transmitter_address, 2);
+            size_t alarm_start = blob->size();
+            put(blob, (uint16_t)packet.alarm_code, 2);
+            put(blob, packet.alarm_has_sounded, 1);
+            put(blob, (uint32_t)packet.first_alarm_time, 4);
+            put(blob, packet.alarm_email_interval, 2);
+            put(blob, packet.alarm_emails_sent, 2);
+            put(blob, packet.max_alarm_emails_to_send, 2);
+            *alarm_crc = crc32(*alarm_crc, blob->data() + alarm_start, blob->size() - alarm_start);
+            put(blob, (uint8_t)packet.RSSI, 1);
+            put(blob, (uint8_t)packet.SNR, 1);
+            put(blob, (uint32_t)packet.sequence, 4);
+            alarm_start = blob->size();
+            put(blob, packet.alarm_fsm.state(), 1);
+            put(blob, (uint16_t)packet.alarm_fsm.alarm_code(), 2);
+            put(blob, packet.alarm_rules_broken, 1);
+            *alarm_crc = crc32(*alarm_crc, blob->data() + alarm_start, blob->size() - alarm_start);
+            put(blob, packet.expected_interval_ms, 4);
+        }
+        uint32_t crc = crc32(0, blob->data() + SNAPSHOT_HEADER_SIZE, blob->size() - SNAPSHOT_HEADER_SIZE);
+        for (uint8_t i = 0; i < 4; i++) {
+            (*blob)[3 + i] = (crc >> (8 * i)) & 0xFF;
+        }
+    }
+
+    /**
+     * @brief CRC-32 (the one zlib uses), continuing from crc.
+     */
+
+    static uint32_t crc32(uint32_t crc, const uint8_t* data, size_t length) {
+        crc = ~crc;
+        for (size_t i = 0; i < length; i++) {
+            crc ^= data[i];
+            for (uint8_t bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (0xEDB88320UL & (0 - (crc & 1)));
+            }
+        }
+        return ~crc;
+    }
+
+}; // class PacketSnapshot
+
+#endif // _SNAPSHOT_H_
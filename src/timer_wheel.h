@@ -0,0 +1,152 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <Arduino.h>
+
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)   // per level
+#define TIMER_WHEEL_LEVELS 3
+
+/**
+ * @brief One timer. It's meant to be a member of whatever it times (so scheduling it
+ * never allocates), and it must not move in memory while it's scheduled.
+ */
+
+struct TimerNode {
+    TimerNode* prev = NULL;    // NULL when it isn't scheduled
+    TimerNode* next = NULL;
+    uint32_t expires_tick = 0;
+    void* owner = NULL;        // for the callback
+
+    bool scheduled() const {
+        return prev != NULL;
+    }
+};
+
+typedef void (*timer_callback_t)(TimerNode* timer, void* context);
+
+/**
+ * @brief TimerWheel is a hierarchical timing wheel: TIMER_WHEEL_LEVELS wheels of
+ * TIMER_WHEEL_SLOTS slots each. A slot of the first wheel is one tick, a slot of the second
+ * is a full turn of the first, and so on - with 1 second ticks, the three wheels reach
+ * 64 seconds, 68 minutes and 72 hours. A timer goes into the slot of the coarsest wheel it
+ * needs, and moves to a finer wheel when that wheel's turn comes.
+ *
+ * Scheduling, re-scheduling and cancelling a timer are O(1), whatever the number of timers,
+ * and advance() does only the work of the ticks that passed - there's never a scan of every timer.
+ * Timers longer than the last wheel are shortened to fit it.
+ */
+
+class TimerWheel {
+
+public:
+
+    TimerWheel(uint32_t tick_ms) : tick_ms_{tick_ms} {
+        for (uint8_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            for (uint8_t slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+                slots_[level][slot].prev = &slots_[level][slot];
+                slots_[level][slot].next = &slots_[level][slot];
+            }
+        }
+    }
+
+    /**
+     * @brief (Re)start a timer: it expires delay_ms from the last advance().
+     */
+
+    void schedule(TimerNode* timer, uint32_t delay_ms) {
+        cancel(timer);
+        uint32_t ticks = (delay_ms + tick_ms_ - 1) / tick_ms_;
+        timer->expires_tick = now_tick_ + (ticks > 0 ? ticks : 1);
+        place(timer);
+    }
+
+    void cancel(TimerNode* timer) {
+        if (timer->scheduled()) {
+            timer->prev->next = timer->next;
+            timer->next->prev = timer->prev;
+            timer->prev = NULL;
+            timer->next = NULL;
+        }
+    }
+
+    /**
+     * @brief Move the wheels up to now_ms, and call callback for every timer that expired.
+     * A timer is no longer scheduled when its callback is called, so the callback can schedule it again.
+     */
+
+    void advance(uint32_t now_ms, timer_callback_t callback, void* context) {
+        if (!started_) {
+            started_ = true;
+            last_ms_ = now_ms;
+            return;
+        }
+        uint32_t ticks = (now_ms - last_ms_) / tick_ms_; // works across millis() rollover
+        last_ms_ += ticks * tick_ms_;
+        while (ticks-- > 0) {
+            now_tick_++;
+            // Bring down the timers for the turn that's starting, coarsest wheel first
+            for (uint8_t level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+                if ((now_tick_ & ((1UL << (TIMER_WHEEL_SLOT_BITS * level)) - 1)) == 0) {
+                    cascade(level, slot_of(now_tick_, level));
+                }
+            }
+            TimerNode* head = &slots_[0][slot_of(now_tick_, 0)];
+            while (head->next != head) {
+                TimerNode* timer = head->next;
+                cancel(timer);
+                callback(timer, context);
+            }
+        }
+    }
+
+private:
+    uint32_t tick_ms_;
+    uint32_t now_tick_ = 0;
+    uint32_t last_ms_ = 0;
+    bool started_ = false;
+    TimerNode slots_[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // each is the head of a circular list
+
+    static uint8_t slot_of(uint32_t tick, uint8_t level) {
+        return (tick >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    }
+
+    void place(TimerNode* timer) {
+        uint32_t delta = timer->expires_tick - now_tick_;
+        uint8_t level = 0;
+        while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1UL << (TIMER_WHEEL_SLOT_BITS * (level + 1)))) {
+            level++;
+        }
+        if (delta >= (1UL << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS))) {
+            timer->expires_tick = now_tick_ + (1UL << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1;
+        }
+        TimerNode* head = &slots_[level][slot_of(timer->expires_tick, level)];
+        timer->prev = head->prev;
+        timer->next = head;
+        head->prev->next = timer;
+        head->prev = timer;
+    }
+
+    void cascade(uint8_t level, uint8_t slot) {
+        TimerNode* head = &slots_[level][slot];
+        TimerNode pending;
+        // Take the whole slot first, so timers that land back in it aren't seen twice
+        if (head->next == head) {
+            return;
+        }
+        pending.next = head->next;
+        pending.prev = head->prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        head->next = head;
+        head->prev = head;
+        while (pending.next != &pending) {
+            TimerNode* timer = pending.next;
+            cancel(timer);
+            place(timer);
+        }
+    }
+
+}; // class TimerWheel
+
+#endif // _TIMER_WHEEL_H_
@@ -9,7 +9,7 @@
 #include "DejaVu_Sans_12.h"
 #include "DejaVu_Sans_12_bold.h"
 #include "alarm.h"
-#include "elapsedMillis.h"
+#include "clock.h"
 
 #define SCREEN_WIDTH 128 // OLED display width, in pixels
 #define SCREEN_HEIGHT 128 // OLED display height, in pixels
@@ -35,6 +35,11 @@
 #define SSD1327_VERY_DIM 0x9
 #define SSD1327_DIM 0xd
 
+#define STATUS_LINE_SIZE 22   // 21 characters fit on a line
+
+// Called when post_status() has posted a new status. See set_status_waker().
+typedef void (*status_waker_t)(void* context);
+
 /**
  * @brief UI is the class that controls the display and the alarm. It displays
  * "status info" on the top line, the current date and time on the bottom line,
@@ -51,29 +56,118 @@ private:
     Alarm* alarm_;
     uint8_t buzzer_pin_;
     bool screensaver_on_ = false;
+    // false until prepare_display() has run, splash screen and all. With FAST_BOOT, other
+    // tasks can try to use the display before then, and everything that draws checks this first.
+    volatile bool display_ready_ = false;
+    // The display is drawn on by loop(), the init task and the network tasks. Whoever
+    // draws holds this, from the first pixel to display() - but never while waiting.
+    SemaphoreHandle_t display_mutex_;
+    // The latest status from post_status(), until show_posted_status() shows it
+    char posted_status_[2][STATUS_LINE_SIZE];
+    bool status_posted_ = false;
+    portMUX_TYPE posted_status_lock_ = portMUX_INITIALIZER_UNLOCKED;
+    status_waker_t status_waker_ = NULL;
+    void* status_waker_context_ = NULL;
+    Clock clock_;
+    uint8_t day_start_hour_ = 8;
+    uint8_t day_end_hour_ = 22;
+
+    void lock_display() {
+        xSemaphoreTakeRecursive(display_mutex_, portMAX_DELAY);
+    }
+
+    void unlock_display() {
+        xSemaphoreGiveRecursive(display_mutex_);
+    }
+
+    /**
+     * @brief Draw the top two lines of the OLED, without showing them yet (display() does that).
+     * The display must be locked, like for the clear_...() methods below.
+     */
+
+    void draw_status_lines(const String& status_str, const String& status_str2) {
+        clear_status_area();
+        display_->setTextColor(SSD1327_VERY_DIM);
+        display_->println(status_str);
+        display_->print(status_str2);
+        display_->setTextColor(SSD1327_DIM);
+    }
+
+    /**
+     * @brief Clears the top two lines of the OLED.
+     */
+    void clear_status_area() {
+        // This is how Jim did it, and it works
+        for (int y = 0; y <= line2 + 3; y++) {
+            for (int x = 0; x < 127; x++) {
+                display_->drawPixel(x, y, SSD1327_BLACK);
+            }
+        }
+        // drawFastHLine causes a crash   
+        // display_->drawFastHLine(0, 15, 15, SSD1306_BLACK);
+        display_->setCursor(0, line1); // Ready to print on the first line
+        display_->display();
+    }
+
+    /**
+     * @brief Clear everything BETWEEN the status lines and the bottom line,
+     * then position the cursor to start printing in that area.
+     * 
+     */
+    void clear_packet_area() {
+        for (int y = line2 + 1; y < SCREEN_HEIGHT - 15; y++) {
+            for (int x = 0; x < SCREEN_WIDTH; x++) {
+                display_->drawPixel(x, y, SSD1327_BLACK);
+            }
+        }
+        // this crashes the system
+        // display_->drawFastHLine(line1, 63, 48, SSD1306_BLACK);
+        display_->setCursor(0, line3);
+        display_->display();
+    }
+
+    /**
+     * @brief Clear just the bottom line and set the cursor to the
+     * beginning of that line, ready to print.
+     * 
+     */
+    void clear_bottom_line() {
+        for (int y = line9 - 14; y < SCREEN_HEIGHT; y++) {
+            for (int x = 0; x < SCREEN_WIDTH; x++) {
+                display_->drawPixel(x, y, SSD1327_BLACK);
+            }
+        }
+        display_->setCursor(0, line9);
+        display_->display();
+
+    }
 
 public:
     
-    elapsedMillis screensaver_timer_;
-    
     UI(uint8_t buzzer_pin) : buzzer_pin_{buzzer_pin} {
         display_ = new Adafruit_SSD1327(128, 128, &Wire, OLED_RESET, 1000000);
         alarm_ = new Alarm(buzzer_pin_);
-        // start the screensaver timer now
-        screensaver_timer_ = 0;
+        display_mutex_ = xSemaphoreCreateRecursiveMutex();
     }
 
     void prepare_display() {
+        lock_display();
         if (display_->begin(0x3D)) { // 0x3D if DC wire is connected to VCC, or 0x3C if connected to GND
             Serial.println("OLED successfully started");
         }
         else {
             Serial.println("SSD1327 allocation failed");
+            unlock_display();
+            return;
         }
         display_->setRotation(0); // 2 flips it 180 degrees
         display_->setTextColor(SSD1327_DIM); // 0x0 -> 0xF == black -> white
         display_->setFont(&DejaVu_Sans_12);
+#ifdef SHOW_SPLASH_SCREEN
         display_about_screen();
+#endif
+        display_ready_ = true;
+        unlock_display();
     }
 
     /**
@@ -82,6 +176,10 @@ public:
      */
      
     void display_one_packet(Packet_it_t packet) {
+       if (!display_ready_) {
+           return;
+       }
+       lock_display();
        clear_packet_area();
        display_->setCursor(0, line4);
        display_->print(packet->data_source);
@@ -114,6 +212,7 @@ public:
            display_->print(" **");
        }
        display_->display();
+       unlock_display();
        if (packet->alarm_code && !packet->alarm_has_sounded && its_daytime()) {
            alarm_->sound_alarm(packet->alarm_code);
            packet->alarm_has_sounded = true;
@@ -121,11 +220,13 @@ public:
     }
    
     /**
-     * @brief Displays info about the program 
+     * @brief Displays info about the program. Called by prepare_display(), with the display locked.
     */
    
     void display_about_screen() {
-       update_status_lines(" Jim Booth's", " Boat Monitor");
+       draw_status_lines(" Jim Booth's", " Boat Monitor");
+       display_->display();
+       delay(1000);
        clear_packet_area();
        display_->setCursor(0, line4);
        display_->println(" As modified by");
@@ -152,17 +253,61 @@ public:
     */
 
     void update_status_lines(String status_str, String status_str2, uint8_t duration_seconds = 1, uint8_t temp_font_size = 1) {
-       clear_status_area();
+       if (!display_ready_) {
+           return;
+       }
+       lock_display();
        display_->setTextSize(temp_font_size);
-       display_->setTextColor(SSD1327_VERY_DIM);
-       display_->println(status_str);
-       display_->print(status_str2);
-       display_->setTextColor(SSD1327_DIM);
+       draw_status_lines(status_str, status_str2);
        display_->display();
+       display_->setTextSize(1);
+       unlock_display();
        if (duration_seconds) {
            delay(duration_seconds * 1000);
        }
-       display_->setTextSize(1);
+    }
+
+    /**
+     * @brief Post a new status for the top two lines, from a task that must not wait for the
+     * display, like radio ingest. It's only copied: show_posted_status() draws it, from loop().
+     * If several are posted before then, the latest one is shown.
+     */
+
+    void post_status(const String& status_str, const String& status_str2) {
+        portENTER_CRITICAL(&posted_status_lock_);
+        snprintf(posted_status_[0], STATUS_LINE_SIZE, "%s", status_str.c_str());
+        snprintf(posted_status_[1], STATUS_LINE_SIZE, "%s", status_str2.c_str());
+        status_posted_ = true;
+        portEXIT_CRITICAL(&posted_status_lock_);
+        if (status_waker_ != NULL) {
+            status_waker_(status_waker_context_);
+        }
+    }
+
+    /**
+     * @brief Call waker (with context) every time post_status() posts a status, so the
+     * task that calls show_posted_status() can wake up and show it.
+     */
+
+    void set_status_waker(status_waker_t waker, void* context) {
+        status_waker_ = waker;
+        status_waker_context_ = context;
+    }
+
+    /**
+     * @brief Show the status from post_status(), if there's a new one. Call it from loop().
+     */
+
+    void show_posted_status() {
+        char status[2][STATUS_LINE_SIZE];
+        portENTER_CRITICAL(&posted_status_lock_);
+        bool posted = status_posted_;
+        memcpy(status, posted_status_, sizeof(status));
+        status_posted_ = false;
+        portEXIT_CRITICAL(&posted_status_lock_);
+        if (posted) {
+            update_status_lines(status[0], status[1], 0);
+        }
     }
 
     /**
@@ -172,11 +317,16 @@ public:
      */
 
     void update_bottom_line(String bottom_line_str) {
+        if (!display_ready_) {
+            return;
+        }
+        lock_display();
         clear_bottom_line();
         display_->setTextColor(SSD1327_VERY_DIM);
         display_->print(bottom_line_str);
         display_->setTextColor(SSD1327_DIM);
         display_->display();
+        unlock_display();
     }
 
     /**
@@ -199,55 +349,6 @@ public:
         }
     }
     
-    /**
-     * @brief Clears the top two lines of the OLED.
-     */
-    void clear_status_area() {
-        // This is how Jim did it, and it works
-        for (int y = 0; y <= line2 + 3; y++) {
-            for (int x = 0; x < 127; x++) {
-                display_->drawPixel(x, y, SSD1327_BLACK);
-            }
-        }
-        // drawFastHLine causes a crash   
-        // display_->drawFastHLine(0, 15, 15, SSD1306_BLACK);
-        display_->setCursor(0, line1); // Ready to print on the first line
-        display_->display();
-    }
-
-    /**
-     * @brief Clear everything BETWEEN the status lines and the bottom line,
-     * then position the cursor to start printing in that area.
-     * 
-     */
-    void clear_packet_area() {
-        for (int y = line2 + 1; y < SCREEN_HEIGHT - 15; y++) {
-            for (int x = 0; x < SCREEN_WIDTH; x++) {
-                display_->drawPixel(x, y, SSD1327_BLACK);
-            }
-        }
-        // this crashes the system
-        // display_->drawFastHLine(line1, 63, 48, SSD1306_BLACK);
-        display_->setCursor(0, line3);
-        display_->display();
-    }
-
-    /**
-     * @brief Clear just the bottom line and set the cursor to the
-     * beginning of that line, ready to print.
-     * 
-     */
-    void clear_bottom_line() {
-        for (int y = line9 - 14; y < SCREEN_HEIGHT; y++) {
-            for (int x = 0; x < SCREEN_WIDTH; x++) {
-                display_->drawPixel(x, y, SSD1327_BLACK);
-            }
-        }
-        display_->setCursor(0, line9);
-        display_->display();
-
-    }
-
     /**
      * @brief Turns the whole display black, saving the pixels from burning into
      * the display, or wakes the screen up (with some kind of interrupt). On
@@ -259,8 +360,10 @@ public:
      */
 
     void screensaver(bool b) {
-        if (screensaver_on_ != b) {
+        if (display_ready_ && screensaver_on_ != b) {
+            lock_display();
             display_->oled_command(b ? SSD1327_DISPLAYALLOFF : SSD1327_NORMALDISPLAY);
+            unlock_display();
             screensaver_on_ = b;
         }
     }
@@ -290,10 +393,10 @@ public:
     String date_time_str(tm* tm_to_convert = NULL) {
        struct tm timeinfo;
        if (tm_to_convert == NULL) {
-           if (!getLocalTime(&timeinfo)) {
-               Serial.println("Failed to obtain time");
+           if (!clock_.is_valid()) {
                return "Invalid sys time";
            }
+           timeinfo = clock_.local_time();
        }
        else {
            timeinfo = *tm_to_convert;
@@ -310,48 +413,33 @@ public:
      */
 
     bool system_time_is_valid() {
-        struct tm timeinfo;
-        if (!getLocalTime(&timeinfo)) {
-               Serial.println("Failed to obtain time");
-               update_bottom_line("Invalid sys time");
-               update_status_lines("Invalid sys time", "", 3);
-               return false;
-        }
-        char year_buf[5];
-        strftime(year_buf, sizeof(year_buf), "%G", &timeinfo);
-        String year_string = year_buf;
-        uint16_t year_as_int = year_string.toInt();
-        if (year_as_int > 2022) {
-            return true;
-        }
-        else {
-            return false;
-        }
+        return clock_.is_valid();
+    }
+
+    /**
+     * @brief The wall clock - see clock.h
+     */
+
+    Clock* clock() {
+        return &clock_;
     }
 
     /**
-     * @brief See if it's between 8am and 10pm. Used to determine
-     * if we should sound an alarm.
+     * @brief Set the hours its_daytime() is true: from start_hour up to (not including) end_hour.
+     */
+
+    void set_daytime_hours(uint8_t start_hour, uint8_t end_hour) {
+        day_start_hour_ = start_hour;
+        day_end_hour_ = end_hour;
+    }
+
+    /**
+     * @brief See if it's daytime - between 8am and 10pm, unless set_daytime_hours()
+     * changed that. Used to determine if we should sound an alarm.
      */
 
     bool its_daytime() {
-        struct tm timeinfo;
-        if (!getLocalTime(&timeinfo)) {
-               Serial.println("Failed to obtain time");
-               update_bottom_line("Invalid sys time");
-               update_status_lines("Invalid sys time", "", 3);
-               return false;
-        }
-        char hour_buf[3];
-        strftime(hour_buf, sizeof(hour_buf), "%H", &timeinfo);
-        String hour_string = hour_buf;
-        uint8_t hour_as_int = hour_string.toInt();
-        if (hour_as_int >= 8 && hour_as_int < 22) {
-            return true;
-        }
-        else {
-            return false;
-        }
+        return clock_.hour_is_between(day_start_hour_, day_end_hour_);
     }
 
 
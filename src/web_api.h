@@ -0,0 +1,374 @@
+#ifndef _WEB_API_H_
+#define _WEB_API_H_
+
+#include <Arduino.h>
+#include <WebServer.h>
+#include <WiFi.h>
+#include <map>
+#include <vector>
+#include "config.h"
+#include "packet_list.h"
+#include "metrics.h"
+#include "event_stream.h"
+#include "runtime_config.h"
+
+#define WEB_API_POLL_MS 5       // how often the task looks for a new HTTP request
+#define WEB_API_CHUNK_SIZE 1024 // fragments are sent in chunks of about this many bytes
+#define WEB_API_WIFI_WAIT_MS 1000   // how often the task looks for wifi, before the server starts
+
+/**
+ * @brief WebApi is a small HTTP server on the LAN, so the current readings can be seen
+ * without the OLED or InfluxDB:
+ *
+ *   GET /datapoints  ->  {"uptime_ms":123456,"datapoints":[{"id":"...","source":"Home",
+ *                        "name":"Temp (F)","value":"72.5","alarm":0,"state":"normal",
+ *                        "rssi":-80,"snr":9,"updated_ms":120000}, ...]}
+ *
+ * Each datapoint's JSON is rendered only when its Packet_t::revision changes, and kept. A request
+ * locks PacketList only long enough to render the datapoints that changed, then streams the kept
+ * fragments with chunked encoding, about WEB_API_CHUNK_SIZE bytes at a time - the whole response
+ * is never in memory at once, and ingest never waits for a slow client.
+ *
+ *   GET /metrics     ->  the datapoints and the counters in metrics.h, for Prometheus
+ *   GET /events      ->  every update of a datapoint, as it happens - see event_stream.h
+ *   POST /downlink   ->  queue a command for a transmitter, sent after its next uplink (see downlink.h):
+ *                        address=65001&command=interval&seconds=300
+ *                        address=65001&command=thresholds&name=Water temp&low=33&high=90
+ *                        address=65001&command=read
+ *   POST /settings   ->  change a setting (see runtime_config.h): name=day_end_hour&value=21
+ *                        It's checked here, then set by loop(), which also checks it against
+ *                        the other settings, and prints why on Serial if it doesn't fit.
+ *
+ * It runs in its own task, on NETWORK_TASK_CORE. The fragments are used only by that task.
+ */
+
+class WebApi {
+
+private:
+    WebServer server_{WEB_API_PORT};
+    PacketList* packet_list_;
+    RuntimeConfig* runtime_config_;
+    struct Fragment {
+        uint32_t revision = 0;
+        String json;
+    };
+    std::map<String, Fragment> fragments_;    // keyed by unique_id
+    std::vector<const String*> response_;     // the fragments of the response being sent
+    String chunk_;
+    // For /metrics: the label set of the i-th datapoint in PacketList, rendered the first time it's
+    // seen (the list only ever grows, at the end), and a copy of its numbers, taken under the lock
+    struct MetricsSample {
+        float value;
+        bool numeric;
+        int16_t alarm_code;
+        int8_t RSSI;
+        int8_t SNR;
+        uint32_t timestamp;
+    };
+    std::vector<String> metric_labels_;
+    std::vector<MetricsSample> metric_samples_;
+    uint32_t requests_served_ = 0;
+    EventStream events_;
+
+    void handle_web_api_task() {
+        // lwIP (its tcpip task and netif) is brought up by the first WiFi.begin(), and opening
+        // the listening socket before that can assert ("Invalid mbox"). Once the server is
+        // listening, it keeps listening through reconnects.
+        while (WiFi.status() != WL_CONNECTED) {
+            vTaskDelay(WEB_API_WIFI_WAIT_MS / portTICK_RATE_MS);
+        }
+        server_.begin();
+        Serial.println("HTTP server on port " + String(WEB_API_PORT) + " at " + String(millis()) + " ms");
+        while (1) {
+            server_.handleClient();
+            events_.send_pending();
+            vTaskDelay(WEB_API_POLL_MS / portTICK_RATE_MS);
+        }
+    }
+
+    static void start_web_api_task_impl(void* _this) {
+        static_cast<WebApi*>(_this)->handle_web_api_task();
+    }
+
+    static void append_json_string(String* json, const String& str) {
+        *json += '"';
+        for (size_t i = 0; i < str.length(); i++) {
+            char c = str[i];
+            if (c == '"' || c == '\\') {
+                *json += '\\';
+                *json += c;
+            }
+            else if ((uint8_t)c < 0x20) {
+                char escaped[7];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                *json += escaped;
+            }
+            else {
+                *json += c;
+            }
+        }
+        *json += '"';
+    }
+
+    static void render(const Packet_t& datapoint, String* json) {
+        *json = "{\"id\":";
+        append_json_string(json, datapoint.unique_id);
+        *json += ",\"source\":";
+        append_json_string(json, datapoint.data_source);
+        *json += ",\"name\":";
+        append_json_string(json, datapoint.data_name);
+        *json += ",\"value\":";
+        append_json_string(json, datapoint.data_value);
+        *json += ",\"alarm\":" + String(datapoint.alarm_code);
+        *json += ",\"state\":\"" + String(AlarmFsm::state_name(datapoint.alarm_fsm.state())) + "\"";
+        *json += ",\"rssi\":" + String(datapoint.RSSI);
+        *json += ",\"snr\":" + String(datapoint.SNR);
+        *json += ",\"updated_ms\":" + String(datapoint.timestamp) + "}";
+    }
+
+    /**
+     * @brief Re-render the datapoints that changed since the last request, and list
+     * the fragments to send, in PacketList's order.
+     */
+
+    void refresh_fragments() {
+        response_.clear();
+        packet_list_->lock();
+        for (Packet_it_t it = packet_list_->get_packets_begin(); it != packet_list_->get_packets_end(); ++it) {
+            Fragment& fragment = fragments_[it->unique_id];
+            if (fragment.revision != it->revision || fragment.json.length() == 0) {
+                render(*it, &fragment.json);
+                fragment.revision = it->revision;
+            }
+            response_.push_back(&fragment.json);
+        }
+        packet_list_->unlock();
+    }
+
+    void handle_datapoints() {
+        refresh_fragments();
+        server_.setContentLength(CONTENT_LENGTH_UNKNOWN);
+        server_.send(200, "application/json", "");
+        chunk_ = "{\"uptime_ms\":" + String(millis()) + ",\"datapoints\":[";
+        for (size_t i = 0; i < response_.size(); i++) {
+            if (i > 0) {
+                chunk_ += ',';
+            }
+            chunk_ += *response_[i];
+            if (chunk_.length() >= WEB_API_CHUNK_SIZE) {
+                server_.sendContent(chunk_);
+                chunk_ = "";
+            }
+        }
+        chunk_ += "]}";
+        server_.sendContent(chunk_);
+        server_.sendContent(""); // the last chunk
+        requests_served_++;
+    }
+
+    /**
+     * @brief Allows EventStream::publish() to be PacketList's update listener.
+     */
+
+    static void publish_update_impl(void* _this, const Packet_t& datapoint) {
+        static_cast<WebApi*>(_this)->events_.publish(datapoint);
+    }
+
+    void handle_events() {
+        if (!events_.add_client(server_.client())) {
+            server_.send(503, "text/plain", "Too many /events clients");
+        }
+    }
+
+    static void send_metrics_impl(void* _this, const char* data, size_t length) {
+        static_cast<WebApi*>(_this)->server_.sendContent(data, length);
+    }
+
+    static String render_labels(const Packet_t& datapoint) {
+        char labels[160] = "{id=\"";
+        MetricsWriter::append_label_value(labels, sizeof(labels), datapoint.unique_id.c_str());
+        strncat(labels, "\",source=\"", sizeof(labels) - strlen(labels) - 1);
+        MetricsWriter::append_label_value(labels, sizeof(labels), datapoint.data_source.c_str());
+        strncat(labels, "\",name=\"", sizeof(labels) - strlen(labels) - 1);
+        MetricsWriter::append_label_value(labels, sizeof(labels), datapoint.data_name.c_str());
+        strncat(labels, "\"}", sizeof(labels) - strlen(labels) - 1);
+        return String(labels);
+    }
+
+    /**
+     * @brief Copy the numbers of every datapoint, under the lock. Once the vectors have
+     * grown to the number of datapoints, this allocates nothing.
+     *
+     * @return the number of datapoints
+     */
+
+    size_t sample_datapoints() {
+        size_t count = 0;
+        packet_list_->lock();
+        for (Packet_it_t it = packet_list_->get_packets_begin(); it != packet_list_->get_packets_end(); ++it) {
+            if (count == metric_labels_.size()) {
+                metric_labels_.push_back(render_labels(*it));
+                metric_samples_.push_back(MetricsSample());
+            }
+            MetricsSample& sample = metric_samples_[count++];
+            const char* value = it->data_value.c_str();
+            char* end;
+            sample.value = strtof(value, &end);
+            sample.numeric = end != value && *end == '\0';
+            sample.alarm_code = it->alarm_code;
+            sample.RSSI = it->RSSI;
+            sample.SNR = it->SNR;
+            sample.timestamp = it->timestamp;
+        }
+        packet_list_->unlock();
+        return count;
+    }
+
+    void handle_metrics() {
+        size_t count = sample_datapoints();
+        uint32_t now = millis();
+        server_.setContentLength(CONTENT_LENGTH_UNKNOWN);
+        server_.send(200, "text/plain; version=0.0.4", "");
+        MetricsWriter writer(send_metrics_impl, this);
+        writer.family("lora_datapoint_value", "gauge", "Latest value of the datapoint");
+        for (size_t i = 0; i < count; i++) {
+            if (metric_samples_[i].numeric) {
+                writer.sample("lora_datapoint_value", metric_labels_[i].c_str(), metric_samples_[i].value);
+            }
+        }
+        writer.family("lora_datapoint_alarm_code", "gauge", "Alarm code of the datapoint, 0 for none");
+        for (size_t i = 0; i < count; i++) {
+            writer.sample("lora_datapoint_alarm_code", metric_labels_[i].c_str(), (float)metric_samples_[i].alarm_code);
+        }
+        writer.family("lora_datapoint_rssi_dbm", "gauge", "RSSI of the datapoint's last packet");
+        for (size_t i = 0; i < count; i++) {
+            writer.sample("lora_datapoint_rssi_dbm", metric_labels_[i].c_str(), (float)metric_samples_[i].RSSI);
+        }
+        writer.family("lora_datapoint_snr_db", "gauge", "SNR of the datapoint's last packet");
+        for (size_t i = 0; i < count; i++) {
+            writer.sample("lora_datapoint_snr_db", metric_labels_[i].c_str(), (float)metric_samples_[i].SNR);
+        }
+        writer.family("lora_datapoint_age_seconds", "gauge", "Time since the datapoint's last value");
+        for (size_t i = 0; i < count; i++) {
+            writer.sample("lora_datapoint_age_seconds", metric_labels_[i].c_str(),
+                          (now - metric_samples_[i].timestamp) / 1000.0F);
+        }
+        writer.family("lora_frames_received_total", "counter", "LoRa frames received, from every radio");
+        writer.sample("lora_frames_received_total", NULL, metrics.frames_received);
+        writer.family("lora_frames_parsed_total", "counter", "LoRa frames whose readings were queued");
+        writer.sample("lora_frames_parsed_total", NULL, metrics.frames_parsed);
+        writer.family("lora_parse_errors_total", "counter", "LoRa frames that couldn't be parsed or decoded");
+        writer.sample("lora_parse_errors_total", NULL, metrics.parse_errors);
+        writer.family("lora_duplicate_frames_total", "counter", "LoRa frames dropped as duplicates");
+        writer.sample("lora_duplicate_frames_total", NULL, metrics.duplicate_frames);
+        writer.family("lora_truncated_frames_total", "counter", "LoRa frames with too many readings, cut short");
+        writer.sample("lora_truncated_frames_total", NULL, metrics.truncated_frames);
+        writer.family("lora_unknown_schema_packets_total", "counter", "Binary packets with no schema yet");
+        writer.sample("lora_unknown_schema_packets_total", NULL, packet_list_->unknown_schema_packets());
+        writer.family("lora_queue_dropped_total", "counter", "Packets dropped because a queue lane was full");
+        writer.sample("lora_queue_dropped_total", "{queue=\"new_packet\",lane=\"alarm\"}", queue_drops(new_packet_queue, ALARM_LANE));
+        writer.sample("lora_queue_dropped_total", "{queue=\"new_packet\",lane=\"routine\"}", queue_drops(new_packet_queue, ROUTINE_LANE));
+        writer.sample("lora_queue_dropped_total", "{queue=\"influx\",lane=\"alarm\"}", queue_drops(send_to_influx_queue, ALARM_LANE));
+        writer.sample("lora_queue_dropped_total", "{queue=\"influx\",lane=\"routine\"}", queue_drops(send_to_influx_queue, ROUTINE_LANE));
+        writer.family("lora_influx_points_suppressed_total", "counter", "Values not sent to InfluxDB, inside their deadband");
+        writer.sample("lora_influx_points_suppressed_total", NULL, packet_list_->influx_points_suppressed());
+        writer.family("lora_events_dropped_total", "counter", "/events messages dropped for slow clients");
+        writer.sample("lora_events_dropped_total", NULL, events_.messages_dropped());
+        writer.family("lora_influx_writes_total", "counter", "Writes to InfluxDB");
+        writer.sample("lora_influx_writes_total", "{result=\"ok\"}", metrics.influx_writes_ok);
+        writer.sample("lora_influx_writes_total", "{result=\"failed\"}", metrics.influx_writes_failed);
+        writer.family("lora_mqtt_publishes_total", "counter", "Publishes to the MQTT broker");
+        writer.sample("lora_mqtt_publishes_total", "{result=\"acked\"}", metrics.mqtt_publishes_acked);
+        writer.sample("lora_mqtt_publishes_total", "{result=\"failed\"}", metrics.mqtt_publishes_failed);
+        writer.family("lora_alarm_emails_total", "counter", "Alarm emails");
+        writer.sample("lora_alarm_emails_total", "{result=\"sent\"}", metrics.emails_sent);
+        writer.sample("lora_alarm_emails_total", "{result=\"failed\"}", metrics.emails_failed);
+        writer.flush();
+        server_.sendContent(""); // the last chunk
+    }
+
+    void handle_downlink() {
+        uint32_t address = server_.arg("address").toInt();
+        String command = server_.arg("command");
+        if (address < ADDRESS_RANGE_LOWER || address > ADDRESS_RANGE_UPPER) {
+            server_.send(400, "text/plain", "address must be from " + String(ADDRESS_RANGE_LOWER) + " to "
+                                            + String(ADDRESS_RANGE_UPPER));
+            return;
+        }
+        DownlinkQueue* downlink = packet_list_->downlink();
+        bool queued;
+        if (command == "interval" && server_.arg("seconds").toInt() > 0) {
+            queued = downlink->set_reporting_interval(address, server_.arg("seconds").toInt());
+        }
+        else if (command == "thresholds" && server_.arg("name").length() > 0 && server_.hasArg("low")
+                 && server_.hasArg("high")) {
+            queued = downlink->set_alarm_thresholds(address, server_.arg("name"), server_.arg("low").toFloat(),
+                                                    server_.arg("high").toFloat());
+        }
+        else if (command == "read") {
+            queued = downlink->request_reading(address);
+        }
+        else {
+            server_.send(400, "text/plain", "command must be interval (with seconds), thresholds (with name, low and high) or read");
+            return;
+        }
+        if (!queued) {
+            server_.send(503, "text/plain", "Too many commands waiting for " + String(address));
+            return;
+        }
+        server_.send(202, "text/plain", "Queued - it's sent after the next uplink from " + String(address));
+    }
+
+    /**
+     * @brief Settings are changed only in loop()'s task, so this just checks the setting
+     * and queues it - see RuntimeConfig::post().
+     */
+
+    void handle_settings() {
+        double value;
+        String error;
+        const SettingInfo* info = RuntimeConfig::parse(server_.arg("name"), server_.arg("value"), &value, &error);
+        if (info == NULL) {
+            server_.send(400, "text/plain", error);
+            return;
+        }
+        if (!runtime_config_->post(*info, value)) {
+            server_.send(503, "text/plain", "Too many settings waiting to be set");
+            return;
+        }
+        server_.send(202, "text/plain", "Queued - " + String(info->name) + " is set by loop(), unless it conflicts with another setting");
+    }
+
+public:
+
+    WebApi(PacketList* packet_list, RuntimeConfig* runtime_config)
+        : packet_list_{packet_list}, runtime_config_{runtime_config} {
+        chunk_.reserve(WEB_API_CHUNK_SIZE + 256);
+        packet_list_->set_update_listener(publish_update_impl, this);
+    }
+
+    /**
+     * @brief Start the task that answers the server's requests. It can be called before
+     * there's wifi: the task starts the server once wifi first connects.
+     */
+
+    void start_task() {
+        server_.on("/datapoints", HTTP_GET, [this]() { handle_datapoints(); });
+        server_.on("/metrics", HTTP_GET, [this]() { handle_metrics(); });
+        server_.on("/events", HTTP_GET, [this]() { handle_events(); });
+        server_.on("/downlink", HTTP_POST, [this]() { handle_downlink(); });
+        server_.on("/settings", HTTP_POST, [this]() { handle_settings(); });
+        server_.onNotFound([this]() {
+            server_.send(404, "text/plain", "Try /datapoints, /metrics, /events, POST /downlink or POST /settings");
+        });
+        xTaskCreatePinnedToCore(this->start_web_api_task_impl, "handle_web_api", 8000, this,
+                                HANDLE_WEB_API_PRIORITY, NULL, NETWORK_TASK_CORE);
+    }
+
+    uint32_t requests_served() {
+        return requests_served_;
+    }
+
+}; // class WebApi
+
+#endif // _WEB_API_H_
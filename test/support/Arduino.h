@@ -0,0 +1,119 @@
+#ifndef _FAKE_ARDUINO_H_
+#define _FAKE_ARDUINO_H_
+
+// Just enough of the Arduino core to run the hardware-free parts of src/ on the host,
+// in the [env:native] tests. Time stands still until a test (or delay()) moves it.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <type_traits>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define SERIAL_8N1 0x800001c
+#define IRAM_ATTR
+
+class String : public std::string {
+public:
+    String() {}
+    String(const char* str) : std::string(str != NULL ? str : "") {}
+    String(const std::string& str) : std::string(str) {}
+    explicit String(char c) : std::string(1, c) {}
+    template <typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+    String(T value) : std::string(std::to_string(value)) {}
+    String(double value, unsigned int decimals = 2) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+        assign(buffer);
+    }
+
+    bool startsWith(const String& prefix) const { return compare(0, prefix.size(), prefix) == 0; }
+    bool endsWith(const String& suffix) const {
+        return size() >= suffix.size() && compare(size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+    int indexOf(char c, unsigned int from = 0) const { size_t i = find(c, from); return i == npos ? -1 : (int)i; }
+    int indexOf(const String& str, unsigned int from = 0) const { size_t i = find(str, from); return i == npos ? -1 : (int)i; }
+    String substring(unsigned int from) const { return from < size() ? String(substr(from)) : String(); }
+    String substring(unsigned int from, unsigned int to) const {
+        return from < size() && from < to ? String(substr(from, to - from)) : String();
+    }
+    char charAt(unsigned int i) const { return i < size() ? (*this)[i] : '\0'; }
+    void trim() {
+        size_t first = find_first_not_of(" \t\r\n");
+        if (first == npos) {
+            clear();
+            return;
+        }
+        assign(substr(first, find_last_not_of(" \t\r\n") - first + 1));
+    }
+    long toInt() const { return atol(c_str()); }
+    float toFloat() const { return atof(c_str()); }
+};
+
+inline unsigned long millis() { return fake_millis; }
+inline unsigned long micros() { return fake_millis * 1000UL; }
+inline void delay(unsigned long ms) { fake_millis += ms; }
+inline void pinMode(uint8_t pin, uint8_t mode) {}
+inline void digitalWrite(uint8_t pin, uint8_t value) {}
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            write(buffer[i]);
+        }
+        return size;
+    }
+    size_t print(const std::string& str) { return write((const uint8_t*)str.data(), str.size()); }
+    size_t print(const String& str) { return print((const std::string&)str); }
+    size_t print(const char* str) { return print(std::string(str)); }
+    size_t println(const std::string& str) { return print(str + "\r\n"); }
+    size_t println(const String& str) { return println((const std::string&)str); }
+    size_t println(const char* str) { return println(std::string(str)); }
+    template <typename T> size_t print(T value) { return print(String(value)); }
+    template <typename T> size_t println(T value) { return println(String(value)); }
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+};
+
+/**
+ * @brief The Serial Monitor (and the UARTs). What's printed is thrown away, unless
+ * FAKE_SERIAL_ECHO is defined; nothing is ever received.
+ */
+
+class HardwareSerial : public Stream {
+public:
+    void begin(unsigned long baud, uint32_t config = SERIAL_8N1, int8_t rx_pin = -1, int8_t tx_pin = -1) {}
+    size_t write(uint8_t c) override {
+#ifdef FAKE_SERIAL_ECHO
+        putchar(c);
+#endif
+        return 1;
+    }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    operator bool() { return true; }
+};
+
+inline HardwareSerial Serial;
+inline HardwareSerial Serial1;
+inline HardwareSerial Serial2;
+
+#endif // _FAKE_ARDUINO_H_
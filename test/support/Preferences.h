@@ -0,0 +1,62 @@
+#ifndef _FAKE_PREFERENCES_H_
+#define _FAKE_PREFERENCES_H_
+
+// NVS, kept in memory: what's put in a namespace is there for every Preferences that opens
+// it, until the test clears fake_nvs.
+
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include "Arduino.h"
+
+inline std::map<std::string, std::map<std::string, std::vector<uint8_t>>> fake_nvs;
+
+class Preferences {
+public:
+    bool begin(const char* name, bool read_only = false) {
+        namespace_ = &fake_nvs[name];
+        return true;
+    }
+    void end() { namespace_ = NULL; }
+    bool clear() { namespace_->clear(); return true; }
+    bool isKey(const char* key) { return namespace_->count(key) > 0; }
+
+    size_t putUInt(const char* key, uint32_t value) { return put(key, &value, sizeof(value)); }
+    size_t putUChar(const char* key, uint8_t value) { return put(key, &value, sizeof(value)); }
+    size_t putFloat(const char* key, float value) { return put(key, &value, sizeof(value)); }
+    size_t putBytes(const char* key, const void* value, size_t length) { return put(key, value, length); }
+
+    uint32_t getUInt(const char* key, uint32_t default_value = 0) { return get(key, default_value); }
+    uint8_t getUChar(const char* key, uint8_t default_value = 0) { return get(key, default_value); }
+    float getFloat(const char* key, float default_value = NAN) { return get(key, default_value); }
+    size_t getBytesLength(const char* key) { return isKey(key) ? (*namespace_)[key].size() : 0; }
+    size_t getBytes(const char* key, void* buffer, size_t length) {
+        size_t stored = getBytesLength(key);
+        if (stored == 0 || stored > length) {
+            return 0;
+        }
+        memcpy(buffer, (*namespace_)[key].data(), stored);
+        return stored;
+    }
+
+private:
+    std::map<std::string, std::vector<uint8_t>>* namespace_ = NULL;
+
+    size_t put(const char* key, const void* value, size_t length) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(value);
+        (*namespace_)[key].assign(bytes, bytes + length);
+        return length;
+    }
+
+    template <typename T> T get(const char* key, T default_value) {
+        if (!isKey(key) || (*namespace_)[key].size() != sizeof(T)) {
+            return default_value;
+        }
+        T value;
+        memcpy(&value, (*namespace_)[key].data(), sizeof(T));
+        return value;
+    }
+};
+
+#endif // _FAKE_PREFERENCES_H_
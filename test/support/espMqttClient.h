@@ -0,0 +1,64 @@
+#ifndef _FAKE_ESP_MQTT_CLIENT_H_
+#define _FAKE_ESP_MQTT_CLIENT_H_
+
+#include <Arduino.h>
+#include <functional>
+#include <vector>
+
+namespace espMqttClientTypes {
+enum class DisconnectReason { TCP_DISCONNECTED = 0 };
+}
+
+/**
+ * @brief A stand-in for espMqttClient, for the native tests: publish() only records what
+ * was published, and the test plays the broker, with fire_connect() and fire_publish().
+ */
+
+class espMqttClient {
+
+public:
+    struct Publish {
+        uint16_t packet_id;
+        String topic;
+        String payload;
+        uint8_t qos;
+        bool retain;
+    };
+
+    std::vector<Publish> published;
+    bool is_connected = true;
+    bool refuse_publishes = false;    // publish() returns 0, like a full outbox
+
+    espMqttClient(uint8_t priority = 1, uint8_t core = 1) {}
+
+    espMqttClient& setServer(const char* host, uint16_t port) { return *this; }
+    espMqttClient& setCredentials(const char* user, const char* password) { return *this; }
+    espMqttClient& setClientId(const char* client_id) { return *this; }
+    espMqttClient& setCleanSession(bool clean_session) { return *this; }
+    espMqttClient& setKeepAlive(uint16_t seconds) { return *this; }
+    espMqttClient& onConnect(std::function<void(bool)> callback) { on_connect_ = callback; return *this; }
+    espMqttClient& onDisconnect(std::function<void(espMqttClientTypes::DisconnectReason)> callback) { return *this; }
+    espMqttClient& onPublish(std::function<void(uint16_t)> callback) { on_publish_ = callback; return *this; }
+
+    bool connect() { return true; }
+    bool connected() { return is_connected; }
+
+    uint16_t publish(const char* topic, uint8_t qos, bool retain, const char* payload) {
+        if (refuse_publishes) {
+            return 0;
+        }
+        published.push_back({++next_packet_id_, topic, payload, qos, retain});
+        return next_packet_id_;
+    }
+
+    void fire_connect(bool session_present) { on_connect_(session_present); }
+    void fire_publish(uint16_t packet_id) { on_publish_(packet_id); }
+
+private:
+    std::function<void(bool)> on_connect_;
+    std::function<void(uint16_t)> on_publish_;
+    uint16_t next_packet_id_ = 0;
+
+}; // class espMqttClient
+
+#endif // _FAKE_ESP_MQTT_CLIENT_H_
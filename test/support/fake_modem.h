@@ -0,0 +1,76 @@
+#ifndef _FAKE_MODEM_H_
+#define _FAKE_MODEM_H_
+
+#include <Arduino.h>
+#include <deque>
+#include <vector>
+
+/**
+ * @brief FakeModem is a scripted stand-in for a Reyax LoRa module, for testing ReyaxLoRa
+ * through its Stream constructor. Each expect() gives the reply lines for one command;
+ * when ReyaxLoRa writes that command, its replies become readable. A command nobody
+ * expected gets no reply at all, like a module that's hung. inject() makes a line
+ * readable right away - a "+RCV=" that comes in on its own, for example.
+ */
+
+class FakeModem : public Stream {
+
+public:
+    std::vector<String> sent;       // every command ReyaxLoRa wrote, without "\r\n"
+
+    void expect(const String& command, std::vector<String> reply_lines) {
+        script_.push_back({command, reply_lines});
+    }
+
+    void inject(const String& line) {
+        rx_ += line + "\r\n";
+    }
+
+    // true when every expected command was sent
+    bool script_done() const { return script_.empty(); }
+
+    size_t write(uint8_t c) override {
+        if (c == '\n') {
+            command_received(tx_);
+            tx_ = "";
+        }
+        else if (c != '\r') {
+            tx_ += (char)c;
+        }
+        return 1;
+    }
+
+    int available() override { return rx_.length(); }
+
+    int read() override {
+        if (rx_.empty()) {
+            return -1;
+        }
+        char c = rx_[0];
+        rx_.erase(0, 1);
+        return c;
+    }
+
+private:
+    struct Expectation {
+        String command;
+        std::vector<String> reply_lines;
+    };
+
+    std::deque<Expectation> script_;
+    String tx_ = "";
+    String rx_ = "";
+
+    void command_received(const String& command) {
+        sent.push_back(command);
+        if (!script_.empty() && script_.front().command == command) {
+            for (const String& line : script_.front().reply_lines) {
+                inject(line);
+            }
+            script_.pop_front();
+        }
+    }
+
+}; // class FakeModem
+
+#endif // _FAKE_MODEM_H_
@@ -0,0 +1,29 @@
+#ifndef _FAKE_FREERTOS_H_
+#define _FAKE_FREERTOS_H_
+
+// A single-threaded stand-in for FreeRTOS, for the [env:native] tests: there's one task,
+// nothing ever blocks, and a tick is a millisecond of fake_millis (see ../Arduino.h).
+
+#include <cstdint>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xffffffffUL
+#define portTICK_PERIOD_MS 1
+#define portTICK_RATE_MS 1
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+typedef struct { int unused; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL(mux)
+#define portYIELD_FROM_ISR()
+
+inline uint32_t fake_millis = 0;    // the one clock: millis(), and the tick count
+
+#endif // _FAKE_FREERTOS_H_
@@ -0,0 +1,34 @@
+#ifndef _FAKE_FREERTOS_SEMPHR_H_
+#define _FAKE_FREERTOS_SEMPHR_H_
+
+#include "FreeRTOS.h"
+
+// With one task, a semaphore is just a count: taking one that isn't there fails at once.
+struct FakeSemaphore {
+    int count;
+};
+
+typedef FakeSemaphore* SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex() { return new FakeSemaphore{1}; }
+inline SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() { return new FakeSemaphore{1}; }
+inline SemaphoreHandle_t xSemaphoreCreateBinary() { return new FakeSemaphore{0}; }
+inline void vSemaphoreDelete(SemaphoreHandle_t semaphore) { delete semaphore; }
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+    if (semaphore->count == 0) {
+        return pdFALSE;
+    }
+    semaphore->count--;
+    return pdTRUE;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    semaphore->count++;
+    return pdTRUE;
+}
+
+inline BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t semaphore, TickType_t ticks) { return pdTRUE; }
+inline BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t semaphore) { return pdTRUE; }
+
+#endif // _FAKE_FREERTOS_SEMPHR_H_
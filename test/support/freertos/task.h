@@ -0,0 +1,17 @@
+#ifndef _FAKE_FREERTOS_TASK_H_
+#define _FAKE_FREERTOS_TASK_H_
+
+#include "FreeRTOS.h"
+
+typedef void* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+
+inline int fake_current_task;   // its address is the one task's handle
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return &fake_current_task; }
+inline TickType_t xTaskGetTickCount() { return fake_millis; }
+inline void vTaskDelay(TickType_t ticks) { fake_millis += ticks; }
+inline uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks) { return 0; }
+inline void xTaskNotifyGive(TaskHandle_t task) {}
+
+#endif // _FAKE_FREERTOS_TASK_H_
@@ -0,0 +1,7 @@
+#ifndef _SECRET_CONFIG_H_
+#define _SECRET_CONFIG_H_
+
+// The native tests use the placeholder settings.
+#include "default_config.h"
+
+#endif // _SECRET_CONFIG_H_
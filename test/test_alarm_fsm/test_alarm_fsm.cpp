@@ -0,0 +1,214 @@
+// AlarmFsm (and the hysteresis of AlarmRules), replayed from sequences of values and times: pio test -e native
+
+#include <unity.h>
+#include <Arduino.h>
+#include "alarm_fsm.h"
+#include "alarm_rules.h"
+
+#define RAISE_DWELL_MS 60000
+#define CLEAR_DWELL_MS 300000
+
+/**
+ * @brief One value of a datapoint: its condition at at_ms, and what the state machine
+ * should do with it.
+ */
+
+struct Step {
+    int16_t condition_code;
+    uint32_t at_ms;
+    alarm_state_t state;
+    alarm_event_t event;
+};
+
+void replay(AlarmFsm* fsm, const Step* steps, size_t count, uint32_t raise_dwell_ms = RAISE_DWELL_MS,
+            uint32_t clear_dwell_ms = CLEAR_DWELL_MS) {
+    for (size_t i = 0; i < count; i++) {
+        char message[48];
+        snprintf(message, sizeof(message), "step %u, at %u ms", (unsigned)i, (unsigned)steps[i].at_ms);
+        alarm_event_t event = fsm->update(steps[i].condition_code, raise_dwell_ms, clear_dwell_ms, steps[i].at_ms);
+        TEST_ASSERT_EQUAL_MESSAGE(steps[i].event, event, message);
+        TEST_ASSERT_EQUAL_MESSAGE(steps[i].state, fsm->state(), message);
+    }
+}
+
+#define REPLAY(fsm, steps, ...) replay(fsm, steps, sizeof(steps) / sizeof(steps[0]), ##__VA_ARGS__)
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_raise_waits_for_the_dwell() {
+    AlarmFsm fsm;
+    const Step steps[] = {
+        {0, 0, ALARM_NORMAL, ALARM_NO_CHANGE},
+        {5, 10000, ALARM_PENDING, ALARM_NO_CHANGE},
+        {5, 69999, ALARM_PENDING, ALARM_NO_CHANGE},
+        {5, 70000, ALARM_ACTIVE, ALARM_RAISED},
+        {5, 80000, ALARM_ACTIVE, ALARM_NO_CHANGE},
+    };
+    REPLAY(&fsm, steps);
+    TEST_ASSERT_EQUAL(5, fsm.alarm_code());
+}
+
+void test_blip_shorter_than_the_raise_dwell_is_not_an_alarm() {
+    AlarmFsm fsm;
+    const Step steps[] = {
+        {5, 0, ALARM_PENDING, ALARM_NO_CHANGE},
+        {5, 30000, ALARM_PENDING, ALARM_NO_CHANGE},
+        {0, 50000, ALARM_NORMAL, ALARM_NO_CHANGE},
+        {5, 60000, ALARM_PENDING, ALARM_NO_CHANGE},   // the dwell starts over
+        {5, 110000, ALARM_PENDING, ALARM_NO_CHANGE},
+        {5, 120000, ALARM_ACTIVE, ALARM_RAISED},
+    };
+    REPLAY(&fsm, steps);
+}
+
+void test_zero_raise_dwell_raises_at_once() {
+    AlarmFsm fsm;
+    const Step steps[] = {
+        {7, 1000, ALARM_ACTIVE, ALARM_RAISED},
+    };
+    REPLAY(&fsm, steps, 0);
+    TEST_ASSERT_EQUAL(7, fsm.alarm_code());
+}
+
+void test_clear_waits_for_the_dwell() {
+    AlarmFsm fsm;
+    const Step steps[] = {
+        {5, 0, ALARM_ACTIVE, ALARM_RAISED},
+        {0, 100000, ALARM_CLEARING, ALARM_NO_CHANGE},
+        {0, 399999, ALARM_CLEARING, ALARM_NO_CHANGE},
+        {0, 400000, ALARM_NORMAL, ALARM_CLEARED},
+    };
+    REPLAY(&fsm, steps, 0);
+    TEST_ASSERT_EQUAL(0, fsm.alarm_code());
+}
+
+void test_still_an_alarm_while_clearing() {
+    AlarmFsm fsm;
+    const Step steps[] = {
+        {5, 0, ALARM_ACTIVE, ALARM_RAISED},
+        {0, 1000, ALARM_CLEARING, ALARM_NO_CHANGE},
+    };
+    REPLAY(&fsm, steps, 0);
+    TEST_ASSERT_EQUAL(5, fsm.alarm_code());
+}
+
+void test_condition_back_while_clearing_continues_the_alarm() {
+    AlarmFsm fsm;
+    const Step steps[] = {
+        {5, 0, ALARM_ACTIVE, ALARM_RAISED},
+        {0, 100000, ALARM_CLEARING, ALARM_NO_CHANGE},
+        {5, 200000, ALARM_ACTIVE, ALARM_NO_CHANGE},   // no new ALARM_RAISED
+        {0, 300000, ALARM_CLEARING, ALARM_NO_CHANGE},
+        {0, 599999, ALARM_CLEARING, ALARM_NO_CHANGE}, // the clear dwell started over at 300000
+        {0, 600000, ALARM_NORMAL, ALARM_CLEARED},
+    };
+    REPLAY(&fsm, steps, 0);
+}
+
+void test_zero_clear_dwell_clears_at_once() {
+    AlarmFsm fsm;
+    const Step steps[] = {
+        {5, 0, ALARM_ACTIVE, ALARM_RAISED},
+        {0, 1000, ALARM_NORMAL, ALARM_CLEARED},
+    };
+    REPLAY(&fsm, steps, 0, 0);
+}
+
+void test_stale_alarm_is_raised_at_once_and_ended_by_new_data() {
+    // As PacketList does it: on_stale_data() raises STALE_ALARM_CODE with no raise dwell, and
+    // the next value clears it with no clear dwell.
+    AlarmFsm fsm;
+    const Step stale[] = {
+        {0, 0, ALARM_NORMAL, ALARM_NO_CHANGE},
+        {STALE_ALARM_CODE, 3600000, ALARM_ACTIVE, ALARM_RAISED},
+    };
+    REPLAY(&fsm, stale, 0);
+    TEST_ASSERT_EQUAL(STALE_ALARM_CODE, fsm.alarm_code());
+    const Step new_data[] = {
+        {0, 3700000, ALARM_NORMAL, ALARM_CLEARED},
+    };
+    REPLAY(&fsm, new_data, RAISE_DWELL_MS, 0);
+}
+
+void test_stale_alarm_replaces_a_pending_one() {
+    AlarmFsm fsm;
+    const Step pending[] = {
+        {5, 0, ALARM_PENDING, ALARM_NO_CHANGE},
+    };
+    REPLAY(&fsm, pending);
+    const Step stale[] = {
+        {STALE_ALARM_CODE, 30000, ALARM_ACTIVE, ALARM_RAISED},
+    };
+    REPLAY(&fsm, stale, 0);
+    TEST_ASSERT_EQUAL(STALE_ALARM_CODE, fsm.alarm_code());
+}
+
+// "Pool/Water temp < 33, 2 degrees of hysteresis -> alarm 9", evaluated as PacketList does
+void test_rule_hysteresis_keeps_the_alarm_from_flickering() {
+    static const AlarmRule table[] = {
+        {"Pool", "Water temp", RULE_LESS_THAN, 33.0, 2.0, 0, 9, 60, 3},
+    };
+    AlarmRules rules;
+    rules.load(table, 1);
+    Packet_t datapoint;
+    datapoint.alarm_rules = rules.find_rules("Pool", "Water temp");
+    TEST_ASSERT_NOT_EQUAL(NO_ALARM_RULES, datapoint.alarm_rules);
+    const float values[] = {34.0, 32.9, 33.5, 34.9, 35.0, 33.1, 32.0};
+    const int16_t conditions[] = {0, 9, 9, 9, 0, 0, 9};
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        Packet_t packet;
+        packet.data_value = String(values[i], 1);
+        uint32_t raise_dwell_ms = 0;
+        TEST_ASSERT_EQUAL(conditions[i], rules.evaluate(&packet, datapoint.alarm_rules, &datapoint.alarm_rules_broken,
+                                                        &raise_dwell_ms));
+    }
+}
+
+void test_datapoints_with_the_same_names_have_their_own_hysteresis() {
+    static const AlarmRule table[] = {
+        {"Pool", "Water temp", RULE_LESS_THAN, 33.0, 2.0, 0, 9, 60, 3},
+    };
+    AlarmRules rules;
+    rules.load(table, 1);
+    Packet_t first;      // two transmitters, both sending "Pool" "Water temp"
+    Packet_t second;
+    first.alarm_rules = second.alarm_rules = rules.find_rules("Pool", "Water temp");
+    Packet_t packet;
+    uint32_t raise_dwell_ms = 0;
+    packet.data_value = "32.0";
+    TEST_ASSERT_EQUAL(9, rules.evaluate(&packet, first.alarm_rules, &first.alarm_rules_broken, &raise_dwell_ms));
+    // inside the hysteresis band: still broken for the first, never broken for the second
+    packet.data_value = "34.0";
+    TEST_ASSERT_EQUAL(0, rules.evaluate(&packet, second.alarm_rules, &second.alarm_rules_broken, &raise_dwell_ms));
+    TEST_ASSERT_EQUAL(9, rules.evaluate(&packet, first.alarm_rules, &first.alarm_rules_broken, &raise_dwell_ms));
+}
+
+void test_restore_starts_the_dwell_over() {
+    AlarmFsm fsm;
+    fsm.restore(ALARM_CLEARING, 5, 1000);
+    TEST_ASSERT_EQUAL(5, fsm.alarm_code());
+    const Step steps[] = {
+        {0, 300999, ALARM_CLEARING, ALARM_NO_CHANGE},
+        {0, 301000, ALARM_NORMAL, ALARM_CLEARED},
+    };
+    REPLAY(&fsm, steps);
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_raise_waits_for_the_dwell);
+    RUN_TEST(test_blip_shorter_than_the_raise_dwell_is_not_an_alarm);
+    RUN_TEST(test_zero_raise_dwell_raises_at_once);
+    RUN_TEST(test_clear_waits_for_the_dwell);
+    RUN_TEST(test_still_an_alarm_while_clearing);
+    RUN_TEST(test_condition_back_while_clearing_continues_the_alarm);
+    RUN_TEST(test_zero_clear_dwell_clears_at_once);
+    RUN_TEST(test_stale_alarm_is_raised_at_once_and_ended_by_new_data);
+    RUN_TEST(test_stale_alarm_replaces_a_pending_one);
+    RUN_TEST(test_rule_hysteresis_keeps_the_alarm_from_flickering);
+    RUN_TEST(test_datapoints_with_the_same_names_have_their_own_hysteresis);
+    RUN_TEST(test_restore_starts_the_dwell_over);
+    return UNITY_END();
+}
@@ -0,0 +1,141 @@
+// MqttSink's topics, payloads and in-flight window, against a fake espMqttClient: pio test -e native
+
+#include <unity.h>
+#include <Arduino.h>
+#include "mqtt_sink.h"
+
+espMqttClient* client;
+MqttSink* sink;
+
+Packet_t make_packet(const char* data_source, const char* data_name, const char* data_value) {
+    Packet_t packet;
+    packet.data_source = data_source;
+    packet.data_name = data_name;
+    packet.data_value = data_value;
+    packet.alarm_code = 0;
+    packet.RSSI = -80;
+    packet.SNR = 9;
+    return packet;
+}
+
+// Publish until the window is full
+void fill_window() {
+    Packet_t packet = make_packet("Pool", "Water temp", "80");
+    for (int i = 0; i < MQTT_MAX_IN_FLIGHT; i++) {
+        TEST_ASSERT_TRUE(sink->write(packet));
+    }
+}
+
+void setUp() {
+    client = new espMqttClient();
+    sink = new MqttSink(client);
+    sink->begin();
+    metrics = Metrics();
+}
+
+void tearDown() {
+    delete sink;
+    delete client;
+}
+
+void test_value_topic_and_payload() {
+    Packet_t packet = make_packet("Home", "Temp (F)", "72.5");
+    packet.alarm_code = 3;
+    TEST_ASSERT_TRUE(sink->write(packet));
+    TEST_ASSERT_EQUAL(1, client->published.size());
+    TEST_ASSERT_EQUAL_STRING(MQTT_TOPIC_PREFIX "/Home/Temp (F)", client->published[0].topic.c_str());
+    TEST_ASSERT_EQUAL_STRING("{\"value\":72.5,\"alarm\":3,\"rssi\":-80,\"snr\":9}", client->published[0].payload.c_str());
+    TEST_ASSERT_EQUAL(1, client->published[0].qos);
+    TEST_ASSERT_TRUE(client->published[0].retain);
+}
+
+void test_wildcards_and_slashes_cannot_add_levels() {
+    TEST_ASSERT_TRUE(sink->write(make_packet("Barn/1", "Temp #2+", "1")));
+    TEST_ASSERT_EQUAL_STRING(MQTT_TOPIC_PREFIX "/Barn_1/Temp _2_", client->published[0].topic.c_str());
+}
+
+void test_long_names_are_cut_to_the_topic_size() {
+    std::string long_name(200, 'x');
+    TEST_ASSERT_TRUE(sink->write(make_packet("Pool", long_name.c_str(), "1")));
+    TEST_ASSERT_EQUAL(MQTT_TOPIC_SIZE - 1, client->published[0].topic.length());
+}
+
+void test_aggregate_topic_and_payload() {
+    AggregateWindow window;
+    window.data_source = "Pool";
+    window.data_name = "Pump pressure";
+    window.window_ms = 5 * 60000UL;
+    window.min = 10;
+    window.max = 14;
+    window.sum = 48;
+    window.count = 4;
+    window.last = 11;
+    window.alarm_code = 0;
+    window.RSSI = -90;
+    window.SNR = 3;
+    TEST_ASSERT_TRUE(sink->write_aggregate(window));
+    TEST_ASSERT_EQUAL_STRING(MQTT_TOPIC_PREFIX "/Pool/Pump pressure/5m", client->published[0].topic.c_str());
+    TEST_ASSERT_EQUAL_STRING("{\"min\":10,\"max\":14,\"mean\":12,\"count\":4,\"last\":11,\"alarm\":0,\"rssi\":-90,\"snr\":3}",
+                             client->published[0].payload.c_str());
+}
+
+void test_full_window_waits_for_an_ack_then_drops() {
+    fill_window();
+    uint32_t start_ms = millis();
+    TEST_ASSERT_FALSE(sink->write(make_packet("Pool", "Water temp", "81")));
+    TEST_ASSERT_TRUE(millis() - start_ms >= MQTT_ACK_TIMEOUT_MS);
+    TEST_ASSERT_EQUAL(MQTT_MAX_IN_FLIGHT, client->published.size());
+    TEST_ASSERT_EQUAL(1, metrics.mqtt_publishes_failed);
+}
+
+void test_ack_opens_the_window() {
+    fill_window();
+    client->fire_publish(client->published[0].packet_id);
+    TEST_ASSERT_EQUAL(1, metrics.mqtt_publishes_acked);
+    TEST_ASSERT_TRUE(sink->write(make_packet("Pool", "Water temp", "81")));
+    TEST_ASSERT_FALSE(sink->write(make_packet("Pool", "Water temp", "82")));
+}
+
+void test_full_window_without_a_connection_drops_at_once() {
+    fill_window();
+    client->is_connected = false;
+    uint32_t start_ms = millis();
+    TEST_ASSERT_FALSE(sink->write(make_packet("Pool", "Water temp", "81")));
+    TEST_ASSERT_EQUAL(start_ms, millis());
+}
+
+void test_refused_publish_is_not_in_flight() {
+    client->refuse_publishes = true;
+    for (int i = 0; i < MQTT_MAX_IN_FLIGHT; i++) {
+        TEST_ASSERT_FALSE(sink->write(make_packet("Pool", "Water temp", "80")));
+    }
+    client->refuse_publishes = false;
+    fill_window();
+}
+
+void test_new_session_forgets_what_was_in_flight() {
+    fill_window();
+    client->fire_connect(false);
+    fill_window();
+}
+
+void test_resumed_session_keeps_what_was_in_flight() {
+    fill_window();
+    client->fire_connect(true);
+    TEST_ASSERT_FALSE(sink->write(make_packet("Pool", "Water temp", "81")));
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_value_topic_and_payload);
+    RUN_TEST(test_wildcards_and_slashes_cannot_add_levels);
+    RUN_TEST(test_long_names_are_cut_to_the_topic_size);
+    RUN_TEST(test_aggregate_topic_and_payload);
+    RUN_TEST(test_full_window_waits_for_an_ack_then_drops);
+    RUN_TEST(test_ack_opens_the_window);
+    RUN_TEST(test_full_window_without_a_connection_drops_at_once);
+    RUN_TEST(test_refused_publish_is_not_in_flight);
+    RUN_TEST(test_new_session_forgets_what_was_in_flight);
+    RUN_TEST(test_resumed_session_keeps_what_was_in_flight);
+    return UNITY_END();
+}
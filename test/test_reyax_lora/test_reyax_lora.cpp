@@ -0,0 +1,153 @@
+// The AT command engine of ReyaxLoRa, driven by a scripted fake modem: pio test -e native
+
+#include <unity.h>
+#include <Arduino.h>
+#include "reyax_lora.h"
+#include "fake_modem.h"
+
+FakeModem* modem;
+ReyaxLoRa* lora;
+std::vector<String> received;     // the "+RCV=" lines given to the receive handler
+
+void on_rcv(void* context, const String& rcv_line) {
+    received.push_back(rcv_line);
+}
+
+// The replies to the radio profile in config.h
+void expect_profile(const RadioProfile& profile) {
+    String parameters = String(profile.spread_factor) + "," + String(profile.bandwidth) + ","
+                        + String(profile.coding_rate) + "," + String(profile.preamble);
+    modem->expect("AT+PARAMETER=" + parameters, {"+OK"});
+    modem->expect("AT+BAND=" + String(profile.frequency), {"+OK"});
+    modem->expect("AT+CRFOP=" + String(profile.output_power), {"+OK"});
+    modem->expect("AT+PARAMETER?", {"+PARAMETER=" + parameters});
+    modem->expect("AT+BAND?", {"+BAND=" + String(profile.frequency)});
+    modem->expect("AT+CRFOP?", {"+CRFOP=" + String(profile.output_power)});
+}
+
+void setUp() {
+    modem = new FakeModem();
+    lora = new ReyaxLoRa(modem);
+    lora->set_receive_handler(on_rcv, NULL);
+    received.clear();
+    modem->expect("AT", {"+OK"});
+    modem->expect("AT+VER?", {"+VER=RYLR896_v1.2.7"});
+    modem->expect("AT+NETWORKID?", {"+NETWORKID=15"});
+    modem->expect("AT+ADDRESS?", {"+ADDRESS=65000"});
+    expect_profile(RadioProfile());
+    lora->initialize();
+    TEST_ASSERT_TRUE(modem->script_done());
+    modem->sent.clear();
+}
+
+void tearDown() {
+    delete lora;
+    delete modem;
+}
+
+void test_ok_completes_a_command() {
+    modem->expect("AT+ADDRESS=65000", {"+OK"});
+    String reply;
+    TEST_ASSERT_EQUAL(AT_OK, lora->send_command("AT+ADDRESS=65000", &reply));
+    TEST_ASSERT_EQUAL_STRING("+OK", reply.c_str());
+}
+
+void test_query_gets_its_value() {
+    modem->expect("AT+ADDRESS?", {"+ADDRESS=65000"});
+    String reply;
+    TEST_ASSERT_EQUAL(AT_OK, lora->send_command("AT+ADDRESS?", &reply));
+    TEST_ASSERT_EQUAL_STRING("+ADDRESS=65000", reply.c_str());
+}
+
+void test_reply_to_another_query_is_not_a_match() {
+    modem->expect("AT+ADDRESS?", {"+NETWORKID=15"});
+    TEST_ASSERT_EQUAL(AT_TIMEOUT, lora->send_command("AT+ADDRESS?"));
+}
+
+void test_err_is_an_error() {
+    modem->expect("AT+BAND=1", {"+ERR=4"});
+    String reply;
+    TEST_ASSERT_EQUAL(AT_ERROR, lora->send_command("AT+BAND=1", &reply));
+    TEST_ASSERT_EQUAL_STRING("+ERR=4", reply.c_str());
+}
+
+void test_silent_modem_times_out() {
+    uint32_t start_ms = millis();
+    TEST_ASSERT_EQUAL(AT_TIMEOUT, lora->send_command("AT", NULL, 500));
+    TEST_ASSERT_TRUE(millis() - start_ms > 500);
+    // and the engine isn't stuck: the next command is sent
+    modem->expect("AT", {"+OK"});
+    TEST_ASSERT_EQUAL(AT_OK, lora->send_command("AT"));
+}
+
+void test_rcv_while_a_command_waits() {
+    modem->expect("AT+SEND=1,2,hi", {"+RCV=200,9,Pool%Temp%72.5%0,-80,9", "+OK"});
+    TEST_ASSERT_EQUAL(AT_OK, lora->send_command("AT+SEND=1,2,hi", NULL, AT_SEND_TIMEOUT_MS));
+    TEST_ASSERT_EQUAL(1, received.size());
+    TEST_ASSERT_EQUAL_STRING("+RCV=200,9,Pool%Temp%72.5%0,-80,9", received[0].c_str());
+}
+
+void test_rcv_between_commands() {
+    modem->inject("+RCV=201,9,Shed%Temp%40.1%0,-90,3");
+    lora->poll();
+    TEST_ASSERT_EQUAL(1, received.size());
+}
+
+void test_queued_commands_go_in_order() {
+    TEST_ASSERT_TRUE(lora->queue_command("AT+CRFOP=10"));
+    modem->expect("AT+CRFOP=10", {"+OK"});
+    modem->expect("AT+CRFOP?", {"+CRFOP=10"});
+    TEST_ASSERT_EQUAL(AT_OK, lora->send_command("AT+CRFOP?"));
+    TEST_ASSERT_EQUAL(2, modem->sent.size());
+    TEST_ASSERT_EQUAL_STRING("AT+CRFOP=10", modem->sent[0].c_str());
+}
+
+void test_profile_is_verified() {
+    RadioProfile profile;
+    profile.spread_factor = 12;
+    expect_profile(profile);
+    TEST_ASSERT_TRUE(lora->apply_radio_profile(profile));
+    TEST_ASSERT_TRUE(lora->get_radio_profile() == profile);
+}
+
+void test_profile_not_taken_is_rolled_back() {
+    RadioProfile profile;
+    profile.spread_factor = 12;
+    RadioProfile original;
+    String parameters = "12," + String(profile.bandwidth) + "," + String(profile.coding_rate) + "," + String(profile.preamble);
+    modem->expect("AT+PARAMETER=" + parameters, {"+OK"});
+    modem->expect("AT+BAND=" + String(profile.frequency), {"+OK"});
+    modem->expect("AT+CRFOP=" + String(profile.output_power), {"+OK"});
+    // the LoRa says it's still using the old spread factor
+    modem->expect("AT+PARAMETER?", {"+PARAMETER=9," + String(profile.bandwidth) + "," + String(profile.coding_rate) + "," + String(profile.preamble)});
+    modem->expect("AT+BAND?", {"+BAND=" + String(profile.frequency)});
+    modem->expect("AT+CRFOP?", {"+CRFOP=" + String(profile.output_power)});
+    TEST_ASSERT_FALSE(lora->apply_radio_profile(profile));
+    TEST_ASSERT_TRUE(lora->get_radio_profile() == original);
+    TEST_ASSERT_EQUAL_STRING(("AT+PARAMETER=" + String(original.spread_factor) + "," + String(original.bandwidth) + ","
+                              + String(original.coding_rate) + "," + String(original.preamble)).c_str(),
+                             modem->sent[6].c_str());
+}
+
+void test_invalid_profile_is_not_sent() {
+    RadioProfile profile;
+    profile.spread_factor = 13;
+    TEST_ASSERT_FALSE(lora->apply_radio_profile(profile));
+    TEST_ASSERT_EQUAL(0, modem->sent.size());
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_ok_completes_a_command);
+    RUN_TEST(test_query_gets_its_value);
+    RUN_TEST(test_reply_to_another_query_is_not_a_match);
+    RUN_TEST(test_err_is_an_error);
+    RUN_TEST(test_silent_modem_times_out);
+    RUN_TEST(test_rcv_while_a_command_waits);
+    RUN_TEST(test_rcv_between_commands);
+    RUN_TEST(test_queued_commands_go_in_order);
+    RUN_TEST(test_profile_is_verified);
+    RUN_TEST(test_profile_not_taken_is_rolled_back);
+    RUN_TEST(test_invalid_profile_is_not_sent);
+    return UNITY_END();
+}
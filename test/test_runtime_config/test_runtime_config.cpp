@@ -0,0 +1,198 @@
+// RuntimeConfig: set, load and defaults, through an in-memory NVS: pio test -e native
+
+#include <unity.h>
+#include <Arduino.h>
+#include <Preferences.h>
+#include "runtime_config.h"
+
+static int notifications;
+static int wakes;
+
+void count_notification(void* context, const RuntimeSettings& settings) {
+    notifications++;
+}
+
+void count_wake(void* context) {
+    wakes++;
+}
+
+bool saved(const char* name) {
+    Preferences preferences;
+    preferences.begin(RUNTIME_CONFIG_NAMESPACE, true);
+    bool is_key = preferences.isKey(name);
+    preferences.end();
+    return is_key;
+}
+
+void setUp() {
+    fake_nvs.clear();
+    notifications = 0;
+    wakes = 0;
+}
+
+void tearDown() {}
+
+void test_set_is_saved_and_loaded_back() {
+    RuntimeConfig config;
+    config.load();
+    TEST_ASSERT_TRUE(config.set("bme280_ms", "20000"));
+    TEST_ASSERT_TRUE(config.set("low_temp", "35.5"));
+    TEST_ASSERT_TRUE(config.set("day_end_hour", "21"));
+    RuntimeConfig rebooted;
+    rebooted.load();
+    TEST_ASSERT_EQUAL_UINT32(20000, rebooted.settings().bme280_ms);
+    TEST_ASSERT_EQUAL_FLOAT(35.5F, rebooted.settings().low_temp);
+    TEST_ASSERT_EQUAL_UINT8(21, rebooted.settings().day_end_hour);
+    TEST_ASSERT_EQUAL_UINT32(RuntimeSettings().display_ms, rebooted.settings().display_ms);
+}
+
+void test_set_tells_the_subscribers() {
+    RuntimeConfig config;
+    config.load();
+    config.subscribe(count_notification);
+    TEST_ASSERT_TRUE(config.set("display_ms", "5000"));
+    TEST_ASSERT_FALSE(config.set("display_ms", "0"));
+    TEST_ASSERT_EQUAL(1, notifications);
+}
+
+void test_value_must_be_all_number() {
+    RuntimeConfig config;
+    config.load();
+    const char* bad_values[] = {"abc", "", "12abc", "1e3", "5.5", " ", "0x10"};
+    for (const char* value : bad_values) {
+        TEST_ASSERT_FALSE_MESSAGE(config.set("day_start_hour", value), value);
+    }
+    TEST_ASSERT_EQUAL_UINT8(8, config.settings().day_start_hour);
+    TEST_ASSERT_FALSE(saved("day_start_hour"));
+    TEST_ASSERT_FALSE(config.set("low_temp", "cold"));
+    TEST_ASSERT_TRUE(config.set("low_temp", "1e1"));
+    TEST_ASSERT_EQUAL_FLOAT(10.0F, config.settings().low_temp);
+}
+
+void test_value_must_be_in_range() {
+    RuntimeConfig config;
+    config.load();
+    TEST_ASSERT_FALSE(config.set("day_start_hour", "24"));
+    TEST_ASSERT_FALSE(config.set("day_start_hour", "-1"));
+    TEST_ASSERT_FALSE(config.set("bme280_ms", "9999"));
+    TEST_ASSERT_TRUE(config.set("bme280_ms", "86400000"));
+    TEST_ASSERT_EQUAL_UINT32(86400000, config.settings().bme280_ms);
+    TEST_ASSERT_FALSE(config.set("no_such_setting", "1"));
+}
+
+void test_day_start_must_be_before_day_end() {
+    RuntimeConfig config;
+    config.load();
+    TEST_ASSERT_FALSE(config.set("day_start_hour", "22"));
+    TEST_ASSERT_FALSE(config.set("day_end_hour", "8"));
+    TEST_ASSERT_FALSE(config.set("day_end_hour", "3"));
+    TEST_ASSERT_EQUAL_UINT8(8, config.settings().day_start_hour);
+    TEST_ASSERT_EQUAL_UINT8(22, config.settings().day_end_hour);
+    TEST_ASSERT_TRUE(config.set("day_start_hour", "21"));
+}
+
+void test_low_threshold_must_be_below_high() {
+    RuntimeConfig config;
+    config.load();
+    String high = String(config.settings().high_temp, 2);
+    TEST_ASSERT_FALSE(config.set("low_temp", high));
+    TEST_ASSERT_FALSE(config.set("high_pressure", "20"));
+    TEST_ASSERT_FALSE(config.set("low_humidity", "100"));
+    TEST_ASSERT_FALSE(saved("low_temp"));
+}
+
+void test_defaults_clears_what_was_saved() {
+    RuntimeConfig config;
+    config.load();
+    config.subscribe(count_notification);
+    TEST_ASSERT_TRUE(config.set("screensaver_ms", "60000"));
+    config.reset_to_defaults();
+    TEST_ASSERT_EQUAL_UINT32(RuntimeSettings().screensaver_ms, config.settings().screensaver_ms);
+    TEST_ASSERT_EQUAL(2, notifications);
+    RuntimeConfig rebooted;
+    rebooted.load();
+    TEST_ASSERT_EQUAL_UINT32(RuntimeSettings().screensaver_ms, rebooted.settings().screensaver_ms);
+    TEST_ASSERT_FALSE(saved("screensaver_ms"));
+}
+
+void test_load_ignores_another_version() {
+    Preferences preferences;
+    preferences.begin(RUNTIME_CONFIG_NAMESPACE, false);
+    preferences.putUInt("version", RUNTIME_CONFIG_VERSION + 1);
+    preferences.putUInt("bme280_ms", 20000);
+    preferences.end();
+    RuntimeConfig config;
+    config.load();
+    TEST_ASSERT_EQUAL_UINT32(RuntimeSettings().bme280_ms, config.settings().bme280_ms);
+    TEST_ASSERT_FALSE(saved("bme280_ms"));
+}
+
+void test_load_ignores_conflicting_settings() {
+    Preferences preferences;
+    preferences.begin(RUNTIME_CONFIG_NAMESPACE, false);
+    preferences.putUInt("version", RUNTIME_CONFIG_VERSION);
+    preferences.putUChar("day_start_hour", 23);
+    preferences.putUChar("day_end_hour", 5);
+    preferences.end();
+    RuntimeConfig config;
+    config.load();
+    TEST_ASSERT_EQUAL_UINT8(8, config.settings().day_start_hour);
+    TEST_ASSERT_EQUAL_UINT8(22, config.settings().day_end_hour);
+    TEST_ASSERT_FALSE(saved("day_start_hour"));
+}
+
+void test_posted_setting_waits_for_apply_posted() {
+    RuntimeConfig config;
+    config.load();
+    config.set_post_waker(count_wake, NULL);
+    double value;
+    String error;
+    const SettingInfo* info = RuntimeConfig::parse("day_end_hour", "20", &value, &error);
+    TEST_ASSERT_NOT_NULL(info);
+    TEST_ASSERT_TRUE(config.post(*info, value));
+    TEST_ASSERT_EQUAL(1, wakes);
+    TEST_ASSERT_EQUAL_UINT8(22, config.settings().day_end_hour);
+    config.apply_posted();
+    TEST_ASSERT_EQUAL_UINT8(20, config.settings().day_end_hour);
+    TEST_ASSERT_TRUE(saved("day_end_hour"));
+}
+
+void test_parse_explains_what_is_wrong() {
+    double value;
+    String error;
+    TEST_ASSERT_NULL(RuntimeConfig::parse("day_end_hour", "late", &value, &error));
+    TEST_ASSERT_TRUE(error.startsWith("day_end_hour must be a whole number"));
+    TEST_ASSERT_NULL(RuntimeConfig::parse("bedtime", "21", &value, &error));
+    TEST_ASSERT_EQUAL_STRING("No setting called bedtime", error.c_str());
+}
+
+void test_post_queue_is_bounded() {
+    RuntimeConfig config;
+    config.load();
+    double value;
+    String error;
+    const SettingInfo* info = RuntimeConfig::parse("display_ms", "4000", &value, &error);
+    for (int i = 0; i < SETTINGS_QUEUE_LENGTH; i++) {
+        TEST_ASSERT_TRUE(config.post(*info, value));
+    }
+    TEST_ASSERT_FALSE(config.post(*info, value));
+    config.apply_posted();
+    TEST_ASSERT_TRUE(config.post(*info, value));
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_set_is_saved_and_loaded_back);
+    RUN_TEST(test_set_tells_the_subscribers);
+    RUN_TEST(test_value_must_be_all_number);
+    RUN_TEST(test_value_must_be_in_range);
+    RUN_TEST(test_day_start_must_be_before_day_end);
+    RUN_TEST(test_low_threshold_must_be_below_high);
+    RUN_TEST(test_defaults_clears_what_was_saved);
+    RUN_TEST(test_load_ignores_another_version);
+    RUN_TEST(test_load_ignores_conflicting_settings);
+    RUN_TEST(test_posted_setting_waits_for_apply_posted);
+    RUN_TEST(test_parse_explains_what_is_wrong);
+    RUN_TEST(test_post_queue_is_bounded);
+    return UNITY_END();
+}